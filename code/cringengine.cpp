@@ -7,6 +7,7 @@
 #include <ext/quaternion_float.hpp>
 #include <ext/quaternion_transform.hpp>
 #include <gtc/matrix_transform.hpp>
+#include <gtc/packing.hpp>
 using glm::vec2;
 using glm::vec3;
 using glm::vec4;
@@ -15,12 +16,33 @@ using glm::mat3;
 using glm::mat4;
 using glm::quat;
 
+void* CountedRealloc(void* Memory, size_t Size);
+void CountedFree(void* Memory);
+#define FAST_OBJ_REALLOC CountedRealloc
+#define FAST_OBJ_FREE CountedFree
 #define FAST_OBJ_IMPLEMENTATION
 #include <fast_obj.h>
 #include <meshoptimizer.h>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
 
 #include <stdio.h>
+#include <float.h>
+#include <inttypes.h>
 #include <vector>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <random>
+
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 #define ArrayCount(Arr) (sizeof(Arr)/sizeof((Arr)[0]))
 #define Assert(Expr) if(!(Expr)) { *(int *)0 = 0; }
@@ -31,7 +53,8 @@ using glm::quat;
 					Assert(Result == VK_SUCCESS); \
 				}
 
-VkInstance CreateInstance()
+// Headless runs need neither the window system extensions nor, on farm machines, the validation layer
+VkInstance CreateInstance(bool bHeadless, bool bValidation)
 {
 	VkApplicationInfo AppInfo = { VK_STRUCTURE_TYPE_APPLICATION_INFO };
 	AppInfo.pApplicationName = "Cringengine";
@@ -40,9 +63,13 @@ VkInstance CreateInstance()
 	AppInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
 	AppInfo.apiVersion = VK_API_VERSION_1_2;
 
-	uint32_t GLFWExtensionCount;
-	const char** GLFWExtensions = glfwGetRequiredInstanceExtensions(&GLFWExtensionCount);
-	std::vector<const char*> Extensions(GLFWExtensions, GLFWExtensions + GLFWExtensionCount);
+	std::vector<const char*> Extensions;
+	if (!bHeadless)
+	{
+		uint32_t GLFWExtensionCount;
+		const char** GLFWExtensions = glfwGetRequiredInstanceExtensions(&GLFWExtensionCount);
+		Extensions.assign(GLFWExtensions, GLFWExtensions + GLFWExtensionCount);
+	}
 
 	VkInstanceCreateInfo CreateInfo = { VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO };
 	CreateInfo.pApplicationInfo = &AppInfo;
@@ -53,8 +80,11 @@ VkInstance CreateInstance()
 	{
 		"VK_LAYER_KHRONOS_validation"
 	};
-	CreateInfo.enabledLayerCount = ArrayCount(ValidationLayers);
-	CreateInfo.ppEnabledLayerNames = ValidationLayers;
+	if (bValidation)
+	{
+		CreateInfo.enabledLayerCount = ArrayCount(ValidationLayers);
+		CreateInfo.ppEnabledLayerNames = ValidationLayers;
+	}
 
 	VkInstance Instance = 0;
 	VkCheck(vkCreateInstance(&CreateInfo, 0, &Instance));
@@ -84,7 +114,7 @@ bool SupportsPresentation(VkInstance Instance, VkPhysicalDevice PhysicalDevices,
 	return Result;
 }
 
-VkPhysicalDevice PickPhysicalDevice(VkInstance Instance)
+VkPhysicalDevice PickPhysicalDevice(VkInstance Instance, bool bHeadless)
 {
 	uint32_t PhysicalDeviceCount = 0;
 	VkCheck(vkEnumeratePhysicalDevices(Instance, &PhysicalDeviceCount, 0));
@@ -105,7 +135,7 @@ VkPhysicalDevice PickPhysicalDevice(VkInstance Instance)
 		if (GraphicsFamilyIndex == VK_QUEUE_FAMILY_IGNORED)
 			continue;
 
-		if (!SupportsPresentation(Instance, PhysicalDevices[I], GraphicsFamilyIndex))
+		if (!bHeadless && !SupportsPresentation(Instance, PhysicalDevices[I], GraphicsFamilyIndex))
 			continue;
 
 		if (!Discrete && (Properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU))
@@ -134,7 +164,31 @@ VkPhysicalDevice PickPhysicalDevice(VkInstance Instance)
 	return PhysicalDevice;
 }
 
-VkDevice CreateDevice(VkPhysicalDevice PhysicalDevice, uint32_t FamilyIndex)
+// Cull shader compacts draw commands with subgroup ballots when the device can run them in compute
+bool SupportsSubgroupCompaction(VkPhysicalDevice PhysicalDevice)
+{
+	VkPhysicalDeviceSubgroupProperties SubgroupProperties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES };
+	VkPhysicalDeviceProperties2 Properties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2 };
+	Properties.pNext = &SubgroupProperties;
+	vkGetPhysicalDeviceProperties2(PhysicalDevice, &Properties);
+
+	VkSubgroupFeatureFlags RequiredOperations = VK_SUBGROUP_FEATURE_BASIC_BIT | VK_SUBGROUP_FEATURE_BALLOT_BIT;
+	bool bResult = (SubgroupProperties.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) && ((SubgroupProperties.supportedOperations & RequiredOperations) == RequiredOperations);
+
+	printf("Subgroup size: %d, ballot compaction: %s\n", SubgroupProperties.subgroupSize, bResult ? "ON" : "OFF");
+
+	return bResult;
+}
+
+bool SupportsPipelineStatistics(VkPhysicalDevice PhysicalDevice)
+{
+	VkPhysicalDeviceFeatures Features = {};
+	vkGetPhysicalDeviceFeatures(PhysicalDevice, &Features);
+
+	return Features.pipelineStatisticsQuery == VK_TRUE;
+}
+
+VkDevice CreateDevice(VkPhysicalDevice PhysicalDevice, uint32_t FamilyIndex, bool bHeadless, bool bPipelineStatistics)
 {
 	VkDeviceQueueCreateInfo QueueCreateInfo = { VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO };
 	QueueCreateInfo.queueFamilyIndex = FamilyIndex;
@@ -149,6 +203,7 @@ VkDevice CreateDevice(VkPhysicalDevice PhysicalDevice, uint32_t FamilyIndex)
 
 	VkPhysicalDeviceFeatures DeviceFeatures = {};
 	DeviceFeatures.multiDrawIndirect = true;
+	DeviceFeatures.pipelineStatisticsQuery = bPipelineStatistics;
 
 	VkPhysicalDeviceVulkan12Features DeviceFeatures12 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES };
 	DeviceFeatures12.drawIndirectCount = true;
@@ -157,7 +212,7 @@ VkDevice CreateDevice(VkPhysicalDevice PhysicalDevice, uint32_t FamilyIndex)
 	CreateInfo.pNext = &DeviceFeatures12;
 	CreateInfo.queueCreateInfoCount = 1;
 	CreateInfo.pQueueCreateInfos = &QueueCreateInfo;
-	CreateInfo.enabledExtensionCount = ArrayCount(Extensions);
+	CreateInfo.enabledExtensionCount = bHeadless ? 0 : ArrayCount(Extensions);
 	CreateInfo.ppEnabledExtensionNames = Extensions;
 	CreateInfo.pEnabledFeatures = &DeviceFeatures;
 
@@ -185,6 +240,12 @@ VkBool32 SurfaceSupportsPresentation(VkPhysicalDevice PhysicalDevice, uint32_t F
 	return SupportsPresentation;
 }
 
+// Captures are read back as 8 bit RGBA or BGRA only
+bool IsCaptureFormat(VkFormat Format)
+{
+	return (Format == VK_FORMAT_R8G8B8A8_UNORM) || (Format == VK_FORMAT_R8G8B8A8_SRGB) || (Format == VK_FORMAT_B8G8R8A8_UNORM) || (Format == VK_FORMAT_B8G8R8A8_SRGB);
+}
+
 VkFormat GetSwapchainFormat(VkPhysicalDevice PhysicalDevice, VkSurfaceKHR Surface)
 {
 	uint32_t FormatsCount = 0;
@@ -221,26 +282,27 @@ VkFormat FindDepthFormat(VkPhysicalDevice PhysicalDevice)
 	return VK_FORMAT_UNDEFINED;
 }
 
-VkRenderPass CreateRenderPass(VkDevice Device, VkFormat ColorFormat, VkFormat DepthFormat)
+// Late pass render pass loads what the early pass has drawn instead of clearing it
+VkRenderPass CreateRenderPass(VkDevice Device, VkFormat ColorFormat, VkFormat DepthFormat, bool bLatePass = false)
 {
 	VkAttachmentDescription Attachments[2] = {};
 
 	Attachments[0].format = ColorFormat;
 	Attachments[0].samples = VK_SAMPLE_COUNT_1_BIT;
-	Attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	Attachments[0].loadOp = bLatePass ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
 	Attachments[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
 	Attachments[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 	Attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-	Attachments[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	Attachments[0].initialLayout = bLatePass ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED;
 	Attachments[0].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 
 	Attachments[1].format = DepthFormat;
 	Attachments[1].samples = VK_SAMPLE_COUNT_1_BIT;
-	Attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	Attachments[1].loadOp = bLatePass ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
 	Attachments[1].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
 	Attachments[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 	Attachments[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-	Attachments[1].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	Attachments[1].initialLayout = bLatePass ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED;
 	Attachments[1].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
 
 	VkAttachmentReference ColorAttachment = { 0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL };
@@ -363,9 +425,11 @@ uint32_t GetMipsCount(uint32_t Width, uint32_t Height)
 	return MipsCount;
 }
 
+// Headless runs have no VkSwapchain, they render into one offscreen color image instead
 struct SSwapchain
 {
 	VkSwapchainKHR VkSwapchain;
+	SImage OffscreenImage;
 	std::vector<VkImage> Images;
 	std::vector<VkImageView> ImageViews;
 	std::vector<VkFramebuffer> Framebuffers;
@@ -378,6 +442,7 @@ struct SSwapchain
 	std::vector<VkImageView> DepthMipViews;
 
 	uint32_t Width, Height;
+	bool bCapturable; // Color images can be copied from and have a format captures can read back
 };
 
 VkSwapchainKHR CreateSwapchain(VkDevice Device, VkPhysicalDevice PhysicalDevice, VkSurfaceKHR Surface, VkFormat Format, const VkSurfaceCapabilitiesKHR& SurfaceCaps, VkSwapchainKHR OldSwapchain = 0)
@@ -394,7 +459,7 @@ VkSwapchainKHR CreateSwapchain(VkDevice Device, VkPhysicalDevice PhysicalDevice,
 	CreateInfo.imageColorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR;
 	CreateInfo.imageExtent = SurfaceCaps.currentExtent;
 	CreateInfo.imageArrayLayers = 1;
-	CreateInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+	CreateInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | (SurfaceCaps.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
 	CreateInfo.preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR;
 	CreateInfo.compositeAlpha = CompositeAlpha;
 	CreateInfo.presentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;//VK_PRESENT_MODE_FIFO_KHR;
@@ -406,21 +471,10 @@ VkSwapchainKHR CreateSwapchain(VkDevice Device, VkPhysicalDevice PhysicalDevice,
 	return Swapchain;
 }
 
-SSwapchain CreateSwapchain(VkDevice Device, VkPhysicalDevice PhysicalDevice, VkSurfaceKHR Surface, VkFormat ColorFormat, VkFormat DepthFormat, VkRenderPass RenderPass, VmaAllocator MemoryAllocator, VkSwapchainKHR OldSwapchain = 0)
+// Views, framebuffers, depth and HiZ targets for the given color images
+void CreateSwapchainTargets(SSwapchain& Swapchain, VkDevice Device, VkFormat ColorFormat, VkFormat DepthFormat, VkRenderPass RenderPass, VmaAllocator MemoryAllocator, const std::vector<VkImage>& Images, uint32_t Width, uint32_t Height)
 {
-	SSwapchain Swapchain = {};
-
-	VkSurfaceCapabilitiesKHR SurfaceCaps;
-	VkCheck(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(PhysicalDevice, Surface, &SurfaceCaps));
-
-	Swapchain.VkSwapchain = CreateSwapchain(Device, PhysicalDevice, Surface, ColorFormat, SurfaceCaps, OldSwapchain);
-	Assert(Swapchain.VkSwapchain);
-
-	uint32_t ImageCount = 0;
-	VkCheck(vkGetSwapchainImagesKHR(Device, Swapchain.VkSwapchain, &ImageCount, 0));
-
-	std::vector<VkImage> Images(ImageCount);
-	VkCheck(vkGetSwapchainImagesKHR(Device, Swapchain.VkSwapchain, &ImageCount, Images.data()));
+	uint32_t ImageCount = (uint32_t)Images.size();
 
 	std::vector<VkImageView> ImageViews(ImageCount);
 	for (uint32_t I = 0; I < ImageCount; I++)
@@ -428,11 +482,11 @@ SSwapchain CreateSwapchain(VkDevice Device, VkPhysicalDevice PhysicalDevice, VkS
 		ImageViews[I] = CreateImageView(Device, Images[I], ColorFormat, 0, 1, VK_IMAGE_ASPECT_COLOR_BIT);
 	}
 
-	SImage DepthImage = CreateImage(Device, MemoryAllocator, DepthFormat, SurfaceCaps.currentExtent.width, SurfaceCaps.currentExtent.height, 1, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
+	SImage DepthImage = CreateImage(Device, MemoryAllocator, DepthFormat, Width, Height, 1, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
 	VkImageView DepthImageView = CreateImageView(Device, DepthImage.Image, DepthFormat, 0, 1, VK_IMAGE_ASPECT_DEPTH_BIT);
 
-	uint32_t DepthMipsCount = GetMipsCount(SurfaceCaps.currentExtent.width, SurfaceCaps.currentExtent.height) - 1;
-	SImage DepthMipsImage = CreateImage(Device, MemoryAllocator, VK_FORMAT_R32_SFLOAT, SurfaceCaps.currentExtent.width >> 1, SurfaceCaps.currentExtent.height >> 1, DepthMipsCount, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
+	uint32_t DepthMipsCount = GetMipsCount(Width, Height) - 1;
+	SImage DepthMipsImage = CreateImage(Device, MemoryAllocator, VK_FORMAT_R32_SFLOAT, Width >> 1, Height >> 1, DepthMipsCount, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
 	
 	VkImageView DepthMipView = CreateImageView(Device, DepthMipsImage.Image, VK_FORMAT_R32_SFLOAT, 0, VK_REMAINING_MIP_LEVELS, VK_IMAGE_ASPECT_COLOR_BIT);
 
@@ -451,8 +505,8 @@ SSwapchain CreateSwapchain(VkDevice Device, VkPhysicalDevice PhysicalDevice, VkS
 		CreateInfo.renderPass = RenderPass;
 		CreateInfo.attachmentCount = ArrayCount(Attachments);
 		CreateInfo.pAttachments = Attachments;
-		CreateInfo.width = SurfaceCaps.currentExtent.width;
-		CreateInfo.height = SurfaceCaps.currentExtent.height;
+		CreateInfo.width = Width;
+		CreateInfo.height = Height;
 		CreateInfo.layers = 1;
 
 		VkCheck(vkCreateFramebuffer(Device, &CreateInfo, 0, &Framebuffers[I]));
@@ -466,8 +520,41 @@ SSwapchain CreateSwapchain(VkDevice Device, VkPhysicalDevice PhysicalDevice, VkS
 	Swapchain.DepthMipsImage = DepthMipsImage;
 	Swapchain.DepthMipView = DepthMipView;
 	Swapchain.DepthMipViews = DepthMipViews;
-	Swapchain.Width = SurfaceCaps.currentExtent.width;
-	Swapchain.Height = SurfaceCaps.currentExtent.height;
+	Swapchain.Width = Width;
+	Swapchain.Height = Height;
+}
+
+SSwapchain CreateSwapchain(VkDevice Device, VkPhysicalDevice PhysicalDevice, VkSurfaceKHR Surface, VkFormat ColorFormat, VkFormat DepthFormat, VkRenderPass RenderPass, VmaAllocator MemoryAllocator, VkSwapchainKHR OldSwapchain = 0)
+{
+	SSwapchain Swapchain = {};
+
+	VkSurfaceCapabilitiesKHR SurfaceCaps;
+	VkCheck(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(PhysicalDevice, Surface, &SurfaceCaps));
+
+	Swapchain.VkSwapchain = CreateSwapchain(Device, PhysicalDevice, Surface, ColorFormat, SurfaceCaps, OldSwapchain);
+	Assert(Swapchain.VkSwapchain);
+
+	uint32_t ImageCount = 0;
+	VkCheck(vkGetSwapchainImagesKHR(Device, Swapchain.VkSwapchain, &ImageCount, 0));
+
+	std::vector<VkImage> Images(ImageCount);
+	VkCheck(vkGetSwapchainImagesKHR(Device, Swapchain.VkSwapchain, &ImageCount, Images.data()));
+
+	CreateSwapchainTargets(Swapchain, Device, ColorFormat, DepthFormat, RenderPass, MemoryAllocator, Images, SurfaceCaps.currentExtent.width, SurfaceCaps.currentExtent.height);
+	Swapchain.bCapturable = ((SurfaceCaps.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT) != 0) && IsCaptureFormat(ColorFormat);
+
+	return Swapchain;
+}
+
+SSwapchain CreateOffscreenSwapchain(VkDevice Device, VkFormat ColorFormat, VkFormat DepthFormat, VkRenderPass RenderPass, VmaAllocator MemoryAllocator, uint32_t Width, uint32_t Height)
+{
+	SSwapchain Swapchain = {};
+
+	Swapchain.OffscreenImage = CreateImage(Device, MemoryAllocator, ColorFormat, Width, Height, 1, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
+	std::vector<VkImage> Images(1, Swapchain.OffscreenImage.Image);
+
+	CreateSwapchainTargets(Swapchain, Device, ColorFormat, DepthFormat, RenderPass, MemoryAllocator, Images, Width, Height);
+	Swapchain.bCapturable = IsCaptureFormat(ColorFormat);
 
 	return Swapchain;
 }
@@ -491,7 +578,10 @@ void DestroySwapchain(SSwapchain Swapchain, VkDevice Device, VmaAllocator Memory
 	}
 	vmaDestroyImage(MemoryAllocator, Swapchain.DepthMipsImage.Image, Swapchain.DepthMipsImage.Allocation);
 
-	vkDestroySwapchainKHR(Device, Swapchain.VkSwapchain, 0);
+	if (Swapchain.OffscreenImage.Image)
+		vmaDestroyImage(MemoryAllocator, Swapchain.OffscreenImage.Image, Swapchain.OffscreenImage.Allocation);
+	else
+		vkDestroySwapchainKHR(Device, Swapchain.VkSwapchain, 0);
 }
 
 bool ResizeSwapchainIfChanged(SSwapchain& Swapchain, VkDevice Device, VkPhysicalDevice PhysicalDevice, VkSurfaceKHR Surface, VkFormat ColorFormat, VkFormat DepthFormat, VkRenderPass RenderPass, VmaAllocator MemoryAllocator)
@@ -522,6 +612,18 @@ bool ResizeSwapchainIfChanged(SSwapchain& Swapchain, VkDevice Device, VkPhysical
 	return bResized;
 }
 
+bool ResizeOffscreenSwapchain(SSwapchain& Swapchain, VkDevice Device, VkFormat ColorFormat, VkFormat DepthFormat, VkRenderPass RenderPass, VmaAllocator MemoryAllocator, uint32_t Width, uint32_t Height)
+{
+	if ((Swapchain.Width == Width) && (Swapchain.Height == Height))
+		return false;
+
+	VkCheck(vkDeviceWaitIdle(Device));
+	DestroySwapchain(Swapchain, Device, MemoryAllocator);
+	Swapchain = CreateOffscreenSwapchain(Device, ColorFormat, DepthFormat, RenderPass, MemoryAllocator, Width, Height);
+
+	return true;
+}
+
 VkCommandPool CreateCommandPool(VkDevice Device, VkCommandPoolCreateFlags Flags, uint32_t FamilyIndex)
 {
 	VkCommandPoolCreateInfo CreateInfo = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
@@ -560,11 +662,12 @@ VkSemaphore CreateSemaphore(VkDevice Device)
 	return Semaphore;
 }
 
-VkQueryPool CreateQueryPool(VkDevice Device)
+VkQueryPool CreateQueryPool(VkDevice Device, uint32_t QueryCount, VkQueryType QueryType = VK_QUERY_TYPE_TIMESTAMP, VkQueryPipelineStatisticFlags PipelineStatistics = 0)
 {
 	VkQueryPoolCreateInfo CreateInfo = { VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
-	CreateInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
-	CreateInfo.queryCount = 4;
+	CreateInfo.queryType = QueryType;
+	CreateInfo.queryCount = QueryCount;
+	CreateInfo.pipelineStatistics = PipelineStatistics;
 
 	VkQueryPool QueryPool = 0;
 	VkCheck(vkCreateQueryPool(Device, &CreateInfo, 0, &QueryPool));
@@ -573,6 +676,389 @@ VkQueryPool CreateQueryPool(VkDevice Device)
 	return QueryPool;
 }
 
+// Every frame writes its scopes into its own range of the query pools, the results are read GpuProfilerRingSize - 1 frames later so reading them never waits on the GPU
+const uint32_t GpuProfilerRingSize = 3;
+const uint32_t GpuProfilerMaxScopes = 64;
+
+// Vulkan writes the enabled statistics in bit order
+const VkQueryPipelineStatisticFlags GpuProfilerStatistics = VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT | VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT |
+															 VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT | VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT;
+const uint32_t GpuStatisticVertexInvocations = 0;
+const uint32_t GpuStatisticClippingPrimitives = 1;
+const uint32_t GpuStatisticFragmentInvocations = 2;
+const uint32_t GpuStatisticComputeInvocations = 3;
+const uint32_t GpuStatisticsCount = 4;
+
+struct SGpuScope
+{
+	const char* Name;
+	uint32_t Depth;
+	int32_t StatisticsIndex; // -1 if the scope has no pipeline statistics
+
+	double Begin; // Milliseconds since the first scope of the frame began
+	double Time;
+	uint64_t Statistics[GpuStatisticsCount];
+};
+
+struct SGpuProfiler
+{
+	VkQueryPool TimestampPool;
+	VkQueryPool StatisticsPool;
+	float TimestampPeriod;
+
+	uint32_t FrameSlot;
+	std::vector<SGpuScope> FrameScopes[GpuProfilerRingSize];
+	uint32_t FrameStatisticsCount[GpuProfilerRingSize];
+	std::vector<uint32_t> OpenScopes;
+	bool bStatisticsScopeOpen;
+
+	// Scopes of the latest frame that was read back, in begin order
+	std::vector<SGpuScope> Results;
+};
+
+// Without pipelineStatisticsQuery there is no statistics pool, scopes that ask for statistics get only timestamps
+SGpuProfiler CreateGpuProfiler(VkDevice Device, const VkPhysicalDeviceProperties& PhysicalDeviceProps, bool bPipelineStatistics)
+{
+	SGpuProfiler Profiler = {};
+	Profiler.TimestampPool = CreateQueryPool(Device, GpuProfilerRingSize * GpuProfilerMaxScopes * 2);
+	if (bPipelineStatistics)
+		Profiler.StatisticsPool = CreateQueryPool(Device, GpuProfilerRingSize * GpuProfilerMaxScopes, VK_QUERY_TYPE_PIPELINE_STATISTICS, GpuProfilerStatistics);
+	Profiler.TimestampPeriod = PhysicalDeviceProps.limits.timestampPeriod;
+
+	return Profiler;
+}
+
+void BeginGpuFrame(VkCommandBuffer CommandBuffer, SGpuProfiler& Profiler, uint32_t FrameID)
+{
+	Assert(Profiler.OpenScopes.empty());
+
+	uint32_t Slot = FrameID % GpuProfilerRingSize;
+	Profiler.FrameSlot = Slot;
+	Profiler.FrameScopes[Slot].clear();
+	Profiler.FrameStatisticsCount[Slot] = 0;
+
+	vkCmdResetQueryPool(CommandBuffer, Profiler.TimestampPool, Slot * GpuProfilerMaxScopes * 2, GpuProfilerMaxScopes * 2);
+	if (Profiler.StatisticsPool)
+		vkCmdResetQueryPool(CommandBuffer, Profiler.StatisticsPool, Slot * GpuProfilerMaxScopes, GpuProfilerMaxScopes);
+}
+
+// Queries of one type can't be nested, so only one open scope at a time can have pipeline statistics.
+// A scope with statistics that begins outside a render pass has to end outside of it too
+void BeginGpuScope(VkCommandBuffer CommandBuffer, SGpuProfiler& Profiler, const char* Name, bool bStatistics = false)
+{
+	std::vector<SGpuScope>& Scopes = Profiler.FrameScopes[Profiler.FrameSlot];
+	Assert(Scopes.size() < GpuProfilerMaxScopes);
+
+	uint32_t ScopeIndex = (uint32_t)Scopes.size();
+
+	SGpuScope Scope = {};
+	Scope.Name = Name;
+	Scope.Depth = (uint32_t)Profiler.OpenScopes.size();
+	Scope.StatisticsIndex = -1;
+
+	// Both ends are written at the bottom of the pipe, so a scope starts when the work recorded before it is done and sibling scopes don't overlap
+	vkCmdWriteTimestamp(CommandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, Profiler.TimestampPool, (Profiler.FrameSlot * GpuProfilerMaxScopes + ScopeIndex) * 2);
+	if (bStatistics && Profiler.StatisticsPool)
+	{
+		Assert(!Profiler.bStatisticsScopeOpen);
+		Profiler.bStatisticsScopeOpen = true;
+
+		Scope.StatisticsIndex = int32_t(Profiler.FrameStatisticsCount[Profiler.FrameSlot]++);
+		vkCmdBeginQuery(CommandBuffer, Profiler.StatisticsPool, Profiler.FrameSlot * GpuProfilerMaxScopes + Scope.StatisticsIndex, 0);
+	}
+
+	Scopes.push_back(Scope);
+	Profiler.OpenScopes.push_back(ScopeIndex);
+}
+
+void EndGpuScope(VkCommandBuffer CommandBuffer, SGpuProfiler& Profiler)
+{
+	Assert(!Profiler.OpenScopes.empty());
+	uint32_t ScopeIndex = Profiler.OpenScopes.back();
+	Profiler.OpenScopes.pop_back();
+
+	const SGpuScope& Scope = Profiler.FrameScopes[Profiler.FrameSlot][ScopeIndex];
+	if (Scope.StatisticsIndex != -1)
+	{
+		vkCmdEndQuery(CommandBuffer, Profiler.StatisticsPool, Profiler.FrameSlot * GpuProfilerMaxScopes + Scope.StatisticsIndex);
+		Profiler.bStatisticsScopeOpen = false;
+	}
+	vkCmdWriteTimestamp(CommandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, Profiler.TimestampPool, (Profiler.FrameSlot * GpuProfilerMaxScopes + ScopeIndex) * 2 + 1);
+}
+
+// Reads the oldest frame of the ring, FrameID + 1 - GpuProfilerRingSize. If its queries aren't available yet the previous results are kept and false is returned
+bool ReadGpuProfiler(VkDevice Device, SGpuProfiler& Profiler, uint32_t FrameID)
+{
+	if (FrameID + 1 < GpuProfilerRingSize)
+		return false;
+
+	uint32_t Slot = (FrameID + 1) % GpuProfilerRingSize;
+	const std::vector<SGpuScope>& Scopes = Profiler.FrameScopes[Slot];
+	uint32_t ScopesCount = (uint32_t)Scopes.size();
+	uint32_t StatisticsCount = Profiler.FrameStatisticsCount[Slot];
+	if (ScopesCount == 0)
+		return false;
+
+	uint64_t Timestamps[GpuProfilerMaxScopes * 2] = {};
+	VkResult Result = vkGetQueryPoolResults(Device, Profiler.TimestampPool, Slot * GpuProfilerMaxScopes * 2, ScopesCount * 2, sizeof(Timestamps), Timestamps, sizeof(Timestamps[0]), VK_QUERY_RESULT_64_BIT);
+	if (Result == VK_NOT_READY)
+		return false;
+	VkCheck(Result);
+
+	uint64_t Statistics[GpuProfilerMaxScopes][GpuStatisticsCount] = {};
+	if (StatisticsCount > 0)
+	{
+		Result = vkGetQueryPoolResults(Device, Profiler.StatisticsPool, Slot * GpuProfilerMaxScopes, StatisticsCount, sizeof(Statistics), Statistics, sizeof(Statistics[0]), VK_QUERY_RESULT_64_BIT);
+		if (Result == VK_NOT_READY)
+			return false;
+		VkCheck(Result);
+	}
+
+	Profiler.Results = Scopes;
+	for (uint32_t I = 0; I < ScopesCount; I++)
+	{
+		SGpuScope& Scope = Profiler.Results[I];
+		Scope.Begin = double(Timestamps[2 * I] - Timestamps[0]) * Profiler.TimestampPeriod * 1e-6;
+		Scope.Time = double(Timestamps[2 * I + 1] - Timestamps[2 * I]) * Profiler.TimestampPeriod * 1e-6;
+		if (Scope.StatisticsIndex != -1)
+			memcpy(Scope.Statistics, Statistics[Scope.StatisticsIndex], sizeof(Scope.Statistics));
+	}
+
+	return true;
+}
+
+// Sums every scope with this name, a pass that runs twice a frame reports its total
+double GetGpuScopeTime(const SGpuProfiler& Profiler, const char* Name)
+{
+	double Time = 0.0;
+	for (const SGpuScope& Scope : Profiler.Results)
+	{
+		if (strcmp(Scope.Name, Name) == 0)
+			Time += Scope.Time;
+	}
+
+	return Time;
+}
+
+uint64_t GetGpuScopeStatistic(const SGpuProfiler& Profiler, const char* Name, uint32_t Statistic)
+{
+	uint64_t Value = 0;
+	for (const SGpuScope& Scope : Profiler.Results)
+	{
+		if (strcmp(Scope.Name, Name) == 0)
+			Value += Scope.Statistics[Statistic];
+	}
+
+	return Value;
+}
+
+// Per scope totals over many frames, scopes are matched by name and depth
+struct SGpuScopeTotal
+{
+	const char* Name;
+	uint32_t Depth;
+	double Time;
+	uint32_t Count;
+};
+
+void AccumulateGpuProfiler(std::vector<SGpuScopeTotal>& Totals, const SGpuProfiler& Profiler)
+{
+	for (const SGpuScope& Scope : Profiler.Results)
+	{
+		uint32_t I = 0;
+		while ((I < Totals.size()) && ((Totals[I].Depth != Scope.Depth) || (strcmp(Totals[I].Name, Scope.Name) != 0)))
+			I++;
+		if (I == Totals.size())
+			Totals.push_back({ Scope.Name, Scope.Depth, 0.0, 0 });
+
+		Totals[I].Time += Scope.Time;
+		Totals[I].Count++;
+	}
+}
+
+void PrintGpuScopeTotals(const std::vector<SGpuScopeTotal>& Totals)
+{
+	for (const SGpuScopeTotal& Total : Totals)
+		printf("%*s%s: %.3f ms (%u frames)\n", int(2 * Total.Depth), "", Total.Name, Total.Time / double(Total.Count), Total.Count);
+}
+
+void PrintGpuProfiler(const SGpuProfiler& Profiler)
+{
+	for (const SGpuScope& Scope : Profiler.Results)
+	{
+		printf("%*s%s: %.3f ms", int(2 * Scope.Depth), "", Scope.Name, Scope.Time);
+		if (Scope.StatisticsIndex != -1)
+		{
+			printf(" (vs invocations: %llu; clipping primitives: %llu; fs invocations: %llu; cs invocations: %llu)",
+				   (unsigned long long)Scope.Statistics[GpuStatisticVertexInvocations], (unsigned long long)Scope.Statistics[GpuStatisticClippingPrimitives],
+				   (unsigned long long)Scope.Statistics[GpuStatisticFragmentInvocations], (unsigned long long)Scope.Statistics[GpuStatisticComputeInvocations]);
+		}
+		printf("\n");
+	}
+}
+
+// CPU markers are recorded into per thread lists only while a capture is running. Captures are written as Chrome trace JSON,
+// which chrome://tracing and Perfetto open, with the GPU scopes of the captured frames on their own track
+struct SCpuEvent
+{
+	const char* Name;
+	uint64_t Begin; // Steady clock nanoseconds
+	uint64_t End;
+};
+
+struct SCpuThreadEvents
+{
+	char ThreadName[32];
+	uint32_t ThreadID;
+	std::vector<SCpuEvent> Events;
+	std::vector<uint32_t> OpenEvents; // ~0u for scopes that began outside of a capture
+};
+
+struct SCpuProfiler
+{
+	std::atomic<bool> bCapturing;
+	std::mutex Mutex;
+	std::vector<SCpuThreadEvents*> Threads; // Never freed, so events of threads that have exited stay valid
+
+	uint64_t CaptureBeginTicks;
+	uint32_t CaptureFirstFrame;
+	uint32_t CaptureEndFrame;
+	bool bCapturePending; // Until the GPU scopes of the last captured frame are read back
+	std::vector<SCpuEvent> GpuEvents;
+};
+
+static SCpuProfiler GlobalCpuProfiler;
+static thread_local SCpuThreadEvents* GlobalCpuThreadEvents = 0;
+
+uint64_t GetCpuTicks()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Seconds since the first call, also works in headless runs where GLFW isn't initialized
+double GetTime()
+{
+	static uint64_t StartTicks = GetCpuTicks();
+	return double(GetCpuTicks() - StartTicks) * 1e-9;
+}
+
+SCpuThreadEvents* GetCpuThreadEvents()
+{
+	if (!GlobalCpuThreadEvents)
+	{
+		std::lock_guard<std::mutex> Lock(GlobalCpuProfiler.Mutex);
+
+		GlobalCpuThreadEvents = new SCpuThreadEvents();
+		GlobalCpuThreadEvents->ThreadID = (uint32_t)GlobalCpuProfiler.Threads.size();
+		snprintf(GlobalCpuThreadEvents->ThreadName, sizeof(GlobalCpuThreadEvents->ThreadName), "Thread %u", GlobalCpuThreadEvents->ThreadID);
+		GlobalCpuProfiler.Threads.push_back(GlobalCpuThreadEvents);
+	}
+
+	return GlobalCpuThreadEvents;
+}
+
+void SetCpuThreadName(const char* Name)
+{
+	SCpuThreadEvents* Thread = GetCpuThreadEvents();
+	snprintf(Thread->ThreadName, sizeof(Thread->ThreadName), "%s", Name);
+}
+
+void BeginCpuScope(const char* Name)
+{
+	SCpuThreadEvents* Thread = GetCpuThreadEvents();
+	if (GlobalCpuProfiler.bCapturing.load(std::memory_order_relaxed))
+	{
+		Thread->OpenEvents.push_back((uint32_t)Thread->Events.size());
+		Thread->Events.push_back({ Name, GetCpuTicks(), 0 });
+	}
+	else
+	{
+		Thread->OpenEvents.push_back(~0u);
+	}
+}
+
+void EndCpuScope()
+{
+	SCpuThreadEvents* Thread = GetCpuThreadEvents();
+	Assert(!Thread->OpenEvents.empty());
+
+	uint32_t EventIndex = Thread->OpenEvents.back();
+	Thread->OpenEvents.pop_back();
+	if (EventIndex < Thread->Events.size())
+		Thread->Events[EventIndex].End = GetCpuTicks();
+}
+
+// For functions with several returns
+struct SCpuScope
+{
+	SCpuScope(const char* Name) { BeginCpuScope(Name); }
+	~SCpuScope() { EndCpuScope(); }
+};
+
+// Called between frames, when no thread has a scope open
+void BeginCpuCapture(uint32_t FrameID, uint32_t FramesCount)
+{
+	std::lock_guard<std::mutex> Lock(GlobalCpuProfiler.Mutex);
+	for (SCpuThreadEvents* Thread : GlobalCpuProfiler.Threads)
+		Thread->Events.clear();
+	GlobalCpuProfiler.GpuEvents.clear();
+
+	GlobalCpuProfiler.CaptureBeginTicks = GetCpuTicks();
+	GlobalCpuProfiler.CaptureFirstFrame = FrameID;
+	GlobalCpuProfiler.CaptureEndFrame = FrameID + FramesCount;
+	GlobalCpuProfiler.bCapturePending = true;
+	GlobalCpuProfiler.bCapturing = true;
+}
+
+// GPU timestamps aren't on the CPU clock, every frame's scopes are placed relative to its submit, which is as early as the GPU could start it
+void AddGpuTraceEvents(const SGpuProfiler& GpuProfiler, uint32_t ResultsFrameID, uint64_t SubmitTicks)
+{
+	if (!GlobalCpuProfiler.bCapturePending || (ResultsFrameID < GlobalCpuProfiler.CaptureFirstFrame) || (ResultsFrameID >= GlobalCpuProfiler.CaptureEndFrame))
+		return;
+
+	for (const SGpuScope& Scope : GpuProfiler.Results)
+	{
+		uint64_t Begin = SubmitTicks + uint64_t(Scope.Begin * 1e6);
+		GlobalCpuProfiler.GpuEvents.push_back({ Scope.Name, Begin, Begin + uint64_t(Scope.Time * 1e6) });
+	}
+}
+
+void WriteChromeTrace(const char* Path)
+{
+	FILE* File = fopen(Path, "w");
+	if (!File)
+	{
+		printf("Can't open %s\n", Path);
+		return;
+	}
+
+	const uint32_t GpuThreadID = 1000;
+	uint64_t BeginTicks = GlobalCpuProfiler.CaptureBeginTicks;
+
+	fprintf(File, "{\"traceEvents\":[\n");
+	fprintf(File, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"GPU\"}}", GpuThreadID);
+	for (const SCpuEvent& Event : GlobalCpuProfiler.GpuEvents)
+		fprintf(File, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", Event.Name, GpuThreadID, double(int64_t(Event.Begin - BeginTicks)) * 1e-3, double(Event.End - Event.Begin) * 1e-3);
+
+	std::lock_guard<std::mutex> Lock(GlobalCpuProfiler.Mutex);
+	for (const SCpuThreadEvents* Thread : GlobalCpuProfiler.Threads)
+	{
+		fprintf(File, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", Thread->ThreadID, Thread->ThreadName);
+		for (const SCpuEvent& Event : Thread->Events)
+		{
+			// Scopes still open when the capture stopped are dropped
+			if (Event.End < Event.Begin)
+				continue;
+
+			fprintf(File, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", Event.Name, Thread->ThreadID, double(int64_t(Event.Begin - BeginTicks)) * 1e-3, double(Event.End - Event.Begin) * 1e-3);
+		}
+	}
+	fprintf(File, "\n]}\n");
+
+	fclose(File);
+	printf("Trace written to %s\n", Path);
+}
+
 VkImageMemoryBarrier CreateImageMemoryBarrier(VkAccessFlags SrcAccessMask, VkAccessFlags DstAccessMask, VkImageLayout OldLayout, VkImageLayout NewLayout, VkImage Image, VkImageAspectFlags AspectMask, uint32_t MipLevel = 0, uint32_t MipLevelCount = VK_REMAINING_MIP_LEVELS)
 {
 	VkImageMemoryBarrier Barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
@@ -662,21 +1148,18 @@ SBuffer CreateBuffer(VmaAllocator MemoryAllocator, VkDeviceSize Size, VkBufferUs
 	return Buffer;
 }
 
-void UploadBuffer(VkDevice Device, VkCommandPool CommandPool, VkCommandBuffer CommandBuffer, VkQueue Queue, const SBuffer& Buffer, const SBuffer& StagingBuffer, void *Data, uint64_t Size)
+void BeginCommandBuffer(VkDevice Device, VkCommandPool CommandPool, VkCommandBuffer CommandBuffer)
 {
-	Assert(StagingBuffer.Data);
-	memcpy(StagingBuffer.Data, Data, Size);
-
 	VkCheck(vkResetCommandPool(Device, CommandPool, 0));
 
 	VkCommandBufferBeginInfo BeginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
 	BeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
 	VkCheck(vkBeginCommandBuffer(CommandBuffer, &BeginInfo));
+}
 
-	VkBufferCopy CopyRegion = { 0, 0, Size };
-	vkCmdCopyBuffer(CommandBuffer, StagingBuffer.Buffer, Buffer.Buffer, 1, &CopyRegion);
-
+void SubmitAndWait(VkDevice Device, VkQueue Queue, VkCommandBuffer CommandBuffer)
+{
 	VkCheck(vkEndCommandBuffer(CommandBuffer));
 
 	VkSubmitInfo SubmitInfo = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
@@ -687,12 +1170,25 @@ void UploadBuffer(VkDevice Device, VkCommandPool CommandPool, VkCommandBuffer Co
 	VkCheck(vkDeviceWaitIdle(Device));
 }
 
+void UploadBuffer(VkDevice Device, VkCommandPool CommandPool, VkCommandBuffer CommandBuffer, VkQueue Queue, const SBuffer& Buffer, const SBuffer& StagingBuffer, void *Data, uint64_t Size)
+{
+	Assert(StagingBuffer.Data);
+	memcpy(StagingBuffer.Data, Data, Size);
+
+	BeginCommandBuffer(Device, CommandPool, CommandBuffer);
+
+	VkBufferCopy CopyRegion = { 0, 0, Size };
+	vkCmdCopyBuffer(CommandBuffer, StagingBuffer.Buffer, Buffer.Buffer, 1, &CopyRegion);
+
+	SubmitAndWait(Device, Queue, CommandBuffer);
+}
+
 VkDescriptorPool CreateDescriptorPool(VkDevice Device)
 {
 	VkDescriptorPoolSize PoolSizes[] =
 	{
 		{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 10 },
-		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 10 },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 32 },
 		{ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 25 },
 		{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 25}
 	};
@@ -788,11 +1284,10 @@ struct SCameraBuffer
 	mat4 View;
 	mat4 Proj;
 
-	mat4 PrevView;
-	mat4 PrevProj;
-
 	vec4 CameraPosition;
 	vec4 Frustums[6];
+
+	vec4 QuantizationGrid;
 };
 
 struct SPushConstantsCompute
@@ -803,8 +1298,67 @@ struct SPushConstantsCompute
 	uint32_t bOcclusionCullingEnabled;
 	uint32_t ImageWidth;
 	uint32_t ImageHeight;
+
+	uint32_t bLatePass;
+	uint32_t ObjectsCount;
+	uint32_t CellsCount;
+	uint32_t BucketsCount;
+	uint32_t DepthBinsCount;
+
+	float DeltaTime;
+
+	uint32_t NodeFirst;
+	uint32_t NodeCount;
+
+	float OcclusionBias;
 };
 
+void UpdateCameraBuffer(SCameraBuffer& CameraBufferData, vec3 CameraPosition, vec3 CameraDir, float AspectRatio, bool bFrustumCulling)
+{
+	vec3 CameraRight = glm::normalize(glm::cross(CameraDir, vec3(0.0f, 1.0f, 0.0f)));
+	vec3 CameraUp = glm::cross(CameraRight, CameraDir);
+	float CameraNear = 0.1f;
+	float CameraFar = 100000.0f;
+	float FoV = 70.0f;
+	float NearHalfHeight = CameraNear * tanf(0.5f*glm::radians(FoV));
+	float NearHalfWidth = AspectRatio * NearHalfHeight;
+	float FarHalfHeight = CameraFar * tanf(0.5f*glm::radians(FoV));
+	float FarHalfWidth = AspectRatio * FarHalfHeight;
+
+	CameraBufferData.View = glm::lookAt(CameraPosition, CameraPosition + CameraDir, CameraUp);
+	CameraBufferData.Proj = glm::perspective(FoV, AspectRatio, CameraNear, CameraFar);
+	CameraBufferData.CameraPosition = vec4(CameraPosition, -CameraNear);
+
+	memset(CameraBufferData.Frustums, 0, sizeof(CameraBufferData.Frustums));
+	if (bFrustumCulling)
+	{
+		vec3 FrustumPoints[8] = {};
+		FrustumPoints[0] = CameraPosition + CameraNear*CameraDir + NearHalfWidth*CameraRight + NearHalfHeight*CameraUp; // near right top
+		FrustumPoints[1] = CameraPosition + CameraNear*CameraDir + NearHalfWidth*CameraRight - NearHalfHeight*CameraUp; // near right bot
+		FrustumPoints[2] = CameraPosition + CameraNear*CameraDir - NearHalfWidth*CameraRight + NearHalfHeight*CameraUp; // near left top
+		FrustumPoints[3] = CameraPosition + CameraNear*CameraDir - NearHalfWidth*CameraRight - NearHalfHeight*CameraUp; // naer left bot
+		FrustumPoints[4] = CameraPosition + CameraFar*CameraDir + FarHalfWidth*CameraRight + FarHalfHeight*CameraUp; // far right top
+		FrustumPoints[5] = CameraPosition + CameraFar*CameraDir + FarHalfWidth*CameraRight - FarHalfHeight*CameraUp; // far right bot
+		FrustumPoints[6] = CameraPosition + CameraFar*CameraDir - FarHalfWidth*CameraRight + FarHalfHeight*CameraUp; // far left top
+		FrustumPoints[7] = CameraPosition + CameraFar*CameraDir - FarHalfWidth*CameraRight - FarHalfHeight*CameraUp; // far left bot
+
+		vec3 FrustumPlaneNormals[6] = {};
+		FrustumPlaneNormals[0] = glm::normalize(glm::cross(FrustumPoints[1] - FrustumPoints[0], FrustumPoints[2] - FrustumPoints[0])); // near
+		FrustumPlaneNormals[1] = glm::normalize(glm::cross(FrustumPoints[6] - FrustumPoints[4], FrustumPoints[5] - FrustumPoints[4])); // far
+		FrustumPlaneNormals[2] = glm::normalize(glm::cross(FrustumPoints[4] - FrustumPoints[0], FrustumPoints[1] - FrustumPoints[0])); // right
+		FrustumPlaneNormals[3] = glm::normalize(glm::cross(FrustumPoints[3] - FrustumPoints[2], FrustumPoints[6] - FrustumPoints[2])); // left
+		FrustumPlaneNormals[4] = glm::normalize(glm::cross(FrustumPoints[6] - FrustumPoints[2], FrustumPoints[0] - FrustumPoints[2])); // top
+		FrustumPlaneNormals[5] = glm::normalize(glm::cross(FrustumPoints[5] - FrustumPoints[1], FrustumPoints[3] - FrustumPoints[1])); // bot
+
+		CameraBufferData.Frustums[0] = vec4(FrustumPlaneNormals[0], glm::dot(FrustumPlaneNormals[0], FrustumPoints[0])); // near
+		CameraBufferData.Frustums[1] = vec4(FrustumPlaneNormals[1], glm::dot(FrustumPlaneNormals[1], FrustumPoints[4])); // far
+		CameraBufferData.Frustums[2] = vec4(FrustumPlaneNormals[2], glm::dot(FrustumPlaneNormals[2], FrustumPoints[0])); // right
+		CameraBufferData.Frustums[3] = vec4(FrustumPlaneNormals[3], glm::dot(FrustumPlaneNormals[3], FrustumPoints[2])); // left
+		CameraBufferData.Frustums[4] = vec4(FrustumPlaneNormals[4], glm::dot(FrustumPlaneNormals[4], FrustumPoints[2])); // top
+		CameraBufferData.Frustums[5] = vec4(FrustumPlaneNormals[5], glm::dot(FrustumPlaneNormals[5], FrustumPoints[1])); // bot
+	}
+}
+
 VkPipelineLayout CreatePipelineLayout(VkDevice Device, uint32_t SetLayoutCount, const VkDescriptorSetLayout* SetLayouts, uint32_t PushConstantsSize = 0)
 {
 	VkPipelineLayoutCreateInfo CreateInfo = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
@@ -836,6 +1390,24 @@ struct SVertex
 };
 
 const uint32_t LodsCount = 7;
+// Every (mesh, LOD) bucket gets split by quantized view depth when depth sorting is on
+const uint32_t DepthBinsCount = 16;
+
+// Mirrors CullStats in cull.h: outcome counters are late pass only, emitted draws and triangles cover both passes
+struct SCullStats
+{
+	uint64_t EmittedTriangles; // Low and high half of the counter pair in cull.h
+	uint32_t CellCulledDraws;
+	uint32_t TestedDraws;
+	uint32_t FrustumCulledDraws;
+	uint32_t OcclusionCulledDraws;
+	uint32_t VisibleDraws;
+	uint32_t EmittedLodDraws[LodsCount];
+};
+
+// Frames of culling stats in flight, the stats shown are CullStatsRingSize - 1 frames old so reading them never waits on the GPU
+const uint32_t CullStatsRingSize = 3;
+
 struct SMesh
 {
 	vec3 SphereCenter;
@@ -844,6 +1416,9 @@ struct SMesh
 	uint32_t IndexCount[LodsCount];
 	uint32_t IndexOffset[LodsCount];
 	uint32_t VertexOffset;
+
+	// Meshes are uploaded as the GPU mesh table, keeps the 16 byte array stride of the shader struct
+	uint32_t Padding;
 };
 
 struct SGeometry
@@ -853,22 +1428,26 @@ struct SGeometry
 	std::vector<SMesh> Meshes;
 };
 
+// Per instance data is only the transform and the mesh, everything else is in the mesh table
 struct SMeshDraw
 {
-	vec3 SphereCenter;
-	float SphereRadius;
-
 	vec3 Position;
 	float Scale;
-	quat Orientation;
-
-	uint32_t IndexCount[LodsCount];
-	uint32_t IndexOffset[LodsCount];
-	uint32_t VertexOffset;
-	uint32_t FirstInstance;
+	vec3 Orientation;
+	uint32_t MeshIndex;
 };
 
-void LoadMesh(SGeometry& Geometry, const char* Path)
+// Instances keep only the quaternion xyz and shaders reconstruct w = sqrt(1 - dot(xyz, xyz)), so w has to be non-negative
+vec3 PackOrientation(quat Q)
+{
+	Q = glm::normalize(Q);
+	vec3 Result = vec3(Q.x, Q.y, Q.z);
+
+	return (Q.w < 0.0f) ? -Result : Result;
+}
+
+// The LoadMesh stages are separate functions so -bench-assets can time them one by one
+std::vector<SVertex> ParseObj(const char* Path)
 {
 	fastObjMesh* File = fast_obj_read(Path);
 	Assert(File);
@@ -916,185 +1495,3388 @@ void LoadMesh(SGeometry& Geometry, const char* Path)
 	Assert(VertexOffset == IndexCount);
 	fast_obj_destroy(File);
 
-	vec3 SphereCenter = vec3(0.0f);
-	for (uint32_t I = 0; I < IndexCount; I++)
+	return Vertices;
+}
+
+void ComputeBoundingSphere(const std::vector<SVertex>& Vertices, vec3& SphereCenter, float& SphereRadius)
+{
+	SphereCenter = vec3(0.0f);
+	for (uint32_t I = 0; I < Vertices.size(); I++)
 	{
-		SVertex* Vertex = (SVertex*)Vertices.data() + I;
-		SphereCenter += Vertex->Position;
+		SphereCenter += Vertices[I].Position;
 	}
-	SphereCenter /= IndexCount;
+	SphereCenter /= Vertices.size();
 
-	float SphereRadius = 0.0f;
-	for (uint32_t I = 0; I < IndexCount; I++)
+	SphereRadius = 0.0f;
+	for (uint32_t I = 0; I < Vertices.size(); I++)
 	{
-		SVertex* Vertex = (SVertex*)Vertices.data() + I;
-		float Length = glm::length(Vertex->Position - SphereCenter);
+		float Length = glm::length(Vertices[I].Position - SphereCenter);
 		if (Length > SphereRadius)
 			SphereRadius = Length;
 	}
+}
+
+void DeduplicateVertices(const std::vector<SVertex>& Vertices, std::vector<SVertex>& UniqueVertices, std::vector<uint32_t>& UniqueIndices)
+{
+	size_t IndexCount = Vertices.size();
 
 	std::vector<uint32_t> Remap(IndexCount);
 	size_t UniqueVerticesCount = meshopt_generateVertexRemap(Remap.data(), 0, IndexCount, Vertices.data(), IndexCount, sizeof(SVertex));
 
-	std::vector<SVertex> UniqueVertices(UniqueVerticesCount);
-	std::vector<uint32_t> UniqueIndices(IndexCount);
+	UniqueVertices.resize(UniqueVerticesCount);
+	UniqueIndices.resize(IndexCount);
 
 	meshopt_remapVertexBuffer(UniqueVertices.data(), Vertices.data(), IndexCount, sizeof(SVertex), Remap.data());
 	meshopt_remapIndexBuffer(UniqueIndices.data(), 0, IndexCount, Remap.data());
+}
 
-	meshopt_optimizeVertexCache(UniqueIndices.data(), UniqueIndices.data(), IndexCount, UniqueVerticesCount);
-	meshopt_optimizeVertexFetch(UniqueVertices.data(), UniqueIndices.data(), IndexCount, UniqueVertices.data(), UniqueVerticesCount, sizeof(SVertex));
+void OptimizeMesh(std::vector<SVertex>& Vertices, std::vector<uint32_t>& Indices)
+{
+	meshopt_optimizeVertexCache(Indices.data(), Indices.data(), Indices.size(), Vertices.size());
+	meshopt_optimizeVertexFetch(Vertices.data(), Indices.data(), Indices.size(), Vertices.data(), Vertices.size(), sizeof(SVertex));
+}
+
+// Every LOD keeps 75% of the triangles of the previous one
+void SimplifyLods(const std::vector<SVertex>& Vertices, const std::vector<uint32_t>& Indices, std::vector<uint32_t> (&Lods)[LodsCount])
+{
+	Lods[0] = Indices;
+	for (uint32_t I = 1; I < LodsCount; I++)
+	{
+		std::vector<uint32_t>& LodIndices = Lods[I];
+		LodIndices = Lods[I - 1];
 
-	uint32_t PrevVertexCount = Geometry.Vertices.size();
+		size_t NextIndicesTarget = size_t(0.75*double(LodIndices.size()));
+		size_t NewIndicesCount = meshopt_simplify(LodIndices.data(), LodIndices.data(), LodIndices.size(), (float*)Vertices.data(), Vertices.size(), sizeof(SVertex), NextIndicesTarget, 0.2f);
+		Assert(NewIndicesCount < LodIndices.size())
 
-	Geometry.Vertices.insert(Geometry.Vertices.end(), UniqueVertices.begin(), UniqueVertices.end());
+		LodIndices.resize(NewIndicesCount);
+		meshopt_optimizeVertexCache(LodIndices.data(), LodIndices.data(), NewIndicesCount, Vertices.size());
+	}
+}
 
+void AddMesh(SGeometry& Geometry, const std::vector<SVertex>& Vertices, const std::vector<uint32_t> (&Lods)[LodsCount], vec3 SphereCenter, float SphereRadius)
+{
 	SMesh Mesh = {};
 	Mesh.SphereCenter = SphereCenter;
 	Mesh.SphereRadius = SphereRadius;
-	Mesh.VertexOffset = PrevVertexCount;
-	
-	std::vector<uint32_t> LodIncides = UniqueIndices;
+	Mesh.VertexOffset = (uint32_t)Geometry.Vertices.size();
+
+	Geometry.Vertices.insert(Geometry.Vertices.end(), Vertices.begin(), Vertices.end());
+
 	for (uint32_t I = 0; I < LodsCount; I++)
 	{
-		if (I == 0)
+		Mesh.IndexOffset[I] = (uint32_t)Geometry.Indices.size();
+		Mesh.IndexCount[I] = (uint32_t)Lods[I].size();
+
+		Geometry.Indices.insert(Geometry.Indices.end(), Lods[I].begin(), Lods[I].end());
+	}
+
+	Geometry.Meshes.push_back(Mesh);
+}
+
+void LoadMesh(SGeometry& Geometry, const char* Path)
+{
+	SCpuScope Scope("Load mesh");
+
+	std::vector<SVertex> Vertices = ParseObj(Path);
+
+	vec3 SphereCenter;
+	float SphereRadius;
+	ComputeBoundingSphere(Vertices, SphereCenter, SphereRadius);
+
+	std::vector<SVertex> UniqueVertices;
+	std::vector<uint32_t> UniqueIndices;
+	DeduplicateVertices(Vertices, UniqueVertices, UniqueIndices);
+	OptimizeMesh(UniqueVertices, UniqueIndices);
+
+	std::vector<uint32_t> Lods[LodsCount];
+	SimplifyLods(UniqueVertices, UniqueIndices, Lods);
+
+	AddMesh(Geometry, UniqueVertices, Lods, SphereCenter, SphereRadius);
+}
+
+struct SCell
+{
+	vec3 BoundsMin;
+	uint32_t FirstDraw;
+	vec3 BoundsMax;
+	uint32_t DrawCount;
+};
+
+struct SCellGrid
+{
+	vec3 Origin;
+	float CellSize;
+	uint32_t ResolutionX, ResolutionY, ResolutionZ;
+
+	bool bMortonOrder;
+
+	vec4 Quantization; // Frame of the packed draw positions, xyz = origin, w = size of one of the 1024 cells per axis
+
+	std::vector<SCell> Cells;
+	std::vector<uint32_t> CellKeys;
+	std::vector<uint32_t> DrawRemap; // Draw ID in generation order -> index in the sorted MeshDraws
+
+	double NeighbourDistance; // Average distance between draws that end up in neighbouring cull invocations
+};
+
+// Spreads the low 10 bits so two zero bits follow each of them
+uint32_t SpreadBits(uint32_t V)
+{
+	V &= 0x3FF;
+	V = (V | (V << 16)) & 0x030000FF;
+	V = (V | (V << 8)) & 0x0300F00F;
+	V = (V | (V << 4)) & 0x030C30C3;
+	V = (V | (V << 2)) & 0x09249249;
+
+	return V;
+}
+
+uint32_t GetCellKey(const SCellGrid& Grid, vec3 Position)
+{
+	vec3 GridPosition = (Position - Grid.Origin) / Grid.CellSize;
+
+	uint32_t X = (uint32_t)glm::clamp(int(GridPosition.x), 0, int(Grid.ResolutionX) - 1);
+	uint32_t Y = (uint32_t)glm::clamp(int(GridPosition.y), 0, int(Grid.ResolutionY) - 1);
+	uint32_t Z = (uint32_t)glm::clamp(int(GridPosition.z), 0, int(Grid.ResolutionZ) - 1);
+
+	if (Grid.bMortonOrder)
+		return SpreadBits(X) | (SpreadBits(Y) << 1) | (SpreadBits(Z) << 2);
+
+	return X + Grid.ResolutionX * (Y + Grid.ResolutionY * Z);
+}
+
+// Loose grid over the draws: every draw goes to the cell containing its position and MeshDraws get sorted so each cell owns a contiguous range.
+// Only non-empty cells are stored. Bounds are left for CellRefitPipeline, which fits them to the draw spheres on the GPU.
+// With bSpatialSort cells go in Morton order and draws inside a cell in meshopt_spatialSortRemap order, so neighbouring cull invocations
+// test nearby objects, touch the same Hi-Z texels and mostly agree on visibility
+SCellGrid BuildCellGrid(std::vector<SMeshDraw>& MeshDraws, uint32_t DrawsPerCell, bool bSpatialSort)
+{
+	SCellGrid Grid = {};
+	Grid.bMortonOrder = bSpatialSort;
+
+	vec3 SceneMin = vec3(FLT_MAX);
+	vec3 SceneMax = vec3(-FLT_MAX);
+	for (uint32_t I = 0; I < MeshDraws.size(); I++)
+	{
+		SceneMin = glm::min(SceneMin, MeshDraws[I].Position);
+		SceneMax = glm::max(SceneMax, MeshDraws[I].Position);
+	}
+
+	vec3 SceneExtent = glm::max(SceneMax - SceneMin, vec3(0.001f));
+	float MaxExtent = std::max(SceneExtent.x, std::max(SceneExtent.y, SceneExtent.z));
+	float TargetCellsCount = std::max(1.0f, float(MeshDraws.size()) / float(DrawsPerCell));
+
+	// Keep flat scenes from exploding the resolution on the other axes
+	const float MaxResolution = 1024.0f;
+	Grid.CellSize = std::max(cbrtf(SceneExtent.x * SceneExtent.y * SceneExtent.z / TargetCellsCount), MaxExtent / MaxResolution);
+	Grid.Origin = SceneMin;
+	Grid.ResolutionX = std::max(1u, (uint32_t)ceilf(SceneExtent.x / Grid.CellSize));
+	Grid.ResolutionY = std::max(1u, (uint32_t)ceilf(SceneExtent.y / Grid.CellSize));
+	Grid.ResolutionZ = std::max(1u, (uint32_t)ceilf(SceneExtent.z / Grid.CellSize));
+	Grid.Quantization = vec4(Grid.Origin, Grid.CellSize);
+
+	std::vector<uint32_t> Keys(MeshDraws.size());
+	std::vector<uint32_t> Order(MeshDraws.size());
+	for (uint32_t I = 0; I < MeshDraws.size(); I++)
+	{
+		Keys[I] = GetCellKey(Grid, MeshDraws[I].Position);
+		Order[I] = I;
+	}
+
+	if (bSpatialSort && !MeshDraws.empty())
+	{
+		std::vector<uint32_t> SpatialRemap(MeshDraws.size());
+		meshopt_spatialSortRemap(SpatialRemap.data(), &MeshDraws[0].Position.x, MeshDraws.size(), sizeof(SMeshDraw));
+		for (uint32_t I = 0; I < MeshDraws.size(); I++)
+			Order[SpatialRemap[I]] = I;
+	}
+	std::stable_sort(Order.begin(), Order.end(), [&Keys](uint32_t A, uint32_t B) { return Keys[A] < Keys[B]; });
+
+	Grid.DrawRemap.resize(MeshDraws.size());
+	std::vector<SMeshDraw> SortedMeshDraws(MeshDraws.size());
+	for (uint32_t I = 0; I < MeshDraws.size(); I++)
+	{
+		SortedMeshDraws[I] = MeshDraws[Order[I]];
+		Grid.DrawRemap[Order[I]] = I;
+
+		uint32_t Key = Keys[Order[I]];
+		if (Grid.CellKeys.empty() || (Grid.CellKeys.back() != Key))
 		{
-			uint32_t PrevIndexCount = Geometry.Indices.size();
-			Geometry.Indices.insert(Geometry.Indices.end(), UniqueIndices.begin(), UniqueIndices.end());
-			
-			Mesh.IndexOffset[I] = PrevIndexCount;
-			Mesh.IndexCount[I] = UniqueIndices.size();
+			SCell Cell = {};
+			Cell.FirstDraw = I;
+
+			Grid.Cells.push_back(Cell);
+			Grid.CellKeys.push_back(Key);
 		}
-		else
-		{
-			size_t NextIndicesTarget = size_t(0.75*double(LodIncides.size()));
-			size_t NewIndicesCount = meshopt_simplify(LodIncides.data(), LodIncides.data(), LodIncides.size(), (float*)UniqueVertices.data(), UniqueVertices.size(), sizeof(SVertex), NextIndicesTarget, 0.2f);
-			Assert(NewIndicesCount < LodIncides.size())
+		Grid.Cells.back().DrawCount++;
+	}
+	MeshDraws.swap(SortedMeshDraws);
+
+	double NeighbourDistance = 0.0;
+	for (uint32_t I = 1; I < MeshDraws.size(); I++)
+		NeighbourDistance += glm::length(MeshDraws[I].Position - MeshDraws[I - 1].Position);
+	Grid.NeighbourDistance = (MeshDraws.size() > 1) ? NeighbourDistance / (MeshDraws.size() - 1) : 0.0;
+
+	return Grid;
+}
+
+// Stretches the packed position frame over Min, Max, which has to hold every position a draw can be moved or spawned to.
+// The cells of the frame are only a position encoding, culling still uses the cells from BuildCellGrid
+void FitQuantization(SCellGrid& Grid, vec3 Min, vec3 Max)
+{
+	vec3 Extent = glm::max(Max - Min, vec3(0.001f));
+	Grid.Quantization = vec4(Min, std::max(Extent.x, std::max(Extent.y, Extent.z)) / 1023.0f);
+}
+
+// Quantized draw, see common.h for the layout. Positions are relative to a cell of SCellGrid::Quantization
+struct SPackedMeshDraw
+{
+	uint32_t Data[6];
+};
+
+// Smallest three with 16 bit components, decodable with meshopt_decodeFilterQuat
+void EncodeQuaternion(int16_t Result[4], quat Q)
+{
+	float Components[4] = { Q.x, Q.y, Q.z, Q.w };
+
+	int MaxComponent = 0;
+	for (int I = 1; I < 4; I++)
+	{
+		if (fabsf(Components[I]) > fabsf(Components[MaxComponent]))
+			MaxComponent = I;
+	}
+
+	// Q and -Q are the same rotation, so the reconstructed component is always positive
+	float Scale = (Components[MaxComponent] < 0.0f) ? -sqrtf(2.0f) : sqrtf(2.0f);
+	for (int I = 0; I < 3; I++)
+	{
+		float Value = glm::clamp(Components[(MaxComponent + I + 1) & 3] * Scale, -1.0f, 1.0f);
+		Result[I] = (int16_t)roundf(Value * 32767.0f);
+	}
+	Result[3] = (int16_t)((32767 & ~3) | MaxComponent);
+}
+
+// Draws have to stay inside Grid.Quantization, see FitQuantization
+SPackedMeshDraw PackMeshDraw(const SMeshDraw& MeshDraw, const SCellGrid& Grid)
+{
+	Assert(MeshDraw.MeshIndex <= 0xFFFF);
+
+	vec3 GridPosition = (MeshDraw.Position - vec3(Grid.Quantization)) / Grid.Quantization.w;
+	Assert(glm::all(glm::greaterThanEqual(GridPosition, vec3(-1e-3f))) && glm::all(glm::lessThan(GridPosition, vec3(1024.0f))));
+
+	uint32_t CellX = (uint32_t)glm::clamp(int(GridPosition.x), 0, 1023);
+	uint32_t CellY = (uint32_t)glm::clamp(int(GridPosition.y), 0, 1023);
+	uint32_t CellZ = (uint32_t)glm::clamp(int(GridPosition.z), 0, 1023);
+
+	const float FixedMax = float((1 << 21) - 1);
+	vec3 Fraction = glm::clamp(GridPosition - vec3(float(CellX), float(CellY), float(CellZ)), vec3(0.0f), vec3(1.0f));
+	uint32_t X = (uint32_t)(Fraction.x * FixedMax + 0.5f);
+	uint32_t Y = (uint32_t)(Fraction.y * FixedMax + 0.5f);
+	uint32_t Z = (uint32_t)(Fraction.z * FixedMax + 0.5f);
+
+	vec3 Q = MeshDraw.Orientation;
+	int16_t Orientation[4];
+	EncodeQuaternion(Orientation, quat(sqrtf(std::max(0.0f, 1.0f - glm::dot(Q, Q))), Q.x, Q.y, Q.z));
+
+	SPackedMeshDraw Result = {};
+	Result.Data[0] = X | (Y << 21);
+	Result.Data[1] = (Y >> 11) | (Z << 10);
+	Result.Data[2] = CellX | (CellY << 10) | (CellZ << 20);
+	Result.Data[3] = uint32_t(uint16_t(Orientation[0])) | (uint32_t(uint16_t(Orientation[1])) << 16);
+	Result.Data[4] = uint32_t(uint16_t(Orientation[2])) | (uint32_t(uint16_t(Orientation[3])) << 16);
+	Result.Data[5] = glm::packHalf1x16(MeshDraw.Scale) | (MeshDraw.MeshIndex << 16);
+
+	return Result;
+}
+
+// Packs the draws and prints the worst position and rotation error, orientations are checked with meshopt_decodeFilterQuat
+std::vector<SPackedMeshDraw> PackMeshDraws(const std::vector<SMeshDraw>& MeshDraws, const SCellGrid& Grid)
+{
+	std::vector<SPackedMeshDraw> PackedMeshDraws(MeshDraws.size());
+	std::vector<int16_t> Orientations(((MeshDraws.size() + 3) & ~3) * 4);
+
+	float MaxPositionError = 0.0f;
+	for (uint32_t I = 0; I < MeshDraws.size(); I++)
+	{
+		const SPackedMeshDraw& Packed = PackedMeshDraws[I] = PackMeshDraw(MeshDraws[I], Grid);
+		memcpy(&Orientations[4 * I], &Packed.Data[3], 4 * sizeof(int16_t));
+
+		uint32_t X = Packed.Data[0] & 0x1FFFFF;
+		uint32_t Y = (Packed.Data[0] >> 21) | ((Packed.Data[1] & 0x3FF) << 11);
+		uint32_t Z = (Packed.Data[1] >> 10) & 0x1FFFFF;
+		vec3 Cell = vec3(float(Packed.Data[2] & 0x3FF), float((Packed.Data[2] >> 10) & 0x3FF), float((Packed.Data[2] >> 20) & 0x3FF));
+		vec3 Position = vec3(Grid.Quantization) + (Cell + vec3(float(X), float(Y), float(Z)) / float((1 << 21) - 1)) * Grid.Quantization.w;
+		MaxPositionError = std::max(MaxPositionError, glm::length(Position - MeshDraws[I].Position));
+	}
+
+	meshopt_decodeFilterQuat(Orientations.data(), Orientations.size() / 4, 4 * sizeof(int16_t));
+
+	float MaxAngleError = 0.0f;
+	for (uint32_t I = 0; I < MeshDraws.size(); I++)
+	{
+		vec3 Q = MeshDraws[I].Orientation;
+		vec4 Original = vec4(Q, sqrtf(std::max(0.0f, 1.0f - glm::dot(Q, Q))));
+		vec4 Decoded = glm::normalize(vec4(Orientations[4*I + 0], Orientations[4*I + 1], Orientations[4*I + 2], Orientations[4*I + 3]));
+
+		float Cos = glm::min(1.0f, fabsf(glm::dot(Original, Decoded)));
+		MaxAngleError = std::max(MaxAngleError, glm::degrees(2.0f * acosf(Cos)));
+	}
+
+	printf("Quantized draws: %u bytes per draw, max position error %f, max rotation error %f degrees\n", (uint32_t)sizeof(SPackedMeshDraw), MaxPositionError, MaxAngleError);
+
+	return PackedMeshDraws;
+}
+
+// Free draw slot, see common.h
+const uint32_t DeadMeshIndex = 0xFFFF;
+const uint32_t MaxDrawUpdates = 65536;
+
+// Advanced on the GPU by the animation pass, all zero for static draws
+struct SMotion
+{
+	vec4 LinearVelocity; // w = orbit speed, radians per second around the vertical axis through OrbitCenter
+	vec4 AngularVelocity; // xyz = rotation axis * radians per second
+	vec4 OrbitCenter;
+};
+
+// Same layout as SDrawUpdate in cull.h, Data holds the draw in the layout the shaders were specialized for
+struct SDrawUpdate
+{
+	uint32_t DrawIndex;
+	uint32_t CellIndex;
+	uint32_t CellDrawCount;
+	uint32_t Data[8];
+};
+
+// Update buffer: DrawUpdateCount, DirtyCellCount, MotionUpdateCount, 1 uint of padding, DirtyCells[MaxDrawUpdates], DrawUpdates[MaxDrawUpdates],
+// MotionUpdates[MaxDrawUpdates]. Motions are sent only when the animation pass runs, one per draw update
+const uint32_t DrawUpdateBufferSize = 4 * sizeof(uint32_t) + MaxDrawUpdates * (sizeof(uint32_t) + sizeof(SDrawUpdate) + sizeof(SMotion));
+
+// Draws addressed by stable handles. Every cell owns a range of MeshDrawBuffer slots with spare room for spawns,
+// and only [FirstDraw, FirstDraw + DrawCount) of it, the live range, is culled.
+// Changed slots are sent to the GPU once per frame and applied by DrawUpdatePipeline
+struct SInstances
+{
+	SCellGrid Grid;
+
+	std::vector<SMeshDraw> Slots; // Free slots have MeshIndex == DeadMeshIndex
+	std::vector<SMotion> Motions;
+	std::vector<uint32_t> SlotCells;
+	std::vector<uint32_t> SlotHandles;
+
+	std::vector<uint32_t> HandleSlots; // ~0u for despawned handles
+	std::vector<uint32_t> FreeHandles;
+
+	std::vector<uint32_t> CellCapacities;
+	std::vector<std::vector<uint32_t>> CellFreeSlots; // Sorted from high to low, so the lowest slot is reused first and live ranges stay short
+	uint32_t SpawnCursor;
+
+	std::vector<uint32_t> DirtySlots;
+	std::vector<bool> bSlotDirty;
+	std::vector<bool> bCellDirty;
+};
+
+// MeshDraws and Grid come from BuildCellGrid, handles of the initial draws are their indices in generation order
+void CreateInstances(SInstances& Instances, const std::vector<SMeshDraw>& MeshDraws, const SCellGrid& Grid, uint32_t SpareSlotsPerCell)
+{
+	Instances.Grid = Grid;
+	Instances.SpawnCursor = 0;
+
+	SMeshDraw DeadDraw = {};
+	DeadDraw.MeshIndex = DeadMeshIndex;
 
-			LodIncides.resize(NewIndicesCount);
-			meshopt_optimizeVertexCache(LodIncides.data(), LodIncides.data(), NewIndicesCount, UniqueVerticesCount);
+	uint32_t CellsCount = (uint32_t)Grid.Cells.size();
+	Instances.CellCapacities.resize(CellsCount);
+	Instances.CellFreeSlots.resize(CellsCount);
+	Instances.bCellDirty.assign(CellsCount, false);
 
-			uint32_t PrevIndexCount = Geometry.Indices.size();
-			Geometry.Indices.insert(Geometry.Indices.end(), LodIncides.begin(), LodIncides.end());
+	std::vector<uint32_t> SortedDrawSlots(MeshDraws.size());
+	for (uint32_t CellIndex = 0; CellIndex < CellsCount; CellIndex++)
+	{
+		SCell& Cell = Instances.Grid.Cells[CellIndex];
+		uint32_t FirstSlot = (uint32_t)Instances.Slots.size();
+		uint32_t Capacity = Cell.DrawCount + SpareSlotsPerCell;
 
-			Mesh.IndexOffset[I] = PrevIndexCount;
-			Mesh.IndexCount[I] = NewIndicesCount;
+		for (uint32_t I = 0; I < Cell.DrawCount; I++)
+		{
+			SortedDrawSlots[Cell.FirstDraw + I] = FirstSlot + I;
+			Instances.Slots.push_back(MeshDraws[Cell.FirstDraw + I]);
 		}
+		Instances.Slots.resize(FirstSlot + Capacity, DeadDraw);
+		Instances.Motions.resize(FirstSlot + Capacity, SMotion());
+		Instances.SlotCells.resize(FirstSlot + Capacity, CellIndex);
+
+		for (uint32_t I = Capacity; I > Cell.DrawCount; I--)
+			Instances.CellFreeSlots[CellIndex].push_back(FirstSlot + I - 1);
+
+		Cell.FirstDraw = FirstSlot;
+		Instances.CellCapacities[CellIndex] = Capacity;
 	}
-	
-	Geometry.Meshes.push_back(Mesh);
+
+	Instances.SlotHandles.assign(Instances.Slots.size(), ~0u);
+	Instances.HandleSlots.resize(MeshDraws.size());
+	for (uint32_t Handle = 0; Handle < MeshDraws.size(); Handle++)
+	{
+		uint32_t Slot = SortedDrawSlots[Grid.DrawRemap[Handle]];
+		Instances.HandleSlots[Handle] = Slot;
+		Instances.SlotHandles[Slot] = Handle;
+	}
+
+	Instances.bSlotDirty.assign(Instances.Slots.size(), false);
 }
 
-VkPipeline CreateGraphicsPipeline(VkDevice Device, VkRenderPass RenderPass, VkPipelineLayout PipelineLayout, VkShaderModule VS, VkShaderModule FS)
+void MarkSlotDirty(SInstances& Instances, uint32_t Slot)
 {
-	VkPipelineShaderStageCreateInfo ShaderStages[2] = {};
-	ShaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-	ShaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
-	ShaderStages[0].module = VS;
-	ShaderStages[0].pName = "main";
-	ShaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-	ShaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-	ShaderStages[1].module = FS;
-	ShaderStages[1].pName = "main";
+	if (!Instances.bSlotDirty[Slot])
+	{
+		Instances.bSlotDirty[Slot] = true;
+		Instances.DirtySlots.push_back(Slot);
+	}
+}
 
-	VkVertexInputBindingDescription BindingDescr = {};
-	BindingDescr.binding = 0;
-	BindingDescr.stride = sizeof(SVertex);
-	BindingDescr.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+// Takes the lowest free slot of the cell at the draw position. Spawns outside of the populated cells or into full ones go to the next cell
+// with room, the loose cell bounds still cover them after the refit
+uint32_t SpawnInstance(SInstances& Instances, const SMeshDraw& MeshDraw, const SMotion& Motion = SMotion())
+{
+	Assert(MeshDraw.MeshIndex != DeadMeshIndex);
 
-	VkVertexInputAttributeDescription AttributeDescrs[2] = {};
-	AttributeDescrs[0].location = 0;
-	AttributeDescrs[0].binding = 0;
-	AttributeDescrs[0].format = VK_FORMAT_R32G32B32_SFLOAT;
-	AttributeDescrs[0].offset = 0;
-	AttributeDescrs[1].location = 1;
-	AttributeDescrs[1].binding = 0;
-	AttributeDescrs[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-	AttributeDescrs[1].offset = OffsetOf(SVertex, Normal);
+	uint32_t CellIndex = ~0u;
+	uint32_t Key = GetCellKey(Instances.Grid, MeshDraw.Position);
+	std::vector<uint32_t>::const_iterator KeyIt = std::lower_bound(Instances.Grid.CellKeys.begin(), Instances.Grid.CellKeys.end(), Key);
+	if ((KeyIt != Instances.Grid.CellKeys.end()) && (*KeyIt == Key) && !Instances.CellFreeSlots[KeyIt - Instances.Grid.CellKeys.begin()].empty())
+	{
+		CellIndex = uint32_t(KeyIt - Instances.Grid.CellKeys.begin());
+	}
+	else
+	{
+		uint32_t CellsCount = (uint32_t)Instances.Grid.Cells.size();
+		for (uint32_t I = 0; (I < CellsCount) && (CellIndex == ~0u); I++)
+		{
+			uint32_t Candidate = (Instances.SpawnCursor + I) % CellsCount;
+			if (!Instances.CellFreeSlots[Candidate].empty())
+			{
+				CellIndex = Candidate;
+				Instances.SpawnCursor = Candidate;
+			}
+		}
+	}
+	Assert(CellIndex != ~0u);
 
-	VkPipelineVertexInputStateCreateInfo VertexInputInfo = { VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
-	VertexInputInfo.vertexBindingDescriptionCount = 1;
-	VertexInputInfo.pVertexBindingDescriptions = &BindingDescr;
-	VertexInputInfo.vertexAttributeDescriptionCount = ArrayCount(AttributeDescrs);
-	VertexInputInfo.pVertexAttributeDescriptions = AttributeDescrs;
+	uint32_t Slot = Instances.CellFreeSlots[CellIndex].back();
+	Instances.CellFreeSlots[CellIndex].pop_back();
 
-	VkPipelineInputAssemblyStateCreateInfo InputAssemblyInfo = { VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO };
-	InputAssemblyInfo.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	uint32_t Handle = 0;
+	if (!Instances.FreeHandles.empty())
+	{
+		Handle = Instances.FreeHandles.back();
+		Instances.FreeHandles.pop_back();
+	}
+	else
+	{
+		Handle = (uint32_t)Instances.HandleSlots.size();
+		Instances.HandleSlots.push_back(~0u);
+	}
 
-	VkPipelineViewportStateCreateInfo ViewportStateInfo = { VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO };
-	ViewportStateInfo.viewportCount = 1;
-	ViewportStateInfo.scissorCount = 1;
+	Instances.HandleSlots[Handle] = Slot;
+	Instances.SlotHandles[Slot] = Handle;
+	Instances.Slots[Slot] = MeshDraw;
+	Instances.Motions[Slot] = Motion;
 
-	VkPipelineRasterizationStateCreateInfo RasterizationStateInfo = { VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO };
-	RasterizationStateInfo.polygonMode = VK_POLYGON_MODE_FILL;
-	RasterizationStateInfo.cullMode = VK_CULL_MODE_NONE;
-	RasterizationStateInfo.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-	RasterizationStateInfo.lineWidth = 1.0f;
+	SCell& Cell = Instances.Grid.Cells[CellIndex];
+	Cell.DrawCount = std::max(Cell.DrawCount, Slot - Cell.FirstDraw + 1);
+	MarkSlotDirty(Instances, Slot);
 
-	VkPipelineMultisampleStateCreateInfo MultisampleStateInfo = { VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO };
-	MultisampleStateInfo.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+	return Handle;
+}
 
-	VkPipelineDepthStencilStateCreateInfo DepthStencilStateInfo = { VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO };
-	DepthStencilStateInfo.depthTestEnable = VK_TRUE;
-	DepthStencilStateInfo.depthWriteEnable = VK_TRUE;
-	DepthStencilStateInfo.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
-	DepthStencilStateInfo.stencilTestEnable = VK_FALSE;
+void DespawnInstance(SInstances& Instances, uint32_t Handle)
+{
+	uint32_t Slot = Instances.HandleSlots[Handle];
+	Assert(Slot != ~0u);
+
+	uint32_t CellIndex = Instances.SlotCells[Slot];
+	Instances.Slots[Slot] = SMeshDraw();
+	Instances.Slots[Slot].MeshIndex = DeadMeshIndex;
+	Instances.Motions[Slot] = SMotion();
+	Instances.SlotHandles[Slot] = ~0u;
+	Instances.HandleSlots[Handle] = ~0u;
+	Instances.FreeHandles.push_back(Handle);
+
+	std::vector<uint32_t>& FreeSlots = Instances.CellFreeSlots[CellIndex];
+	FreeSlots.insert(std::lower_bound(FreeSlots.begin(), FreeSlots.end(), Slot, std::greater<uint32_t>()), Slot);
+
+	// Trim the live range to the last live slot
+	SCell& Cell = Instances.Grid.Cells[CellIndex];
+	while ((Cell.DrawCount > 0) && (Instances.Slots[Cell.FirstDraw + Cell.DrawCount - 1].MeshIndex == DeadMeshIndex))
+		Cell.DrawCount--;
+
+	MarkSlotDirty(Instances, Slot);
+}
 
-	VkPipelineColorBlendAttachmentState ColorAttachmentState = {};
-	ColorAttachmentState.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+// The draw stays in its cell, cell refit grows the bounds if it leaves it
+void MoveInstance(SInstances& Instances, uint32_t Handle, vec3 Position, quat Orientation)
+{
+	uint32_t Slot = Instances.HandleSlots[Handle];
+	Assert(Slot != ~0u);
 
-	VkPipelineColorBlendStateCreateInfo ColorBlendStateInfo = { VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO };
-	ColorBlendStateInfo.attachmentCount = 1;
-	ColorBlendStateInfo.pAttachments = &ColorAttachmentState;
+	Instances.Slots[Slot].Position = Position;
+	Instances.Slots[Slot].Orientation = PackOrientation(Orientation);
+	MarkSlotDirty(Instances, Slot);
+}
 
-	VkDynamicState DynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
-	VkPipelineDynamicStateCreateInfo dynamicStateInfo = { VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO };
-	dynamicStateInfo.dynamicStateCount = ArrayCount(DynamicStates);
-	dynamicStateInfo.pDynamicStates = DynamicStates;
+// The animation pass changes transforms only on the GPU, so this also resets the draw to its last CPU side transform
+void SetInstanceMotion(SInstances& Instances, uint32_t Handle, const SMotion& Motion)
+{
+	uint32_t Slot = Instances.HandleSlots[Handle];
+	Assert(Slot != ~0u);
 
-	VkGraphicsPipelineCreateInfo CreateInfo = { VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO };
-	CreateInfo.stageCount = ArrayCount(ShaderStages);
-	CreateInfo.pStages = ShaderStages;
-	CreateInfo.pVertexInputState = &VertexInputInfo;
-	CreateInfo.pInputAssemblyState = &InputAssemblyInfo;
-	CreateInfo.pViewportState = &ViewportStateInfo;
-	CreateInfo.pRasterizationState = &RasterizationStateInfo;
-	CreateInfo.pMultisampleState = &MultisampleStateInfo;
-	CreateInfo.pDepthStencilState = &DepthStencilStateInfo;
-	CreateInfo.pColorBlendState = &ColorBlendStateInfo;
-	CreateInfo.pDynamicState = &dynamicStateInfo;
-	CreateInfo.layout = PipelineLayout;
-	CreateInfo.renderPass = RenderPass;
+	Instances.Motions[Slot] = Motion;
+	MarkSlotDirty(Instances, Slot);
+}
 
-	VkPipeline GraphicsPipeline = 0;
-	VkCheck(vkCreateGraphicsPipelines(Device, 0, 1, &CreateInfo, 0, &GraphicsPipeline));
-	Assert(GraphicsPipeline);
+// Writes up to MaxDrawUpdates changed slots and their cells to the mapped update buffer, the rest waits for the next frame.
+// RefitCells are listed as dirty every frame, for cells whose draws are moved on the GPU
+void FlushInstanceUpdates(SInstances& Instances, void* UpdateBufferData, bool bQuantizedDraws, bool bMotions, const std::vector<uint32_t>& RefitCells, uint32_t& DrawUpdateCount, uint32_t& DirtyCellCount)
+{
+	uint32_t* Counts = (uint32_t*)UpdateBufferData;
+	uint32_t* DirtyCells = Counts + 4;
+	SDrawUpdate* DrawUpdates = (SDrawUpdate*)(DirtyCells + MaxDrawUpdates);
+	SMotion* MotionUpdates = (SMotion*)(DrawUpdates + MaxDrawUpdates);
+
+	Assert(RefitCells.size() <= MaxDrawUpdates);
+	DrawUpdateCount = std::min((uint32_t)Instances.DirtySlots.size(), MaxDrawUpdates - (uint32_t)RefitCells.size());
+	DirtyCellCount = 0;
+	for (uint32_t I = 0; I < DrawUpdateCount; I++)
+	{
+		uint32_t Slot = Instances.DirtySlots[I];
+		uint32_t CellIndex = Instances.SlotCells[Slot];
+
+		SDrawUpdate& Update = DrawUpdates[I];
+		Update.DrawIndex = Slot;
+		Update.CellIndex = CellIndex;
+		Update.CellDrawCount = Instances.Grid.Cells[CellIndex].DrawCount;
+		if (bMotions)
+			MotionUpdates[I] = Instances.Motions[Slot];
+		if (bQuantizedDraws)
+		{
+			SPackedMeshDraw Packed = PackMeshDraw(Instances.Slots[Slot], Instances.Grid);
+			memcpy(Update.Data, Packed.Data, sizeof(Packed.Data));
+		}
+		else
+		{
+			memcpy(Update.Data, &Instances.Slots[Slot], sizeof(SMeshDraw));
+		}
 
-	return GraphicsPipeline;
+		if (!Instances.bCellDirty[CellIndex])
+		{
+			Instances.bCellDirty[CellIndex] = true;
+			DirtyCells[DirtyCellCount++] = CellIndex;
+		}
+		Instances.bSlotDirty[Slot] = false;
+	}
+
+	for (uint32_t I = 0; I < RefitCells.size(); I++)
+	{
+		if (!Instances.bCellDirty[RefitCells[I]])
+		{
+			Instances.bCellDirty[RefitCells[I]] = true;
+			DirtyCells[DirtyCellCount++] = RefitCells[I];
+		}
+	}
+
+	for (uint32_t I = 0; I < DirtyCellCount; I++)
+		Instances.bCellDirty[DirtyCells[I]] = false;
+	Instances.DirtySlots.erase(Instances.DirtySlots.begin(), Instances.DirtySlots.begin() + DrawUpdateCount);
+
+	Counts[0] = DrawUpdateCount;
+	Counts[1] = DirtyCellCount;
+	Counts[2] = bMotions ? DrawUpdateCount : 0;
 }
 
-VkPipeline CreateComputePipeline(VkDevice Device, VkPipelineLayout PipelineLayout, VkShaderModule CS)
+// Same layout as SNode in cull.h, the transform is relative to the parent
+struct SNode
 {
-	VkPipelineShaderStageCreateInfo ShaderStage = { VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO };
-	ShaderStage.flags;
-	ShaderStage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-	ShaderStage.module = CS;
-	ShaderStage.pName = "main";
-	
-	VkComputePipelineCreateInfo CreateInfo = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
-	CreateInfo.stage = ShaderStage;
+	vec3 Position;
+	float Scale;
+	quat Orientation;
+	uint32_t Parent; // ~0u for roots
+	uint32_t DrawIndex; // Draw slot that follows the node, ~0u for none
+	uint32_t Padding[2];
+};
+
+struct SNodeWorld
+{
+	vec3 Position;
+	float Scale;
+	quat Orientation;
+};
+
+// Transform hierarchy in flat arrays. Once sorted, nodes are stored level by level and LevelFirstNodes has the start of every level
+// plus the end of the last one, so each level is one dispatch that reads only the previous level
+struct SHierarchy
+{
+	std::vector<SNode> Nodes;
+	std::vector<uint32_t> LevelFirstNodes;
+
+	std::vector<uint32_t> DrawCells; // Cells of the draw slots moved by the nodes, the only ones refit after the hierarchy pass
+};
+
+// Parent has to be added before its children
+uint32_t AddNode(SHierarchy& Hierarchy, uint32_t Parent, vec3 Position, float Scale, quat Orientation, uint32_t DrawIndex)
+{
+	Assert((Parent == ~0u) || (Parent < Hierarchy.Nodes.size()));
+
+	SNode Node = {};
+	Node.Position = Position;
+	Node.Scale = Scale;
+	Node.Orientation = Orientation;
+	Node.Parent = Parent;
+	Node.DrawIndex = DrawIndex;
+	Hierarchy.Nodes.push_back(Node);
+
+	return uint32_t(Hierarchy.Nodes.size() - 1);
+}
+
+// Returns the new index of every node
+std::vector<uint32_t> SortHierarchyLevels(SHierarchy& Hierarchy)
+{
+	uint32_t NodesCount = (uint32_t)Hierarchy.Nodes.size();
+
+	std::vector<uint32_t> Levels(NodesCount);
+	uint32_t LevelsCount = 0;
+	for (uint32_t I = 0; I < NodesCount; I++)
+	{
+		uint32_t Parent = Hierarchy.Nodes[I].Parent;
+		Levels[I] = (Parent == ~0u) ? 0 : Levels[Parent] + 1;
+		LevelsCount = std::max(LevelsCount, Levels[I] + 1);
+	}
+
+	std::vector<uint32_t> Order(NodesCount);
+	for (uint32_t I = 0; I < NodesCount; I++)
+		Order[I] = I;
+	std::stable_sort(Order.begin(), Order.end(), [&Levels](uint32_t A, uint32_t B) { return Levels[A] < Levels[B]; });
+
+	std::vector<uint32_t> Remap(NodesCount);
+	for (uint32_t I = 0; I < NodesCount; I++)
+		Remap[Order[I]] = I;
+
+	std::vector<SNode> SortedNodes(NodesCount);
+	Hierarchy.LevelFirstNodes.assign(LevelsCount + 1, NodesCount);
+	for (uint32_t I = NodesCount; I > 0; I--)
+	{
+		SNode Node = Hierarchy.Nodes[Order[I - 1]];
+		if (Node.Parent != ~0u)
+			Node.Parent = Remap[Node.Parent];
+
+		SortedNodes[I - 1] = Node;
+		Hierarchy.LevelFirstNodes[Levels[Order[I - 1]]] = I - 1;
+	}
+	Hierarchy.Nodes.swap(SortedNodes);
+
+	return Remap;
+}
+
+// CPU version of hierarchy.comp, used to place the attached draws before the first frame
+std::vector<SNodeWorld> ComputeWorldTransforms(const SHierarchy& Hierarchy)
+{
+	std::vector<SNodeWorld> Worlds(Hierarchy.Nodes.size());
+	for (uint32_t I = 0; I < Hierarchy.Nodes.size(); I++)
+	{
+		const SNode& Node = Hierarchy.Nodes[I];
+
+		SNodeWorld& World = Worlds[I];
+		World.Position = Node.Position;
+		World.Scale = Node.Scale;
+		World.Orientation = Node.Orientation;
+		if (Node.Parent != ~0u)
+		{
+			const SNodeWorld& Parent = Worlds[Node.Parent];
+			World.Position = Parent.Position + Parent.Orientation * (Parent.Scale * Node.Position);
+			World.Scale = Parent.Scale * Node.Scale;
+			World.Orientation = glm::normalize(Parent.Orientation * Node.Orientation);
+		}
+	}
+
+	return Worlds;
+}
+
+// Persistent worker threads, RunParallel calls the job once on every worker and once on the calling thread, which gets index 0
+struct SWorkerPool
+{
+	std::vector<std::thread> Threads;
+
+	std::mutex Mutex;
+	std::condition_variable WorkCondition;
+	std::condition_variable DoneCondition;
+	std::function<void(uint32_t)> Job;
+	uint64_t Generation;
+	uint32_t RunningCount;
+	bool bQuit;
+};
+
+void WorkerThread(SWorkerPool* Pool, uint32_t ThreadIndex)
+{
+	char ThreadName[32];
+	snprintf(ThreadName, sizeof(ThreadName), "Worker %u", ThreadIndex);
+	SetCpuThreadName(ThreadName);
+
+	uint64_t Generation = 0;
+	for (;;)
+	{
+		std::function<void(uint32_t)> Job;
+		{
+			std::unique_lock<std::mutex> Lock(Pool->Mutex);
+			Pool->WorkCondition.wait(Lock, [Pool, Generation] { return Pool->bQuit || (Pool->Generation != Generation); });
+			if (Pool->bQuit)
+				return;
+
+			Generation = Pool->Generation;
+			Job = Pool->Job;
+		}
+
+		Job(ThreadIndex);
+
+		std::lock_guard<std::mutex> Lock(Pool->Mutex);
+		if (--Pool->RunningCount == 0)
+			Pool->DoneCondition.notify_one();
+	}
+}
+
+// ThreadsCount includes the calling thread
+void CreateWorkerPool(SWorkerPool& Pool, uint32_t ThreadsCount)
+{
+	Pool.Generation = 0;
+	Pool.RunningCount = 0;
+	Pool.bQuit = false;
+	for (uint32_t I = 1; I < ThreadsCount; I++)
+		Pool.Threads.emplace_back(WorkerThread, &Pool, I);
+}
+
+void DestroyWorkerPool(SWorkerPool& Pool)
+{
+	{
+		std::lock_guard<std::mutex> Lock(Pool.Mutex);
+		Pool.bQuit = true;
+	}
+	Pool.WorkCondition.notify_all();
+
+	for (uint32_t I = 0; I < Pool.Threads.size(); I++)
+		Pool.Threads[I].join();
+	Pool.Threads.clear();
+}
+
+uint32_t GetThreadsCount(const SWorkerPool& Pool)
+{
+	return (uint32_t)Pool.Threads.size() + 1;
+}
+
+void RunParallel(SWorkerPool& Pool, const std::function<void(uint32_t)>& Job)
+{
+	{
+		std::lock_guard<std::mutex> Lock(Pool.Mutex);
+		Pool.Job = Job;
+		Pool.Generation++;
+		Pool.RunningCount = (uint32_t)Pool.Threads.size();
+	}
+	Pool.WorkCondition.notify_all();
+
+	Job(0);
+
+	std::unique_lock<std::mutex> Lock(Pool.Mutex);
+	Pool.DoneCondition.wait(Lock, [&Pool] { return Pool.RunningCount == 0; });
+}
+
+// Runs independent jobs on the pool, threads take the next job when they finish one, so a few slow ones don't hold up a fixed share of the rest
+void RunJobsParallel(SWorkerPool& Pool, const std::vector<std::function<void()>>& Jobs)
+{
+	std::atomic<uint32_t> NextJob(0);
+	RunParallel(Pool, [&](uint32_t ThreadIndex)
+	{
+		for (uint32_t Job = NextJob++; Job < Jobs.size(); Job = NextJob++)
+			Jobs[Job]();
+	});
+}
+
+// CPU fallback for cull.comp: same sphere frustum test and LOD selection over SoA world spheres, without occlusion culling or depth bins.
+// Commands, their count and the instance lists go straight to host visible buffers the render passes read instead of the GPU ones
+struct SCpuCulling
+{
+	std::vector<float> CenterX;
+	std::vector<float> CenterY;
+	std::vector<float> CenterZ;
+	std::vector<float> Radius; // -FLT_MAX for free slots, so they never pass
+	std::vector<uint32_t> MeshIndices;
+	uint32_t LiveDrawsCount = 0;
+
+	SWorkerPool Workers;
+	std::vector<std::vector<uint32_t>> ThreadVisibleDraws;
+	std::vector<std::vector<uint32_t>> ThreadKeys;
+	std::vector<std::vector<uint32_t>> ThreadBucketOffsets;
+
+	SBuffer IndirectBuffer;
+	SBuffer CountBuffer; // Same layout as SCulling::CountBuffer, only the early pass command count is used
+	SBuffer InstanceBuffer;
+};
+
+// World space bounding sphere, same as GetBoundingSphere in common.h
+vec4 GetBoundingSphere(const SMeshDraw& MeshDraw, const SMesh& Mesh)
+{
+	vec3 Q = MeshDraw.Orientation;
+	quat Orientation = quat(sqrtf(std::max(0.0f, 1.0f - glm::dot(Q, Q))), Q.x, Q.y, Q.z);
+	vec3 Center = MeshDraw.Position + Orientation * (MeshDraw.Scale * Mesh.SphereCenter);
+
+	return vec4(Center, MeshDraw.Scale * Mesh.SphereRadius);
+}
+
+void UpdateCpuCullingSphere(SCpuCulling& CpuCulling, const SInstances& Instances, const std::vector<SMesh>& Meshes, uint32_t Slot)
+{
+	if (CpuCulling.Radius.size() < Instances.Slots.size())
+	{
+		CpuCulling.CenterX.resize(Instances.Slots.size());
+		CpuCulling.CenterY.resize(Instances.Slots.size());
+		CpuCulling.CenterZ.resize(Instances.Slots.size());
+		CpuCulling.Radius.resize(Instances.Slots.size(), -FLT_MAX);
+		CpuCulling.MeshIndices.resize(Instances.Slots.size());
+	}
+
+	const SMeshDraw& MeshDraw = Instances.Slots[Slot];
+	bool bWasLive = CpuCulling.Radius[Slot] != -FLT_MAX;
+	if (MeshDraw.MeshIndex == DeadMeshIndex)
+	{
+		CpuCulling.LiveDrawsCount -= bWasLive ? 1 : 0;
+		CpuCulling.Radius[Slot] = -FLT_MAX;
+		return;
+	}
+	CpuCulling.LiveDrawsCount += bWasLive ? 0 : 1;
+
+	vec4 Sphere = GetBoundingSphere(MeshDraw, Meshes[MeshDraw.MeshIndex]);
+	CpuCulling.CenterX[Slot] = Sphere.x;
+	CpuCulling.CenterY[Slot] = Sphere.y;
+	CpuCulling.CenterZ[Slot] = Sphere.z;
+	CpuCulling.Radius[Slot] = Sphere.w;
+	CpuCulling.MeshIndices[Slot] = MeshDraw.MeshIndex;
+}
+
+// The build targets SSE2 only, so AVX is picked at runtime. MSVC accepts AVX intrinsics without /arch:AVX, GCC and Clang need the target attribute
+#if defined(_MSC_VER)
+#define AVX_FUNCTION
+bool SupportsAvx()
+{
+	int Info[4] = {};
+	__cpuid(Info, 1);
+	bool bAvx = (Info[2] & (1 << 28)) != 0;
+	bool bOsSavesYmm = (Info[2] & (1 << 27)) && ((_xgetbv(0) & 6) == 6);
+
+	return bAvx && bOsSavesYmm;
+}
+#else
+#define AVX_FUNCTION __attribute__((target("avx")))
+bool SupportsAvx()
+{
+	return __builtin_cpu_supports("avx");
+}
+#endif
+
+static const bool bGlobalAvxSupported = SupportsAvx();
+
+// 8 wide part of CullSpheres, returns where it stopped
+AVX_FUNCTION uint32_t CullSpheresAvx(const float* CenterX, const float* CenterY, const float* CenterZ, const float* Radius, const vec4* Frustum, uint32_t First, uint32_t End, std::vector<uint32_t>& VisibleDraws)
+{
+	uint32_t I = First;
+	for (; I + 8 <= End; I += 8)
+	{
+		__m256 X = _mm256_loadu_ps(CenterX + I);
+		__m256 Y = _mm256_loadu_ps(CenterY + I);
+		__m256 Z = _mm256_loadu_ps(CenterZ + I);
+		__m256 NegativeRadius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(Radius + I));
+
+		__m256 Inside = _mm256_cmp_ps(NegativeRadius, NegativeRadius, _CMP_EQ_OQ);
+		for (uint32_t P = 0; P < 6; P++)
+		{
+			__m256 Distance = _mm256_mul_ps(X, _mm256_set1_ps(Frustum[P].x));
+			Distance = _mm256_add_ps(Distance, _mm256_mul_ps(Y, _mm256_set1_ps(Frustum[P].y)));
+			Distance = _mm256_add_ps(Distance, _mm256_mul_ps(Z, _mm256_set1_ps(Frustum[P].z)));
+			Distance = _mm256_sub_ps(Distance, _mm256_set1_ps(Frustum[P].w));
+			Inside = _mm256_and_ps(Inside, _mm256_cmp_ps(Distance, NegativeRadius, _CMP_GE_OQ));
+		}
+
+		uint32_t Mask = (uint32_t)_mm256_movemask_ps(Inside);
+		for (uint32_t Lane = 0; Mask != 0; Lane++, Mask >>= 1)
+		{
+			if (Mask & 1)
+				VisibleDraws.push_back(I + Lane);
+		}
+	}
+
+	return I;
+}
+
+// Appends the spheres in [First, End) that are on the inner side of all 6 planes, plane w is the distance from the origin like in cull.comp
+void CullSpheres(const SCpuCulling& CpuCulling, const vec4* Frustum, uint32_t First, uint32_t End, std::vector<uint32_t>& VisibleDraws)
+{
+	const float* CenterX = CpuCulling.CenterX.data();
+	const float* CenterY = CpuCulling.CenterY.data();
+	const float* CenterZ = CpuCulling.CenterZ.data();
+	const float* Radius = CpuCulling.Radius.data();
+
+	uint32_t I = bGlobalAvxSupported ? CullSpheresAvx(CenterX, CenterY, CenterZ, Radius, Frustum, First, End, VisibleDraws) : First;
+	for (; I + 4 <= End; I += 4)
+	{
+		__m128 X = _mm_loadu_ps(CenterX + I);
+		__m128 Y = _mm_loadu_ps(CenterY + I);
+		__m128 Z = _mm_loadu_ps(CenterZ + I);
+		__m128 NegativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(Radius + I));
+
+		__m128 Inside = _mm_cmpeq_ps(NegativeRadius, NegativeRadius);
+		for (uint32_t P = 0; P < 6; P++)
+		{
+			__m128 Distance = _mm_mul_ps(X, _mm_set1_ps(Frustum[P].x));
+			Distance = _mm_add_ps(Distance, _mm_mul_ps(Y, _mm_set1_ps(Frustum[P].y)));
+			Distance = _mm_add_ps(Distance, _mm_mul_ps(Z, _mm_set1_ps(Frustum[P].z)));
+			Distance = _mm_sub_ps(Distance, _mm_set1_ps(Frustum[P].w));
+			Inside = _mm_and_ps(Inside, _mm_cmpge_ps(Distance, NegativeRadius));
+		}
+
+		uint32_t Mask = (uint32_t)_mm_movemask_ps(Inside);
+		for (uint32_t Lane = 0; Mask != 0; Lane++, Mask >>= 1)
+		{
+			if (Mask & 1)
+				VisibleDraws.push_back(I + Lane);
+		}
+	}
+	for (; I < End; I++)
+	{
+		bool bVisible = true;
+		for (uint32_t P = 0; P < 6; P++)
+			bVisible = bVisible && (CenterX[I] * Frustum[P].x + CenterY[I] * Frustum[P].y + CenterZ[I] * Frustum[P].z - Frustum[P].w >= -Radius[I]);
+
+		if (bVisible)
+			VisibleDraws.push_back(I);
+	}
+}
+
+// Returns the number of commands written
+uint32_t CullOnCpu(SCpuCulling& CpuCulling, const std::vector<SMesh>& Meshes, const SCameraBuffer& Camera, bool bLodsEnabled, SCullStats& Stats)
+{
+	SCpuScope Scope("CPU culling");
+
+	uint32_t ThreadsCount = GetThreadsCount(CpuCulling.Workers);
+	uint32_t DrawsCount = (uint32_t)CpuCulling.Radius.size();
+	uint32_t BucketsCount = (uint32_t)Meshes.size() * LodsCount;
+
+	CpuCulling.ThreadVisibleDraws.resize(ThreadsCount);
+	CpuCulling.ThreadKeys.resize(ThreadsCount);
+	CpuCulling.ThreadBucketOffsets.resize(ThreadsCount);
+
+	// Chunks are a multiple of 8 so only the last one has a scalar tail
+	uint32_t ChunkSize = ((DrawsCount + ThreadsCount - 1) / ThreadsCount + 7) & ~7u;
+	RunParallel(CpuCulling.Workers, [&](uint32_t ThreadIndex)
+	{
+		SCpuScope ChunkScope("Cull chunk");
+
+		std::vector<uint32_t>& VisibleDraws = CpuCulling.ThreadVisibleDraws[ThreadIndex];
+		std::vector<uint32_t>& Keys = CpuCulling.ThreadKeys[ThreadIndex];
+		std::vector<uint32_t>& BucketCounts = CpuCulling.ThreadBucketOffsets[ThreadIndex];
+		VisibleDraws.clear();
+		Keys.clear();
+		BucketCounts.assign(BucketsCount, 0);
+
+		uint32_t First = std::min(ThreadIndex * ChunkSize, DrawsCount);
+		uint32_t End = std::min(First + ChunkSize, DrawsCount);
+		CullSpheres(CpuCulling, Camera.Frustums, First, End, VisibleDraws);
+
+		vec3 CameraPosition = vec3(Camera.CameraPosition);
+		for (uint32_t I = 0; I < VisibleDraws.size(); I++)
+		{
+			uint32_t DrawIndex = VisibleDraws[I];
+			vec3 Center = vec3(CpuCulling.CenterX[DrawIndex], CpuCulling.CenterY[DrawIndex], CpuCulling.CenterZ[DrawIndex]);
+
+			float Distance = glm::length(Center - CameraPosition) - CpuCulling.Radius[DrawIndex];
+			float LodDistance = log2f(std::max(Distance, 1.0f));
+			int LodIndex = bLodsEnabled ? glm::clamp(int(LodDistance) - 1, 0, int(LodsCount) - 1) : 0;
+
+			uint32_t Key = CpuCulling.MeshIndices[DrawIndex] * LodsCount + uint32_t(LodIndex);
+			Keys.push_back(Key);
+			BucketCounts[Key]++;
+		}
+	});
+
+	// Counting sort by bucket, every thread gets its own range inside each bucket
+	VkDrawIndexedIndirectCommand* Commands = (VkDrawIndexedIndirectCommand*)CpuCulling.IndirectBuffer.Data;
+	uint32_t CommandCount = 0;
+	uint32_t InstanceCount = 0;
+	for (uint32_t Key = 0; Key < BucketsCount; Key++)
+	{
+		uint32_t FirstInstance = InstanceCount;
+		for (uint32_t ThreadIndex = 0; ThreadIndex < ThreadsCount; ThreadIndex++)
+		{
+			uint32_t BucketCount = CpuCulling.ThreadBucketOffsets[ThreadIndex][Key];
+			CpuCulling.ThreadBucketOffsets[ThreadIndex][Key] = InstanceCount;
+			InstanceCount += BucketCount;
+		}
+
+		if (InstanceCount > FirstInstance)
+		{
+			const SMesh& Mesh = Meshes[Key / LodsCount];
+			uint32_t LodIndex = Key % LodsCount;
+
+			VkDrawIndexedIndirectCommand& Command = Commands[CommandCount++];
+			Command.indexCount = Mesh.IndexCount[LodIndex];
+			Command.instanceCount = InstanceCount - FirstInstance;
+			Command.firstIndex = Mesh.IndexOffset[LodIndex];
+			Command.vertexOffset = Mesh.VertexOffset;
+			Command.firstInstance = FirstInstance;
+
+			Stats.EmittedLodDraws[LodIndex] += Command.instanceCount;
+			Stats.EmittedTriangles += uint64_t(Command.instanceCount) * (Command.indexCount / 3);
+		}
+	}
+
+	RunParallel(CpuCulling.Workers, [&](uint32_t ThreadIndex)
+	{
+		SCpuScope ScatterScope("Scatter instances");
+
+		const std::vector<uint32_t>& VisibleDraws = CpuCulling.ThreadVisibleDraws[ThreadIndex];
+		const std::vector<uint32_t>& Keys = CpuCulling.ThreadKeys[ThreadIndex];
+		std::vector<uint32_t>& BucketOffsets = CpuCulling.ThreadBucketOffsets[ThreadIndex];
+
+		uint32_t* Instances = (uint32_t*)CpuCulling.InstanceBuffer.Data;
+		for (uint32_t I = 0; I < VisibleDraws.size(); I++)
+			Instances[BucketOffsets[Keys[I]]++] = VisibleDraws[I];
+	});
+
+	// Only live draws are counted, like on the GPU. The CPU path has no cells and no occlusion culling
+	Stats.TestedDraws = CpuCulling.LiveDrawsCount;
+	Stats.VisibleDraws = InstanceCount;
+	Stats.FrustumCulledDraws = CpuCulling.LiveDrawsCount - InstanceCount;
+
+	uint32_t* Counts = (uint32_t*)CpuCulling.CountBuffer.Data;
+	Counts[0] = InstanceCount;
+	Counts[1] = 0;
+	Counts[2] = CommandCount;
+	Counts[3] = 0;
+
+	return CommandCount;
+}
+
+// Every pipeline goes through the same cache, vkCreate*Pipelines synchronize access to it on their own, so workers can share it.
+// Creation time is summed over all threads that create pipelines
+static VkPipelineCache GlobalPipelineCache = 0;
+static std::atomic<uint64_t> GlobalPipelineCreationTicks;
+static std::atomic<uint32_t> GlobalPipelinesCount;
+
+const char* PipelineCachePath = "pipeline_cache.bin";
+
+// Header layout is fixed by the spec: size, version, vendor, device, cache UUID. Data written by another device or driver build starts an empty cache,
+// not every driver rejects it gracefully on its own
+VkPipelineCache CreatePipelineCache(VkDevice Device, const VkPhysicalDeviceProperties& PhysicalDeviceProps, const char* Path)
+{
+	std::vector<uint8_t> Data;
+	FILE* File = Path ? fopen(Path, "rb") : 0;
+	if (File)
+	{
+		fseek(File, 0, SEEK_END);
+		Data.resize(ftell(File));
+		fseek(File, 0, SEEK_SET);
+		if (fread(Data.data(), 1, Data.size(), File) != Data.size())
+			Data.clear();
+		fclose(File);
+	}
+
+	const uint32_t HeaderSize = 4 * sizeof(uint32_t) + VK_UUID_SIZE;
+	bool bValid = false;
+	if (Data.size() >= HeaderSize)
+	{
+		uint32_t Header[4] = {};
+		memcpy(Header, Data.data(), sizeof(Header));
+		bValid = (Header[0] >= HeaderSize) && (Header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE) && (Header[2] == PhysicalDeviceProps.vendorID) && (Header[3] == PhysicalDeviceProps.deviceID) &&
+				 (memcmp(Data.data() + sizeof(Header), PhysicalDeviceProps.pipelineCacheUUID, VK_UUID_SIZE) == 0);
+	}
+
+	if (!Data.empty())
+		printf("Pipeline cache: %u bytes, %s\n", (uint32_t)Data.size(), bValid ? "loaded" : "written by another device or driver, ignored");
+
+	VkPipelineCacheCreateInfo CreateInfo = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
+	CreateInfo.initialDataSize = bValid ? Data.size() : 0;
+	CreateInfo.pInitialData = bValid ? Data.data() : 0;
+
+	VkPipelineCache PipelineCache = 0;
+	VkCheck(vkCreatePipelineCache(Device, &CreateInfo, 0, &PipelineCache));
+	Assert(PipelineCache);
+
+	return PipelineCache;
+}
+
+void SavePipelineCache(VkDevice Device, VkPipelineCache PipelineCache, const char* Path)
+{
+	size_t Size = 0;
+	VkCheck(vkGetPipelineCacheData(Device, PipelineCache, &Size, 0));
+	std::vector<uint8_t> Data(Size);
+	VkCheck(vkGetPipelineCacheData(Device, PipelineCache, &Size, Data.data()));
+
+	FILE* File = fopen(Path, "wb");
+	Assert(File);
+	fwrite(Data.data(), 1, Size, File);
+	fclose(File);
+}
+
+// Depth test only pipelines write neither depth nor color, they are used for occlusion queries against a finished depth buffer
+VkPipeline CreateGraphicsPipeline(VkDevice Device, VkRenderPass RenderPass, VkPipelineLayout PipelineLayout, VkShaderModule VS, VkShaderModule FS, const VkSpecializationInfo* SpecializationInfo = 0, bool bDepthTestOnly = false)
+{
+	VkPipelineShaderStageCreateInfo ShaderStages[2] = {};
+	ShaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	ShaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+	ShaderStages[0].module = VS;
+	ShaderStages[0].pName = "main";
+	ShaderStages[0].pSpecializationInfo = SpecializationInfo;
+	ShaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	ShaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+	ShaderStages[1].module = FS;
+	ShaderStages[1].pName = "main";
+
+	VkVertexInputBindingDescription BindingDescr = {};
+	BindingDescr.binding = 0;
+	BindingDescr.stride = sizeof(SVertex);
+	BindingDescr.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+	VkVertexInputAttributeDescription AttributeDescrs[2] = {};
+	AttributeDescrs[0].location = 0;
+	AttributeDescrs[0].binding = 0;
+	AttributeDescrs[0].format = VK_FORMAT_R32G32B32_SFLOAT;
+	AttributeDescrs[0].offset = 0;
+	AttributeDescrs[1].location = 1;
+	AttributeDescrs[1].binding = 0;
+	AttributeDescrs[1].format = VK_FORMAT_R32G32B32_SFLOAT;
+	AttributeDescrs[1].offset = OffsetOf(SVertex, Normal);
+
+	VkPipelineVertexInputStateCreateInfo VertexInputInfo = { VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
+	VertexInputInfo.vertexBindingDescriptionCount = 1;
+	VertexInputInfo.pVertexBindingDescriptions = &BindingDescr;
+	VertexInputInfo.vertexAttributeDescriptionCount = ArrayCount(AttributeDescrs);
+	VertexInputInfo.pVertexAttributeDescriptions = AttributeDescrs;
+
+	VkPipelineInputAssemblyStateCreateInfo InputAssemblyInfo = { VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO };
+	InputAssemblyInfo.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+	VkPipelineViewportStateCreateInfo ViewportStateInfo = { VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO };
+	ViewportStateInfo.viewportCount = 1;
+	ViewportStateInfo.scissorCount = 1;
+
+	VkPipelineRasterizationStateCreateInfo RasterizationStateInfo = { VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO };
+	RasterizationStateInfo.polygonMode = VK_POLYGON_MODE_FILL;
+	RasterizationStateInfo.cullMode = VK_CULL_MODE_NONE;
+	RasterizationStateInfo.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+	RasterizationStateInfo.lineWidth = 1.0f;
+
+	VkPipelineMultisampleStateCreateInfo MultisampleStateInfo = { VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO };
+	MultisampleStateInfo.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+	VkPipelineDepthStencilStateCreateInfo DepthStencilStateInfo = { VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO };
+	DepthStencilStateInfo.depthTestEnable = VK_TRUE;
+	DepthStencilStateInfo.depthWriteEnable = bDepthTestOnly ? VK_FALSE : VK_TRUE;
+	DepthStencilStateInfo.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+	DepthStencilStateInfo.stencilTestEnable = VK_FALSE;
+
+	VkPipelineColorBlendAttachmentState ColorAttachmentState = {};
+	ColorAttachmentState.colorWriteMask = bDepthTestOnly ? 0 : (VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT);
+
+	VkPipelineColorBlendStateCreateInfo ColorBlendStateInfo = { VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO };
+	ColorBlendStateInfo.attachmentCount = 1;
+	ColorBlendStateInfo.pAttachments = &ColorAttachmentState;
+
+	VkDynamicState DynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+	VkPipelineDynamicStateCreateInfo dynamicStateInfo = { VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO };
+	dynamicStateInfo.dynamicStateCount = ArrayCount(DynamicStates);
+	dynamicStateInfo.pDynamicStates = DynamicStates;
+
+	VkGraphicsPipelineCreateInfo CreateInfo = { VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO };
+	CreateInfo.stageCount = ArrayCount(ShaderStages);
+	CreateInfo.pStages = ShaderStages;
+	CreateInfo.pVertexInputState = &VertexInputInfo;
+	CreateInfo.pInputAssemblyState = &InputAssemblyInfo;
+	CreateInfo.pViewportState = &ViewportStateInfo;
+	CreateInfo.pRasterizationState = &RasterizationStateInfo;
+	CreateInfo.pMultisampleState = &MultisampleStateInfo;
+	CreateInfo.pDepthStencilState = &DepthStencilStateInfo;
+	CreateInfo.pColorBlendState = &ColorBlendStateInfo;
+	CreateInfo.pDynamicState = &dynamicStateInfo;
 	CreateInfo.layout = PipelineLayout;
+	CreateInfo.renderPass = RenderPass;
+
+	uint64_t BeginTicks = GetCpuTicks();
+	VkPipeline GraphicsPipeline = 0;
+	VkCheck(vkCreateGraphicsPipelines(Device, GlobalPipelineCache, 1, &CreateInfo, 0, &GraphicsPipeline));
+	Assert(GraphicsPipeline);
+	GlobalPipelineCreationTicks += GetCpuTicks() - BeginTicks;
+	GlobalPipelinesCount++;
+
+	return GraphicsPipeline;
+}
+
+VkPipeline CreateComputePipeline(VkDevice Device, VkPipelineLayout PipelineLayout, VkShaderModule CS, const VkSpecializationInfo* SpecializationInfo = 0)
+{
+	VkPipelineShaderStageCreateInfo ShaderStage = { VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO };
+	ShaderStage.flags;
+	ShaderStage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	ShaderStage.module = CS;
+	ShaderStage.pName = "main";
+	ShaderStage.pSpecializationInfo = SpecializationInfo;
+	
+	VkComputePipelineCreateInfo CreateInfo = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+	CreateInfo.stage = ShaderStage;
+	CreateInfo.layout = PipelineLayout;
+
+	uint64_t BeginTicks = GetCpuTicks();
+	VkPipeline ComputePipeline = 0;
+	VkCheck(vkCreateComputePipelines(Device, GlobalPipelineCache, 1, &CreateInfo, 0, &ComputePipeline));
+	Assert(ComputePipeline);
+	GlobalPipelineCreationTicks += GetCpuTicks() - BeginTicks;
+	GlobalPipelinesCount++;
+
+	return ComputePipeline;
+}
+
+// VkDispatchIndirectCommand of the draw passes and the visible cell count
+const uint32_t CellDispatchBufferSize = sizeof(VkDispatchIndirectCommand) + sizeof(uint32_t);
+
+// Everything the culling passes read and write, shared by the frame loop and the benchmarks
+struct SCulling
+{
+	VkPipelineLayout PipelineLayout;
+	VkDescriptorSet DescriptorSets[3];
+
+	VkPipeline DrawUpdatePipeline;
+	VkPipeline AnimatePipeline;
+	VkPipeline HierarchyPipeline;
+	VkPipeline CellRefitPipeline;
+	VkPipeline CellRefitDirtyPipeline;
+	VkPipeline CellCullPipeline;
+	VkPipeline DrawCullPipeline;
+	VkPipeline BucketPrefixPipeline;
+	VkPipeline BucketScatterPipeline;
+
+	SBuffer IndirectBuffer;
+	SBuffer CountBuffer;
+	SBuffer VisibilityBuffer;
+	SBuffer CellBuffer;
+	SBuffer VisibleCellBuffer;
+	SBuffer CellDispatchBuffer;
+	SBuffer MeshBuffer;
+	SBuffer VisibleDrawBuffer;
+	SBuffer BucketBuffer;
+	SBuffer InstanceBuffer;
+	SBuffer ScatterDispatchBuffer;
+	SBuffer DrawUpdateBuffer;
+	SBuffer MotionBuffer;
+	SBuffer NodeBuffer;
+	SBuffer NodeWorldBuffer;
+	SBuffer CullStatsBuffer;
+	SBuffer CullStatsReadbackBuffer; // CullStatsRingSize frames of SCullStats
+
+	uint32_t CellsCount;
+	uint32_t BucketsCount;
+	bool bCellsDirty;
+};
+
+struct SBucket
+{
+	uint32_t InstanceCount;
+	uint32_t FirstInstance;
+};
+
+void RecordCullingReset(VkCommandBuffer CommandBuffer, const SCulling& Culling, bool bResetVisibility)
+{
+	vkCmdFillBuffer(CommandBuffer, Culling.CountBuffer.Buffer, 0, 4 * sizeof(uint32_t), 0);
+	vkCmdFillBuffer(CommandBuffer, Culling.BucketBuffer.Buffer, 0, 2 * Culling.BucketsCount * DepthBinsCount * sizeof(SBucket), 0);
+	vkCmdFillBuffer(CommandBuffer, Culling.CullStatsBuffer.Buffer, 0, sizeof(SCullStats), 0);
+	if (bResetVisibility)
+	{
+		vkCmdFillBuffer(CommandBuffer, Culling.VisibilityBuffer.Buffer, 0, VK_WHOLE_SIZE, 0);
+	}
+
+	// Dispatch size, then the visible cell count
+	uint32_t CellDispatchReset[] = { 0, 1, 1, 0 };
+	vkCmdUpdateBuffer(CommandBuffer, Culling.CellDispatchBuffer.Buffer, 0, sizeof(CellDispatchReset), CellDispatchReset);
+
+	VkBufferMemoryBarrier FillBufferBarriers[] =
+	{
+		CreateBufferMemoryBarrier(VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, Culling.CountBuffer, 4 * sizeof(uint32_t)),
+		CreateBufferMemoryBarrier(VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, Culling.BucketBuffer, 2 * Culling.BucketsCount * DepthBinsCount * sizeof(SBucket)),
+		CreateBufferMemoryBarrier(VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, Culling.CullStatsBuffer, sizeof(SCullStats)),
+		CreateBufferMemoryBarrier(VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, Culling.VisibilityBuffer, VK_WHOLE_SIZE),
+		CreateBufferMemoryBarrier(VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, Culling.CellDispatchBuffer, CellDispatchBufferSize),
+	};
+	vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, ArrayCount(FillBufferBarriers), FillBufferBarriers, 0, 0);
+}
+
+// Applies the draws flushed to DrawUpdateBuffer and refits only the cells they are in
+void RecordDrawUpdates(VkCommandBuffer CommandBuffer, const SCulling& Culling, const SBuffer& MeshDrawBuffer, const SPushConstantsCompute& PushConstants, uint32_t DrawUpdateCount, uint32_t DirtyCellCount)
+{
+	if (DrawUpdateCount == 0)
+		return;
+
+	vkCmdBindDescriptorSets(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, Culling.PipelineLayout, 0, ArrayCount(Culling.DescriptorSets), Culling.DescriptorSets, 0, 0);
+	vkCmdPushConstants(CommandBuffer, Culling.PipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(SPushConstantsCompute), &PushConstants);
+
+	vkCmdBindPipeline(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, Culling.DrawUpdatePipeline);
+	vkCmdDispatch(CommandBuffer, (DrawUpdateCount + 63) / 64, 1, 1);
+
+	VkBufferMemoryBarrier UpdateBarriers[] =
+	{
+		CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, MeshDrawBuffer, VK_WHOLE_SIZE),
+		CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, Culling.CellBuffer, VK_WHOLE_SIZE),
+		CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, Culling.MotionBuffer, VK_WHOLE_SIZE),
+	};
+	vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, 0, 0, 0, ArrayCount(UpdateBarriers), UpdateBarriers, 0, 0);
+
+	vkCmdBindPipeline(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, Culling.CellRefitDirtyPipeline);
+	vkCmdDispatch(CommandBuffer, (DirtyCellCount + 31) / 32, 1, 1);
+
+	VkBufferMemoryBarrier RefitBarrier = CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, Culling.CellBuffer, VK_WHOLE_SIZE);
+	vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, 1, &RefitBarrier, 0, 0);
+}
+
+// Advances the draw motions by PushConstants.DeltaTime and refits every cell in the same dispatch
+void RecordAnimation(VkCommandBuffer CommandBuffer, const SCulling& Culling, const SBuffer& MeshDrawBuffer, const SPushConstantsCompute& PushConstants)
+{
+	vkCmdBindDescriptorSets(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, Culling.PipelineLayout, 0, ArrayCount(Culling.DescriptorSets), Culling.DescriptorSets, 0, 0);
+	vkCmdPushConstants(CommandBuffer, Culling.PipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(SPushConstantsCompute), &PushConstants);
+
+	vkCmdBindPipeline(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, Culling.AnimatePipeline);
+	vkCmdDispatch(CommandBuffer, Culling.CellsCount, 1, 1);
+
+	VkBufferMemoryBarrier AnimateBarriers[] =
+	{
+		CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, MeshDrawBuffer, VK_WHOLE_SIZE),
+		CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, Culling.CellBuffer, VK_WHOLE_SIZE),
+	};
+	vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, 0, 0, 0, ArrayCount(AnimateBarriers), AnimateBarriers, 0, 0);
+}
+
+// One dispatch per hierarchy level, then the dirty cells are refit. FlushInstanceUpdates lists Hierarchy.DrawCells there every frame
+void RecordHierarchy(VkCommandBuffer CommandBuffer, const SCulling& Culling, const SBuffer& MeshDrawBuffer, const SHierarchy& Hierarchy, SPushConstantsCompute PushConstants, uint32_t DirtyCellCount)
+{
+	if (Hierarchy.Nodes.empty())
+		return;
+
+	vkCmdBindDescriptorSets(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, Culling.PipelineLayout, 0, ArrayCount(Culling.DescriptorSets), Culling.DescriptorSets, 0, 0);
+	vkCmdBindPipeline(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, Culling.HierarchyPipeline);
+
+	for (uint32_t Level = 0; Level + 1 < Hierarchy.LevelFirstNodes.size(); Level++)
+	{
+		PushConstants.NodeFirst = Hierarchy.LevelFirstNodes[Level];
+		PushConstants.NodeCount = Hierarchy.LevelFirstNodes[Level + 1] - Hierarchy.LevelFirstNodes[Level];
+		vkCmdPushConstants(CommandBuffer, Culling.PipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(SPushConstantsCompute), &PushConstants);
+		vkCmdDispatch(CommandBuffer, (PushConstants.NodeCount + 63) / 64, 1, 1);
+
+		VkBufferMemoryBarrier LevelBarrier = CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, Culling.NodeWorldBuffer, VK_WHOLE_SIZE);
+		vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, 1, &LevelBarrier, 0, 0);
+	}
+
+	VkBufferMemoryBarrier DrawBarrier = CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, MeshDrawBuffer, VK_WHOLE_SIZE);
+	vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, 0, 0, 0, 1, &DrawBarrier, 0, 0);
+
+	vkCmdBindPipeline(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, Culling.CellRefitDirtyPipeline);
+	vkCmdDispatch(CommandBuffer, (DirtyCellCount + 31) / 32, 1, 1);
+
+	VkBufferMemoryBarrier RefitBarrier = CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, Culling.CellBuffer, VK_WHOLE_SIZE);
+	vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, 1, &RefitBarrier, 0, 0);
+}
+
+// Cells are culled once per frame, both draw passes then go only through the cells that survived
+void RecordCellCulling(VkCommandBuffer CommandBuffer, SCulling& Culling, const SPushConstantsCompute& PushConstants)
+{
+	vkCmdBindDescriptorSets(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, Culling.PipelineLayout, 0, ArrayCount(Culling.DescriptorSets), Culling.DescriptorSets, 0, 0);
+	vkCmdPushConstants(CommandBuffer, Culling.PipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(SPushConstantsCompute), &PushConstants);
+
+	if (Culling.bCellsDirty)
+	{
+		vkCmdBindPipeline(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, Culling.CellRefitPipeline);
+		vkCmdDispatch(CommandBuffer, (Culling.CellsCount + 31) / 32, 1, 1);
+
+		VkBufferMemoryBarrier RefitBarrier = CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, Culling.CellBuffer, VK_WHOLE_SIZE);
+		vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, 1, &RefitBarrier, 0, 0);
+
+		Culling.bCellsDirty = false;
+	}
+
+	vkCmdBindPipeline(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, Culling.CellCullPipeline);
+	vkCmdDispatch(CommandBuffer, (Culling.CellsCount + 31) / 32, 1, 1);
+
+	VkBufferMemoryBarrier CellCullBarriers[] =
+	{
+		CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT, Culling.CellDispatchBuffer, CellDispatchBufferSize),
+		CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, Culling.VisibleCellBuffer, VK_WHOLE_SIZE),
+	};
+	vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, ArrayCount(CellCullBarriers), CellCullBarriers, 0, 0);
+}
+
+// Draw cull pipeline is a parameter so the benchmark can run every compaction variant over the same data
+void RecordDrawCulling(VkCommandBuffer CommandBuffer, const SCulling& Culling, VkPipeline DrawCullPipeline, const SPushConstantsCompute& PushConstants)
+{
+	vkCmdBindPipeline(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, DrawCullPipeline);
+	vkCmdBindDescriptorSets(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, Culling.PipelineLayout, 0, ArrayCount(Culling.DescriptorSets), Culling.DescriptorSets, 0, 0);
+	vkCmdPushConstants(CommandBuffer, Culling.PipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(SPushConstantsCompute), &PushConstants);
+
+	vkCmdDispatchIndirect(CommandBuffer, Culling.CellDispatchBuffer.Buffer, 0);
+
+	VkBufferMemoryBarrier CullBufferBarriers[] =
+	{
+		CreateBufferMemoryBarrier(VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT, Culling.CountBuffer, 4 * sizeof(uint32_t)),
+		CreateBufferMemoryBarrier(VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, Culling.BucketBuffer, VK_WHOLE_SIZE),
+		CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, Culling.VisibleDrawBuffer, VK_WHOLE_SIZE),
+	};
+	vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, 0, ArrayCount(CullBufferBarriers), CullBufferBarriers, 0, 0);
+}
+
+// Turns the visible draws of the pass into one instanced command per (mesh, LOD) bucket: prefix sum over bucket sizes writes the commands,
+// then every visible draw gets scattered into its bucket instance range. Expects RecordDrawCulling of the same pass right before
+void RecordDrawBucketing(VkCommandBuffer CommandBuffer, const SCulling& Culling, const SPushConstantsCompute& PushConstants)
+{
+	vkCmdBindPipeline(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, Culling.BucketPrefixPipeline);
+	vkCmdDispatch(CommandBuffer, 1, 1, 1);
+
+	VkBufferMemoryBarrier PrefixBarriers[] =
+	{
+		CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, Culling.BucketBuffer, VK_WHOLE_SIZE),
+		CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT, Culling.ScatterDispatchBuffer, VK_WHOLE_SIZE),
+		CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT, Culling.IndirectBuffer, VK_WHOLE_SIZE),
+		CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT, Culling.CountBuffer, 4 * sizeof(uint32_t)),
+	};
+	vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, ArrayCount(PrefixBarriers), PrefixBarriers, 0, 0);
+
+	vkCmdBindPipeline(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, Culling.BucketScatterPipeline);
+	vkCmdDispatchIndirect(CommandBuffer, Culling.ScatterDispatchBuffer.Buffer, PushConstants.bLatePass * sizeof(VkDispatchIndirectCommand));
+
+	VkBufferMemoryBarrier ScatterBarrier = CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, Culling.InstanceBuffer, VK_WHOLE_SIZE);
+	vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, 0, 0, 0, 1, &ScatterBarrier, 0, 0);
+}
+
+// Every frame copies its stats to its own ring slot
+void RecordCullStatsReadback(VkCommandBuffer CommandBuffer, const SCulling& Culling, uint32_t FrameID)
+{
+	VkBufferMemoryBarrier ReadBarrier = CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT, Culling.CullStatsBuffer, sizeof(SCullStats));
+	vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, 0, 1, &ReadBarrier, 0, 0);
+
+	VkBufferCopy CopyRegion = { 0, (FrameID % CullStatsRingSize) * sizeof(SCullStats), sizeof(SCullStats) };
+	vkCmdCopyBuffer(CommandBuffer, Culling.CullStatsBuffer.Buffer, Culling.CullStatsReadbackBuffer.Buffer, 1, &CopyRegion);
+}
+
+// Valid once the frame has finished on the GPU, which is always true for frames CullStatsRingSize - 1 back
+const SCullStats& GetCullStats(const SCulling& Culling, uint32_t FrameID)
+{
+	return ((const SCullStats*)Culling.CullStatsReadbackBuffer.Data)[FrameID % CullStatsRingSize];
+}
+
+// Draw cull builds of cull.comp.glsl, one per COMPACTION value. The subgroup one needs SupportsSubgroupCompaction
+const char* CullVariantNames[] = { "atomic", "workgroup", "subgroup" };
+const char* CullVariantPaths[] = { "shaders_bytecode\\cullatomic.comp.spv", "shaders_bytecode\\cullworkgroup.comp.spv", "shaders_bytecode\\cull.comp.spv" };
+const uint32_t CullWorkgroupVariant = 1;
+const uint32_t CullSubgroupVariant = 2;
+
+struct SDispatchTimer
+{
+	VkDevice Device;
+	VkQueue Queue;
+	VkCommandPool CommandPool;
+	VkCommandBuffer CommandBuffer;
+	VkQueryPool QueryPool;
+	float TimestampPeriod;
+};
+
+SDispatchTimer CreateDispatchTimer(VkDevice Device, VkPhysicalDevice PhysicalDevice, VkQueue Queue, VkCommandPool CommandPool, VkCommandBuffer CommandBuffer)
+{
+	VkPhysicalDeviceProperties PhysicalDeviceProps = {};
+	vkGetPhysicalDeviceProperties(PhysicalDevice, &PhysicalDeviceProps);
+
+	SDispatchTimer Timer = { Device, Queue, CommandPool, CommandBuffer, CreateQueryPool(Device, 2), PhysicalDeviceProps.limits.timestampPeriod };
+	return Timer;
+}
+
+// Median GPU time in ms of the commands Record puts between the two timestamps, Setup is recorded before them and Readback after them
+double TimeDispatches(const SDispatchTimer& Timer, uint32_t WarmupRunsCount, uint32_t RunsCount, const std::function<void()>& Setup, const std::function<void()>& Record, const std::function<void()>& Readback)
+{
+	std::vector<double> Times;
+	for (uint32_t Run = 0; Run < WarmupRunsCount + RunsCount; Run++)
+	{
+		BeginCommandBuffer(Timer.Device, Timer.CommandPool, Timer.CommandBuffer);
+		vkCmdResetQueryPool(Timer.CommandBuffer, Timer.QueryPool, 0, 2);
+		Setup();
+
+		vkCmdWriteTimestamp(Timer.CommandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, Timer.QueryPool, 0);
+		Record();
+		vkCmdWriteTimestamp(Timer.CommandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, Timer.QueryPool, 1);
+		Readback();
+
+		SubmitAndWait(Timer.Device, Timer.Queue, Timer.CommandBuffer);
+
+		uint64_t Timestamps[2] = {};
+		VkCheck(vkGetQueryPoolResults(Timer.Device, Timer.QueryPool, 0, ArrayCount(Timestamps), sizeof(Timestamps), Timestamps, sizeof(Timestamps[0]), VK_QUERY_RESULT_64_BIT));
+
+		if (Run >= WarmupRunsCount)
+			Times.push_back(double(Timestamps[1] - Timestamps[0]) * Timer.TimestampPeriod * 1e-6);
+	}
+
+	std::sort(Times.begin(), Times.end());
+	return Times[Times.size() / 2];
+}
+
+// Plain ranges of DrawsPerCell draws with bounds over the whole scene, the cell pass keeps all of them
+std::vector<SCell> CreateRangeCells(uint32_t ObjectsCount, uint32_t DrawsPerCell)
+{
+	std::vector<SCell> Cells((ObjectsCount + DrawsPerCell - 1) / DrawsPerCell);
+	for (uint32_t I = 0; I < Cells.size(); I++)
+	{
+		Cells[I].BoundsMin = vec3(-1000.0f);
+		Cells[I].BoundsMax = vec3(1000.0f);
+		Cells[I].FirstDraw = I * DrawsPerCell;
+		Cells[I].DrawCount = std::min(DrawsPerCell, ObjectsCount - I * DrawsPerCell);
+	}
+	return Cells;
+}
+
+// Draws in front of a camera at the origin looking down -Z are visible, the ones behind it are frustum culled. About VisibleThreshold / 1024 of them are visible,
+// spread evenly over cells and subgroups by a multiplicative hash. Returns the visible count. Uses its own generator, the global rand() state of the scene is untouched
+uint32_t CreateSplitDraws(std::vector<SMeshDraw>& MeshDraws, uint32_t ObjectsCount, uint32_t MeshesCount, uint32_t VisibleThreshold, uint32_t Seed)
+{
+	uint32_t VisibleCount = 0;
+
+	std::minstd_rand Random(Seed);
+	auto RandomUnit = [&]() { return float(Random() - Random.min()) / float(Random.max() - Random.min()); };
+
+	MeshDraws.resize(ObjectsCount);
+	for (uint32_t I = 0; I < ObjectsCount; I++)
+	{
+		bool bVisible = ((I * 2654435761u) >> 22) < VisibleThreshold;
+		VisibleCount += bVisible;
+
+		SMeshDraw& MeshDraw = MeshDraws[I];
+		MeshDraw.Position.x = 8.0f * RandomUnit() - 4.0f;
+		MeshDraw.Position.y = 8.0f * RandomUnit() - 4.0f;
+		MeshDraw.Position.z = (bVisible ? -1.0f : 1.0f) * (20.0f + 40.0f * RandomUnit());
+		MeshDraw.Scale = 1.0f;
+		MeshDraw.Orientation = PackOrientation(quat(1, 0, 0, 0));
+		MeshDraw.MeshIndex = I % MeshesCount;
+	}
+
+	return VisibleCount;
+}
+
+// Sweeps the share of visible draws from 0 to 100% and times the draw cull pass with every compaction variant.
+// Cells are plain ranges of 64 draws with bounds over the whole scene, and visible and culled draws are interleaved inside them,
+// so every variant tests the same draws and only the amount of emitted commands changes
+void BenchmarkCompaction(VkDevice Device, VkPhysicalDevice PhysicalDevice, VkQueue Queue, VkCommandPool CommandPool, VkCommandBuffer CommandBuffer, VmaAllocator MemoryAllocator, SCulling& Culling,
+						 const SBuffer& StagingBuffer, const SBuffer& MeshDrawBuffer, const SBuffer& CameraBuffer, VkImage HiZImage, const SGeometry& Geometry, uint32_t ObjectsCount, bool bSubgroupCompaction)
+{
+	uint32_t VariantsCount = bSubgroupCompaction ? ArrayCount(CullVariantNames) : CullSubgroupVariant;
+
+	VkPipeline Pipelines[ArrayCount(CullVariantNames)] = {};
+	for (uint32_t I = 0; I < VariantsCount; I++)
+	{
+		VkShaderModule CS = LoadShader(Device, CullVariantPaths[I]);
+		Pipelines[I] = CreateComputePipeline(Device, Culling.PipelineLayout, CS);
+		vkDestroyShaderModule(Device, CS, 0);
+	}
+
+	SDispatchTimer Timer = CreateDispatchTimer(Device, PhysicalDevice, Queue, CommandPool, CommandBuffer);
+	SBuffer ReadbackBuffer = CreateBuffer(MemoryAllocator, 2 * sizeof(uint32_t), VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
+
+	SCameraBuffer CameraBufferData = {};
+	UpdateCameraBuffer(CameraBufferData, vec3(0.0f), vec3(0.0f, 0.0f, -1.0f), 1.0f, true);
+	memcpy(CameraBuffer.Data, &CameraBufferData, sizeof(CameraBufferData));
+
+	std::vector<SCell> Cells = CreateRangeCells(ObjectsCount, 64);
+	UploadBuffer(Device, CommandPool, CommandBuffer, Queue, Culling.CellBuffer, StagingBuffer, Cells.data(), Cells.size() * sizeof(SCell));
+	Culling.CellsCount = (uint32_t)Cells.size();
+	Culling.bCellsDirty = false;
+
+	BeginCommandBuffer(Device, CommandPool, CommandBuffer);
+	VkImageMemoryBarrier HiZBarrier = CreateImageMemoryBarrier(0, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, HiZImage, VK_IMAGE_ASPECT_COLOR_BIT);
+	vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, 0, 0, 1, &HiZBarrier);
+	SubmitAndWait(Device, Queue, CommandBuffer);
+
+	// Late pass with occlusion off and cleared visibility emits exactly the draws that pass the frustum
+	SPushConstantsCompute PushConstants = { false, LodsCount, false, 1, 1, true, ObjectsCount, Culling.CellsCount, Culling.BucketsCount, 1 };
+
+	const uint32_t WarmupRunsCount = 4;
+	const uint32_t RunsCount = 32;
+
+	printf("\nCompaction benchmark: %d draws, %d cells, median of %d runs\n", ObjectsCount, Culling.CellsCount, RunsCount);
+	printf("visible    emitted");
+	for (uint32_t I = 0; I < VariantsCount; I++)
+		printf(" %12s ms", CullVariantNames[I]);
+	printf("\n");
+
+	std::vector<SMeshDraw> MeshDraws;
+	for (uint32_t Step = 0; Step <= 10; Step++)
+	{
+		uint32_t ExpectedCount = CreateSplitDraws(MeshDraws, ObjectsCount, (uint32_t)Geometry.Meshes.size(), Step * 1024 / 10, Step);
+		UploadBuffer(Device, CommandPool, CommandBuffer, Queue, MeshDrawBuffer, StagingBuffer, MeshDraws.data(), MeshDraws.size() * sizeof(SMeshDraw));
+
+		double MedianTimes[ArrayCount(CullVariantNames)] = {};
+		uint32_t EmittedCounts[ArrayCount(CullVariantNames)] = {};
+		for (uint32_t Variant = 0; Variant < VariantsCount; Variant++)
+		{
+			MedianTimes[Variant] = TimeDispatches(Timer, WarmupRunsCount, RunsCount, [&]() { RecordCullingReset(CommandBuffer, Culling, true); RecordCellCulling(CommandBuffer, Culling, PushConstants); },
+												  [&]() { RecordDrawCulling(CommandBuffer, Culling, Pipelines[Variant], PushConstants); },
+												  [&]()
+												  {
+													  VkBufferCopy CopyRegion = { 0, 0, 2 * sizeof(uint32_t) };
+													  vkCmdCopyBuffer(CommandBuffer, Culling.CountBuffer.Buffer, ReadbackBuffer.Buffer, 1, &CopyRegion);
+												  });
+			EmittedCounts[Variant] = ((uint32_t*)ReadbackBuffer.Data)[1];
+		}
+
+		printf("%6d%% %10d", Step * 10, EmittedCounts[0]);
+		for (uint32_t I = 0; I < VariantsCount; I++)
+			printf(" %15.4f", MedianTimes[I]);
+
+		bool bCountsMatch = true;
+		for (uint32_t I = 0; I < VariantsCount; I++)
+			bCountsMatch = bCountsMatch && (EmittedCounts[I] == ExpectedCount);
+		if (bCountsMatch)
+			printf("\n");
+		else
+			printf("   MISMATCH: expected %d\n", ExpectedCount);
+	}
+
+	vkDestroyQueryPool(Device, Timer.QueryPool, 0);
+	vmaDestroyBuffer(MemoryAllocator, ReadbackBuffer.Buffer, ReadbackBuffer.Allocation);
+	for (uint32_t I = 0; I < VariantsCount; I++)
+		vkDestroyPipeline(Device, Pipelines[I], 0);
+}
+
+// Depth source and HiZ pyramid laid out like the swapchain ones, with their own descriptors, for the kernel benchmarks
+struct SHiZTarget
+{
+	SImage DepthImage;
+	VkImageView DepthImageView;
+
+	SImage DepthMipsImage;
+	VkImageView DepthMipView;
+	std::vector<VkImageView> DepthMipViews;
+
+	VkDescriptorPool DescriptorPool;
+	std::vector<VkDescriptorSet> DownscaleDescriptorSets;
+	VkDescriptorSet HiZDescriptorSet;
+
+	uint32_t Width, Height;
+};
+
+// Depth is cleared to the far plane, so the HiZ test samples the pyramid but never rejects anything
+SHiZTarget CreateHiZTarget(VkDevice Device, VkQueue Queue, VkCommandPool CommandPool, VkCommandBuffer CommandBuffer, VmaAllocator MemoryAllocator, VkSampler Sampler,
+						   VkDescriptorSetLayout DownscaleDescriptorSetLayout, VkDescriptorSetLayout HiZDescriptorSetLayout, uint32_t Width, uint32_t Height)
+{
+	SHiZTarget Target = {};
+	Target.Width = Width;
+	Target.Height = Height;
+
+	Target.DepthImage = CreateImage(Device, MemoryAllocator, VK_FORMAT_R32_SFLOAT, Width, Height, 1, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT);
+	Target.DepthImageView = CreateImageView(Device, Target.DepthImage.Image, VK_FORMAT_R32_SFLOAT, 0, 1, VK_IMAGE_ASPECT_COLOR_BIT);
+
+	uint32_t DepthMipsCount = GetMipsCount(Width, Height) - 1;
+	Target.DepthMipsImage = CreateImage(Device, MemoryAllocator, VK_FORMAT_R32_SFLOAT, Width >> 1, Height >> 1, DepthMipsCount, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
+	Target.DepthMipView = CreateImageView(Device, Target.DepthMipsImage.Image, VK_FORMAT_R32_SFLOAT, 0, VK_REMAINING_MIP_LEVELS, VK_IMAGE_ASPECT_COLOR_BIT);
+	for (uint32_t I = 0; I < DepthMipsCount; I++)
+		Target.DepthMipViews.push_back(CreateImageView(Device, Target.DepthMipsImage.Image, VK_FORMAT_R32_SFLOAT, I, 1, VK_IMAGE_ASPECT_COLOR_BIT));
+
+	Target.DescriptorPool = CreateDescriptorPool(Device);
+	for (uint32_t I = 0; I < DepthMipsCount; I++)
+	{
+		VkDescriptorSet DescriptorSet = CreateDescriptorSet(Device, Target.DescriptorPool, DownscaleDescriptorSetLayout);
+		UpdateDescriptorSetImage(Device, DescriptorSet, 0, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, Sampler, Target.DepthMipViews[I], VK_IMAGE_LAYOUT_GENERAL);
+		if (I == 0)
+			UpdateDescriptorSetImage(Device, DescriptorSet, 1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, Sampler, Target.DepthImageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+		else
+			UpdateDescriptorSetImage(Device, DescriptorSet, 1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, Sampler, Target.DepthMipViews[I - 1], VK_IMAGE_LAYOUT_GENERAL);
+		Target.DownscaleDescriptorSets.push_back(DescriptorSet);
+	}
+	Target.HiZDescriptorSet = CreateDescriptorSet(Device, Target.DescriptorPool, HiZDescriptorSetLayout);
+	UpdateDescriptorSetImage(Device, Target.HiZDescriptorSet, 0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, Sampler, Target.DepthMipView, VK_IMAGE_LAYOUT_GENERAL);
+
+	BeginCommandBuffer(Device, CommandPool, CommandBuffer);
+
+	VkImageMemoryBarrier ClearBarrier = CreateImageMemoryBarrier(0, VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, Target.DepthImage.Image, VK_IMAGE_ASPECT_COLOR_BIT);
+	vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, 0, 0, 0, 1, &ClearBarrier);
+
+	VkClearColorValue FarDepth = { { 1.0f, 1.0f, 1.0f, 1.0f } };
+	VkImageSubresourceRange Range = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+	vkCmdClearColorImage(CommandBuffer, Target.DepthImage.Image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &FarDepth, 1, &Range);
+
+	VkImageMemoryBarrier ReadBarrier = CreateImageMemoryBarrier(VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, Target.DepthImage.Image, VK_IMAGE_ASPECT_COLOR_BIT);
+	vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, 0, 0, 1, &ReadBarrier);
+
+	SubmitAndWait(Device, Queue, CommandBuffer);
+
+	return Target;
+}
+
+void DestroyHiZTarget(const SHiZTarget& Target, VkDevice Device, VmaAllocator MemoryAllocator)
+{
+	vkDestroyDescriptorPool(Device, Target.DescriptorPool, 0);
+
+	for (uint32_t I = 0; I < Target.DepthMipViews.size(); I++)
+		vkDestroyImageView(Device, Target.DepthMipViews[I], 0);
+	vkDestroyImageView(Device, Target.DepthMipView, 0);
+	vmaDestroyImage(MemoryAllocator, Target.DepthMipsImage.Image, Target.DepthMipsImage.Allocation);
+
+	vkDestroyImageView(Device, Target.DepthImageView, 0);
+	vmaDestroyImage(MemoryAllocator, Target.DepthImage.Image, Target.DepthImage.Allocation);
+}
+
+// Same dispatches as the HiZ pass of the frame, for any downscale workgroup size
+void RecordHiZBuild(VkCommandBuffer CommandBuffer, const SHiZTarget& Target, VkPipeline DownscalePipeline, VkPipelineLayout DownscalePipelineLayout, uint32_t GroupSize)
+{
+	VkImageMemoryBarrier MipsBarrier = CreateImageMemoryBarrier(0, VK_ACCESS_SHADER_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, Target.DepthMipsImage.Image, VK_IMAGE_ASPECT_COLOR_BIT);
+	vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, 0, 0, 1, &MipsBarrier);
+
+	vkCmdBindPipeline(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, DownscalePipeline);
+
+	for (uint32_t I = 0; I < Target.DepthMipViews.size(); I++)
+	{
+		vkCmdBindDescriptorSets(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, DownscalePipelineLayout, 0, 1, &Target.DownscaleDescriptorSets[I], 0, 0);
+
+		vec2 ImageSize = vec2(std::max(Target.Width >> (I + 1), 1u), std::max(Target.Height >> (I + 1), 1u));
+		vkCmdPushConstants(CommandBuffer, DownscalePipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(vec2), &ImageSize);
+
+		vkCmdDispatch(CommandBuffer, ((uint32_t)ImageSize.x + GroupSize - 1) / GroupSize, ((uint32_t)ImageSize.y + GroupSize - 1) / GroupSize, 1);
+
+		VkImageMemoryBarrier MipBarrier = CreateImageMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL, Target.DepthMipsImage.Image, VK_IMAGE_ASPECT_COLOR_BIT, I, 1);
+		vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_DEPENDENCY_BY_REGION_BIT, 0, 0, 0, 0, 1, &MipBarrier);
+	}
+}
+
+// Kernel tuning candidates, -bench-kernels times the same ones
+const uint32_t CullGroupSizes[] = { 32, 64, 128 };
+const uint32_t DownscaleGroupSizes[] = { 8, 16, 32 };
+
+// Draw cull with the workgroup width in constant_id 3, the other constants as in the frame
+VkPipeline CreateDrawCullPipeline(VkDevice Device, VkPipelineLayout PipelineLayout, VkShaderModule CS, bool bQuantizedDraws, bool bCullStats, uint32_t GroupSize)
+{
+	uint32_t SpecializationData[] = { VkBool32(bQuantizedDraws), VkBool32(bCullStats), GroupSize };
+	VkSpecializationMapEntry MapEntries[] = { { 0, 0, sizeof(VkBool32) }, { 2, sizeof(VkBool32), sizeof(VkBool32) }, { 3, 2 * sizeof(VkBool32), sizeof(uint32_t) } };
+	VkSpecializationInfo Specialization = { ArrayCount(MapEntries), MapEntries, sizeof(SpecializationData), SpecializationData };
+	return CreateComputePipeline(Device, PipelineLayout, CS, &Specialization);
+}
+
+// Square workgroups, the side goes to constant_id 0 and 1 of downscale.comp. Dispatches have to use the same size
+VkPipeline CreateDownscalePipeline(VkDevice Device, VkPipelineLayout PipelineLayout, VkShaderModule CS, uint32_t GroupSize)
+{
+	uint32_t SpecializationData[] = { GroupSize, GroupSize };
+	VkSpecializationMapEntry MapEntries[] = { { 0, 0, sizeof(uint32_t) }, { 1, sizeof(uint32_t), sizeof(uint32_t) } };
+	VkSpecializationInfo Specialization = { ArrayCount(MapEntries), MapEntries, sizeof(SpecializationData), SpecializationData };
+	return CreateComputePipeline(Device, PipelineLayout, CS, &Specialization);
+}
+
+// Only 128 invocations are guaranteed, 32x32 downscale groups are not
+bool SupportsSquareWorkgroup(const VkPhysicalDeviceProperties& PhysicalDeviceProps, uint32_t GroupSize)
+{
+	return (GroupSize <= PhysicalDeviceProps.limits.maxComputeWorkGroupSize[0]) && (GroupSize <= PhysicalDeviceProps.limits.maxComputeWorkGroupSize[1]) &&
+		   (GroupSize * GroupSize <= PhysicalDeviceProps.limits.maxComputeWorkGroupInvocations);
+}
+
+// Draw cull and depth downscale shaders alone, on synthetic draws and depth. Nothing else of the frame runs, timestamps only bracket the measured
+// dispatches. Workgroup sizes are specialization constants (local_size_x_id 3 of cull.comp, local_size_x_id 0 and local_size_y_id 1 of downscale.comp)
+void BenchmarkKernels(VkDevice Device, VkPhysicalDevice PhysicalDevice, VkQueue Queue, VkCommandPool CommandPool, VkCommandBuffer CommandBuffer, VmaAllocator MemoryAllocator, const SCulling& Culling,
+					  const SBuffer& StagingBuffer, const SBuffer& MeshDrawBuffer, const SBuffer& CameraBuffer, const SGeometry& Geometry, uint32_t MaxObjectsCount, bool bSubgroupCompaction)
+{
+	const uint32_t WarmupRunsCount = 4;
+	const uint32_t RunsCount = 32;
+
+	VkPhysicalDeviceProperties PhysicalDeviceProps = {};
+	vkGetPhysicalDeviceProperties(PhysicalDevice, &PhysicalDeviceProps);
+
+	SDispatchTimer Timer = CreateDispatchTimer(Device, PhysicalDevice, Queue, CommandPool, CommandBuffer);
+	SBuffer ReadbackBuffer = CreateBuffer(MemoryAllocator, 2 * sizeof(uint32_t), VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
+	VkSampler Sampler = CreateSampler(Device, VK_SAMPLER_REDUCTION_MODE_MAX);
+
+	VkDescriptorSetLayoutBinding DownscaleDescriptorSetLayoutBindings[] =
+	{
+		CreateDescriptorSetLayoutBinding(0, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT),
+		CreateDescriptorSetLayoutBinding(1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT),
+	};
+	VkDescriptorSetLayout DownscaleDescriptorSetLayout = CreateDescriptorSetLayout(Device, ArrayCount(DownscaleDescriptorSetLayoutBindings), DownscaleDescriptorSetLayoutBindings);
+	VkPipelineLayout DownscalePipelineLayout = CreatePipelineLayout(Device, 1, &DownscaleDescriptorSetLayout, sizeof(vec2));
+
+	// Identical to the culling set 2 layout, so its sets can be bound with Culling.PipelineLayout
+	VkDescriptorSetLayoutBinding HiZDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT);
+	VkDescriptorSetLayout HiZDescriptorSetLayout = CreateDescriptorSetLayout(Device, 1, &HiZDescriptorSetLayoutBinding);
+
+	// Sizes the device can't run keep a null pipeline and are skipped
+	VkPipeline DownscalePipelines[ArrayCount(DownscaleGroupSizes)] = {};
+	uint32_t LargestDownscale = 0;
+	VkShaderModule DownscaleCS = LoadShader(Device, "shaders_bytecode\\downscale.comp.spv");
+	for (uint32_t I = 0; I < ArrayCount(DownscaleGroupSizes); I++)
+	{
+		if (SupportsSquareWorkgroup(PhysicalDeviceProps, DownscaleGroupSizes[I]))
+		{
+			DownscalePipelines[I] = CreateDownscalePipeline(Device, DownscalePipelineLayout, DownscaleCS, DownscaleGroupSizes[I]);
+			LargestDownscale = I;
+		}
+	}
+	vkDestroyShaderModule(Device, DownscaleCS, 0);
+	Assert(DownscalePipelines[LargestDownscale] != VK_NULL_HANDLE);
+
+	// Float draws and no culling counters, only the workgroup size changes
+	VkPipeline CullPipelines[ArrayCount(CullGroupSizes)] = {};
+	VkShaderModule CullCS = LoadShader(Device, CullVariantPaths[bSubgroupCompaction ? CullSubgroupVariant : CullWorkgroupVariant]);
+	for (uint32_t I = 0; I < ArrayCount(CullGroupSizes); I++)
+	{
+		if (CullGroupSizes[I] <= std::min(PhysicalDeviceProps.limits.maxComputeWorkGroupSize[0], PhysicalDeviceProps.limits.maxComputeWorkGroupInvocations))
+			CullPipelines[I] = CreateDrawCullPipeline(Device, Culling.PipelineLayout, CullCS, false, false, CullGroupSizes[I]);
+	}
+	vkDestroyShaderModule(Device, CullCS, 0);
+
+	printf("\nDownscale benchmark: median of %d runs, full pyramid\n", RunsCount);
+	printf("resolution  mips");
+	for (uint32_t I = 0; I < ArrayCount(DownscaleGroupSizes); I++)
+		printf("   %2ux%-2u ms", DownscaleGroupSizes[I], DownscaleGroupSizes[I]);
+	printf("\n");
+
+	const uint32_t Resolutions[][2] = { { 1280, 720 }, { 1920, 1080 }, { 2560, 1440 }, { 3840, 2160 } };
+	for (uint32_t Resolution = 0; Resolution < ArrayCount(Resolutions); Resolution++)
+	{
+		SHiZTarget Target = CreateHiZTarget(Device, Queue, CommandPool, CommandBuffer, MemoryAllocator, Sampler, DownscaleDescriptorSetLayout, HiZDescriptorSetLayout, Resolutions[Resolution][0], Resolutions[Resolution][1]);
+
+		printf("%4ux%-5u %5u", Target.Width, Target.Height, (uint32_t)Target.DepthMipViews.size());
+		for (uint32_t I = 0; I < ArrayCount(DownscaleGroupSizes); I++)
+		{
+			if (DownscalePipelines[I])
+				printf(" %11.4f", TimeDispatches(Timer, WarmupRunsCount, RunsCount, []() {}, [&]() { RecordHiZBuild(CommandBuffer, Target, DownscalePipelines[I], DownscalePipelineLayout, DownscaleGroupSizes[I]); }, []() {}));
+			else
+				printf(" %11s", "-");
+		}
+		printf("\n");
+
+		DestroyHiZTarget(Target, Device, MemoryAllocator);
+	}
+
+	// Late pass with occlusion culling against a 1080p far plane pyramid: every draw in the frustum samples it and is emitted
+	SHiZTarget HiZTarget = CreateHiZTarget(Device, Queue, CommandPool, CommandBuffer, MemoryAllocator, Sampler, DownscaleDescriptorSetLayout, HiZDescriptorSetLayout, 1920, 1080);
+	TimeDispatches(Timer, 0, 1, []() {}, [&]() { RecordHiZBuild(CommandBuffer, HiZTarget, DownscalePipelines[LargestDownscale], DownscalePipelineLayout, DownscaleGroupSizes[LargestDownscale]); }, []() {});
+
+	SCulling BenchCulling = Culling;
+	BenchCulling.DescriptorSets[2] = HiZTarget.HiZDescriptorSet;
+	BenchCulling.bCellsDirty = false;
+
+	SCameraBuffer CameraBufferData = {};
+	UpdateCameraBuffer(CameraBufferData, vec3(0.0f), vec3(0.0f, 0.0f, -1.0f), float(HiZTarget.Width) / float(HiZTarget.Height), true);
+	memcpy(CameraBuffer.Data, &CameraBufferData, sizeof(CameraBufferData));
+
+	printf("\nDraw cull benchmark: %s compaction, %ux%u HiZ, median of %d runs\n", bSubgroupCompaction ? "subgroup" : "workgroup", HiZTarget.Width, HiZTarget.Height, RunsCount);
+	printf("   draws visible    emitted");
+	for (uint32_t I = 0; I < ArrayCount(CullGroupSizes); I++)
+		printf("  %4u wide ms", CullGroupSizes[I]);
+	printf("\n");
+
+	const uint32_t DrawsPerCell = 64;
+	uint32_t ObjectsCounts[] = { std::max(MaxObjectsCount / 100, 1u), std::max(MaxObjectsCount / 10, 1u), MaxObjectsCount };
+	std::vector<SMeshDraw> MeshDraws;
+	for (uint32_t CountIndex = 0; CountIndex < ArrayCount(ObjectsCounts); CountIndex++)
+	{
+		uint32_t ObjectsCount = ObjectsCounts[CountIndex];
+
+		std::vector<SCell> Cells = CreateRangeCells(ObjectsCount, DrawsPerCell);
+		UploadBuffer(Device, CommandPool, CommandBuffer, Queue, BenchCulling.CellBuffer, StagingBuffer, Cells.data(), Cells.size() * sizeof(SCell));
+		BenchCulling.CellsCount = (uint32_t)Cells.size();
+
+		SPushConstantsCompute PushConstants = { true, LodsCount, true, HiZTarget.Width, HiZTarget.Height, true, ObjectsCount, BenchCulling.CellsCount, BenchCulling.BucketsCount, DepthBinsCount };
+
+		for (uint32_t Step = 0; Step <= 4; Step++)
+		{
+			uint32_t ExpectedCount = CreateSplitDraws(MeshDraws, ObjectsCount, (uint32_t)Geometry.Meshes.size(), Step * 1024 / 4, Step);
+			UploadBuffer(Device, CommandPool, CommandBuffer, Queue, MeshDrawBuffer, StagingBuffer, MeshDraws.data(), MeshDraws.size() * sizeof(SMeshDraw));
+
+			printf("%8u %6u%%", ObjectsCount, Step * 25);
+			double Times[ArrayCount(CullGroupSizes)] = {};
+			bool bCountsMatch = true;
+			uint32_t EmittedCount = 0;
+			for (uint32_t I = 0; I < ArrayCount(CullGroupSizes); I++)
+			{
+				if (!CullPipelines[I])
+					continue;
+
+				Times[I] = TimeDispatches(Timer, WarmupRunsCount, RunsCount, [&]() { RecordCullingReset(CommandBuffer, BenchCulling, true); RecordCellCulling(CommandBuffer, BenchCulling, PushConstants); },
+										  [&]() { RecordDrawCulling(CommandBuffer, BenchCulling, CullPipelines[I], PushConstants); },
+										  [&]()
+										  {
+											  VkBufferCopy CopyRegion = { 0, 0, 2 * sizeof(uint32_t) };
+											  vkCmdCopyBuffer(CommandBuffer, BenchCulling.CountBuffer.Buffer, ReadbackBuffer.Buffer, 1, &CopyRegion);
+										  });
+
+				EmittedCount = ((uint32_t*)ReadbackBuffer.Data)[1];
+				bCountsMatch = bCountsMatch && (EmittedCount == ExpectedCount);
+			}
+
+			printf(" %10u", EmittedCount);
+			for (uint32_t I = 0; I < ArrayCount(CullGroupSizes); I++)
+			{
+				if (CullPipelines[I])
+					printf(" %13.4f", Times[I]);
+				else
+					printf(" %13s", "-");
+			}
+			if (bCountsMatch)
+				printf("\n");
+			else
+				printf("   MISMATCH: expected %d\n", ExpectedCount);
+		}
+	}
+
+	DestroyHiZTarget(HiZTarget, Device, MemoryAllocator);
+	for (uint32_t I = 0; I < ArrayCount(CullPipelines); I++)
+		vkDestroyPipeline(Device, CullPipelines[I], 0);
+	for (uint32_t I = 0; I < ArrayCount(DownscalePipelines); I++)
+		vkDestroyPipeline(Device, DownscalePipelines[I], 0);
+	vkDestroyPipelineLayout(Device, DownscalePipelineLayout, 0);
+	vkDestroyDescriptorSetLayout(Device, DownscaleDescriptorSetLayout, 0);
+	vkDestroyDescriptorSetLayout(Device, HiZDescriptorSetLayout, 0);
+	vkDestroySampler(Device, Sampler, 0);
+	vkDestroyQueryPool(Device, Timer.QueryPool, 0);
+	vmaDestroyBuffer(MemoryAllocator, ReadbackBuffer.Buffer, ReadbackBuffer.Allocation);
+}
+
+struct SKernelConfig
+{
+	uint32_t CullVariant;
+	uint32_t CullGroupSize;
+	uint32_t DownscaleGroupSize;
+};
+
+const char* KernelConfigPath = "kernel_tuning.txt";
+
+// Tuning always runs at this draw count, whatever -objects is, so a small first run doesn't pick the kernels of every later large one
+const uint32_t KernelTuningObjectsCount = 1000000;
+
+// The kernels the shaders were written for, used when a run doesn't tune
+SKernelConfig GetDefaultKernelConfig(const VkPhysicalDeviceProperties& PhysicalDeviceProps, bool bSubgroupCompaction)
+{
+	SKernelConfig Config = { bSubgroupCompaction ? CullSubgroupVariant : CullWorkgroupVariant, CullGroupSizes[0], DownscaleGroupSizes[0] };
+	for (uint32_t I = 0; I < ArrayCount(DownscaleGroupSizes); I++)
+	{
+		if (SupportsSquareWorkgroup(PhysicalDeviceProps, DownscaleGroupSizes[I]))
+			Config.DownscaleGroupSize = DownscaleGroupSizes[I];
+	}
+	return Config;
+}
+
+// Device UUID, driver version and tuning draw count, a driver update can change which configuration is the fastest
+void GetKernelConfigKey(VkPhysicalDevice PhysicalDevice, char (&Key)[64])
+{
+	VkPhysicalDeviceIDProperties IDProperties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES };
+	VkPhysicalDeviceProperties2 Properties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2 };
+	Properties.pNext = &IDProperties;
+	vkGetPhysicalDeviceProperties2(PhysicalDevice, &Properties);
+
+	int Length = 0;
+	for (uint32_t I = 0; I < VK_UUID_SIZE; I++)
+		Length += snprintf(Key + Length, sizeof(Key) - Length, "%02x", IDProperties.deviceUUID[I]);
+	snprintf(Key + Length, sizeof(Key) - Length, "-%08x-%u", Properties.properties.driverVersion, KernelTuningObjectsCount);
+}
+
+// One line per device: key, cull variant name, draw cull workgroup width, downscale workgroup side. Lines with values this build doesn't have are ignored
+bool LoadKernelConfig(const char* Path, const char* Key, bool bSubgroupCompaction, SKernelConfig& Config)
+{
+	FILE* File = fopen(Path, "r");
+	if (!File)
+		return false;
+
+	bool bFound = false;
+	char Line[256];
+	while (!bFound && fgets(Line, sizeof(Line), File))
+	{
+		char LineKey[64], VariantName[32];
+		uint32_t CullGroupSize = 0, DownscaleGroupSize = 0;
+		if ((sscanf(Line, "%63s %31s %u %u", LineKey, VariantName, &CullGroupSize, &DownscaleGroupSize) != 4) || (strcmp(LineKey, Key) != 0))
+			continue;
+
+		uint32_t VariantsCount = bSubgroupCompaction ? ArrayCount(CullVariantNames) : CullSubgroupVariant;
+		for (uint32_t I = 0; I < VariantsCount; I++)
+		{
+			if (strcmp(VariantName, CullVariantNames[I]) == 0)
+			{
+				Config.CullVariant = I;
+				bFound = true;
+			}
+		}
+
+		bFound = bFound && (std::find(std::begin(CullGroupSizes), std::end(CullGroupSizes), CullGroupSize) != std::end(CullGroupSizes));
+		bFound = bFound && (std::find(std::begin(DownscaleGroupSizes), std::end(DownscaleGroupSizes), DownscaleGroupSize) != std::end(DownscaleGroupSizes));
+		Config.CullGroupSize = CullGroupSize;
+		Config.DownscaleGroupSize = DownscaleGroupSize;
+	}
+
+	fclose(File);
+	return bFound;
+}
+
+// Replaces the line of this device and keeps the others
+void SaveKernelConfig(const char* Path, const char* Key, const SKernelConfig& Config)
+{
+	size_t KeyLength = strlen(Key);
+	std::vector<char> OtherLines;
+
+	FILE* File = fopen(Path, "r");
+	if (File)
+	{
+		char Line[256];
+		while (fgets(Line, sizeof(Line), File))
+		{
+			if ((strncmp(Line, Key, KeyLength) != 0) || (Line[KeyLength] != ' '))
+				OtherLines.insert(OtherLines.end(), Line, Line + strlen(Line));
+		}
+		fclose(File);
+	}
+
+	File = fopen(Path, "w");
+	Assert(File);
+	fwrite(OtherLines.data(), 1, OtherLines.size(), File);
+	fprintf(File, "%s %s %u %u\n", Key, CullVariantNames[Config.CullVariant], Config.CullGroupSize, Config.DownscaleGroupSize);
+	fclose(File);
+}
+
+// Times the downscale sizes on a 1080p pyramid and every compaction variant and width of the late pass draw cull on ObjectsCount synthetic draws,
+// half of them visible, and returns the fastest of each. Candidates that emit the wrong draw count are skipped. Overwrites the draw, cell and camera buffers
+SKernelConfig TuneKernels(VkDevice Device, VkPhysicalDevice PhysicalDevice, VkQueue Queue, VkCommandPool CommandPool, VkCommandBuffer CommandBuffer, VmaAllocator MemoryAllocator, const SCulling& Culling,
+						  const SBuffer& StagingBuffer, const SBuffer& MeshDrawBuffer, const SBuffer& CameraBuffer, VkSampler Sampler, VkDescriptorSetLayout DownscaleDescriptorSetLayout,
+						  VkPipelineLayout DownscalePipelineLayout, VkDescriptorSetLayout HiZDescriptorSetLayout, uint32_t MeshesCount, uint32_t ObjectsCount, bool bSubgroupCompaction)
+{
+	const uint32_t WarmupRunsCount = 2;
+	const uint32_t RunsCount = 8;
+
+	Assert(ObjectsCount * sizeof(SMeshDraw) <= MeshDrawBuffer.Allocation->GetSize());
+	Assert(2 * ObjectsCount * 3 * sizeof(uint32_t) <= Culling.VisibleDrawBuffer.Allocation->GetSize());
+
+	VkPhysicalDeviceProperties PhysicalDeviceProps = {};
+	vkGetPhysicalDeviceProperties(PhysicalDevice, &PhysicalDeviceProps);
+
+	SDispatchTimer Timer = CreateDispatchTimer(Device, PhysicalDevice, Queue, CommandPool, CommandBuffer);
+	SBuffer ReadbackBuffer = CreateBuffer(MemoryAllocator, 2 * sizeof(uint32_t), VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
+	SHiZTarget HiZTarget = CreateHiZTarget(Device, Queue, CommandPool, CommandBuffer, MemoryAllocator, Sampler, DownscaleDescriptorSetLayout, HiZDescriptorSetLayout, 1920, 1080);
+
+	printf("Tuning kernels, median of %d runs\n", RunsCount);
+
+	SKernelConfig Config = { CullWorkgroupVariant, CullGroupSizes[0], 0 };
+	double BestTime = DBL_MAX;
+
+	VkShaderModule DownscaleCS = LoadShader(Device, "shaders_bytecode\\downscale.comp.spv");
+	for (uint32_t I = 0; I < ArrayCount(DownscaleGroupSizes); I++)
+	{
+		uint32_t GroupSize = DownscaleGroupSizes[I];
+		if (!SupportsSquareWorkgroup(PhysicalDeviceProps, GroupSize))
+			continue;
+
+		VkPipeline Pipeline = CreateDownscalePipeline(Device, DownscalePipelineLayout, DownscaleCS, GroupSize);
+		double Time = TimeDispatches(Timer, WarmupRunsCount, RunsCount, []() {}, [&]() { RecordHiZBuild(CommandBuffer, HiZTarget, Pipeline, DownscalePipelineLayout, GroupSize); }, []() {});
+		vkDestroyPipeline(Device, Pipeline, 0);
+
+		printf("downscale %2ux%-2u %14.4f ms\n", GroupSize, GroupSize, Time);
+		if (Time < BestTime)
+		{
+			BestTime = Time;
+			Config.DownscaleGroupSize = GroupSize;
+		}
+	}
+	vkDestroyShaderModule(Device, DownscaleCS, 0);
+	Assert(Config.DownscaleGroupSize);
+
+	// The last downscale run left a far plane pyramid, so every draw in the frustum is tested against it and emitted
+	SCulling TuneCulling = Culling;
+	TuneCulling.DescriptorSets[2] = HiZTarget.HiZDescriptorSet;
+	TuneCulling.bCellsDirty = false;
+
+	std::vector<SCell> Cells = CreateRangeCells(ObjectsCount, 64);
+	UploadBuffer(Device, CommandPool, CommandBuffer, Queue, TuneCulling.CellBuffer, StagingBuffer, Cells.data(), Cells.size() * sizeof(SCell));
+	TuneCulling.CellsCount = (uint32_t)Cells.size();
+
+	std::vector<SMeshDraw> MeshDraws;
+	uint32_t ExpectedCount = CreateSplitDraws(MeshDraws, ObjectsCount, MeshesCount, 512, 0);
+	UploadBuffer(Device, CommandPool, CommandBuffer, Queue, MeshDrawBuffer, StagingBuffer, MeshDraws.data(), MeshDraws.size() * sizeof(SMeshDraw));
+
+	SCameraBuffer CameraBufferData = {};
+	UpdateCameraBuffer(CameraBufferData, vec3(0.0f), vec3(0.0f, 0.0f, -1.0f), float(HiZTarget.Width) / float(HiZTarget.Height), true);
+	memcpy(CameraBuffer.Data, &CameraBufferData, sizeof(CameraBufferData));
+
+	SPushConstantsCompute PushConstants = { true, LodsCount, true, HiZTarget.Width, HiZTarget.Height, true, ObjectsCount, TuneCulling.CellsCount, TuneCulling.BucketsCount, DepthBinsCount };
+
+	BestTime = DBL_MAX;
+	uint32_t VariantsCount = bSubgroupCompaction ? ArrayCount(CullVariantNames) : CullSubgroupVariant;
+	for (uint32_t Variant = 0; Variant < VariantsCount; Variant++)
+	{
+		VkShaderModule CullCS = LoadShader(Device, CullVariantPaths[Variant]);
+		for (uint32_t I = 0; I < ArrayCount(CullGroupSizes); I++)
+		{
+			uint32_t GroupSize = CullGroupSizes[I];
+			if (GroupSize > std::min(PhysicalDeviceProps.limits.maxComputeWorkGroupSize[0], PhysicalDeviceProps.limits.maxComputeWorkGroupInvocations))
+				continue;
+
+			VkPipeline Pipeline = CreateDrawCullPipeline(Device, TuneCulling.PipelineLayout, CullCS, false, false, GroupSize);
+			double Time = TimeDispatches(Timer, WarmupRunsCount, RunsCount, [&]() { RecordCullingReset(CommandBuffer, TuneCulling, true); RecordCellCulling(CommandBuffer, TuneCulling, PushConstants); },
+										 [&]() { RecordDrawCulling(CommandBuffer, TuneCulling, Pipeline, PushConstants); },
+										 [&]()
+										 {
+											 VkBufferCopy CopyRegion = { 0, 0, 2 * sizeof(uint32_t) };
+											 vkCmdCopyBuffer(CommandBuffer, TuneCulling.CountBuffer.Buffer, ReadbackBuffer.Buffer, 1, &CopyRegion);
+										 });
+			vkDestroyPipeline(Device, Pipeline, 0);
+
+			uint32_t EmittedCount = ((uint32_t*)ReadbackBuffer.Data)[1];
+			printf("draw cull %-9s %4u wide %8.4f ms%s\n", CullVariantNames[Variant], GroupSize, Time, (EmittedCount == ExpectedCount) ? "" : "   MISMATCH, skipped");
+			if ((EmittedCount == ExpectedCount) && (Time < BestTime))
+			{
+				BestTime = Time;
+				Config.CullVariant = Variant;
+				Config.CullGroupSize = GroupSize;
+			}
+		}
+		vkDestroyShaderModule(Device, CullCS, 0);
+	}
+
+	DestroyHiZTarget(HiZTarget, Device, MemoryAllocator);
+	vkDestroyQueryPool(Device, Timer.QueryPool, 0);
+	vmaDestroyBuffer(MemoryAllocator, ReadbackBuffer.Buffer, ReadbackBuffer.Allocation);
+
+	return Config;
+}
+
+// Scalar reference of cull.comp without occlusion culling. Lods get -1 for culled draws, margins are the distance to the closest frustum plane
+// and to the closest LOD switch distance, so mismatches caused only by float precision can be told apart from real ones
+void CullReference(const SInstances& Instances, const std::vector<SMesh>& Meshes, const SCameraBuffer& Camera, bool bLodsEnabled, std::vector<int>& Lods, std::vector<float>& FrustumMargins, std::vector<float>& LodMargins)
+{
+	Lods.assign(Instances.Slots.size(), -1);
+	FrustumMargins.assign(Instances.Slots.size(), FLT_MAX);
+	LodMargins.assign(Instances.Slots.size(), FLT_MAX);
+
+	for (uint32_t I = 0; I < Instances.Slots.size(); I++)
+	{
+		const SMeshDraw& MeshDraw = Instances.Slots[I];
+		if (MeshDraw.MeshIndex == DeadMeshIndex)
+			continue;
+
+		vec4 Sphere = GetBoundingSphere(MeshDraw, Meshes[MeshDraw.MeshIndex]);
+		vec3 Center = vec3(Sphere);
+		float Radius = Sphere.w;
+
+		bool bVisible = true;
+		for (uint32_t P = 0; P < 6; P++)
+		{
+			float Distance = glm::dot(vec3(Camera.Frustums[P]), Center) - Camera.Frustums[P].w;
+			bVisible = bVisible && (Distance >= -Radius);
+			FrustumMargins[I] = std::min(FrustumMargins[I], fabsf(Distance + Radius));
+		}
+
+		if (!bVisible)
+			continue;
+
+		float Distance = glm::length(Center - vec3(Camera.CameraPosition)) - Radius;
+		float LodDistance = log2f(std::max(Distance, 1.0f));
+		Lods[I] = bLodsEnabled ? glm::clamp(int(LodDistance) - 1, 0, int(LodsCount) - 1) : 0;
+		LodMargins[I] = fabsf(std::max(Distance, 1.0f) - exp2f(roundf(LodDistance)));
+	}
+}
+
+// Runs the late pass with occlusion culling off and cleared visibility for a few scripted cameras, so the GPU has to emit exactly the draws
+// that pass the frustum. Reads back the visible draws, commands and instances and compares them with CullReference
+bool ValidateCulling(VkDevice Device, VkQueue Queue, VkCommandPool CommandPool, VkCommandBuffer CommandBuffer, VmaAllocator MemoryAllocator, SCulling& Culling,
+					 const SBuffer& CameraBuffer, VkImage HiZImage, const SGeometry& Geometry, const SInstances& Instances, float SceneRadius, float AspectRatio, bool bQuantizedDraws)
+{
+	struct SValidationCamera
+	{
+		const char* Name;
+		vec3 Position;
+		vec3 Dir;
+		bool bFrustumCulling;
+	};
+	SValidationCamera Cameras[] =
+	{
+		{ "start", vec3(0.0f, 0.0f, 3.0f), vec3(0.0f, 0.0f, -1.0f), true },
+		{ "side", vec3(0.0f), vec3(1.0f, 0.0f, 0.0f), true },
+		{ "up", vec3(0.0f), glm::normalize(vec3(0.3f, 0.9f, 0.1f)), true },
+		{ "outside", vec3(-2.0f * SceneRadius, 0.5f * SceneRadius, -2.0f * SceneRadius), glm::normalize(vec3(1.0f, -0.25f, 1.0f)), true },
+		{ "corner", vec3(SceneRadius), glm::normalize(vec3(-1.0f)), true },
+		{ "no culling", vec3(0.0f, 0.0f, 3.0f), vec3(0.0f, 0.0f, -1.0f), false },
+	};
+
+	// Quantized draws decode to slightly different spheres than the float ones the reference uses
+	float Tolerance = bQuantizedDraws ? 4e-3f : 1e-4f;
+
+	uint32_t ObjectsCount = (uint32_t)Instances.Slots.size();
+	uint32_t KeysCount = Culling.BucketsCount * DepthBinsCount;
+	VkDeviceSize CountsOffset = 0;
+	VkDeviceSize CommandsOffset = CountsOffset + 4 * sizeof(uint32_t);
+	VkDeviceSize VisibleDrawsOffset = CommandsOffset + KeysCount * sizeof(VkDrawIndexedIndirectCommand);
+	VkDeviceSize InstancesOffset = VisibleDrawsOffset + ObjectsCount * 3 * sizeof(uint32_t);
+	SBuffer ReadbackBuffer = CreateBuffer(MemoryAllocator, InstancesOffset + ObjectsCount * sizeof(uint32_t), VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
+
+	BeginCommandBuffer(Device, CommandPool, CommandBuffer);
+	VkImageMemoryBarrier HiZBarrier = CreateImageMemoryBarrier(0, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, HiZImage, VK_IMAGE_ASPECT_COLOR_BIT);
+	vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, 0, 0, 1, &HiZBarrier);
+	SubmitAndWait(Device, Queue, CommandBuffer);
+
+	SPushConstantsCompute PushConstants = { true, LodsCount, false, 1, 1, true, ObjectsCount, Culling.CellsCount, Culling.BucketsCount, DepthBinsCount };
+
+	printf("\nCulling validation: %d draws, %d cells\n", ObjectsCount, Culling.CellsCount);
+	printf("%-12s %10s %10s %10s %10s %10s %10s  per LOD reference/gpu\n", "camera", "reference", "gpu", "missing", "extra", "wrong lod", "bad cmds");
+
+	bool bPassed = true;
+	std::vector<int> Lods, GpuLods;
+	std::vector<float> FrustumMargins, LodMargins;
+	for (uint32_t CameraIndex = 0; CameraIndex < ArrayCount(Cameras); CameraIndex++)
+	{
+		const SValidationCamera& Camera = Cameras[CameraIndex];
+
+		SCameraBuffer CameraBufferData = {};
+		CameraBufferData.QuantizationGrid = Instances.Grid.Quantization;
+		UpdateCameraBuffer(CameraBufferData, Camera.Position, Camera.Dir, AspectRatio, Camera.bFrustumCulling);
+		memcpy(CameraBuffer.Data, &CameraBufferData, sizeof(CameraBufferData));
+
+		BeginCommandBuffer(Device, CommandPool, CommandBuffer);
+
+		RecordCullingReset(CommandBuffer, Culling, true);
+		RecordCellCulling(CommandBuffer, Culling, PushConstants);
+		RecordDrawCulling(CommandBuffer, Culling, Culling.DrawCullPipeline, PushConstants);
+		RecordDrawBucketing(CommandBuffer, Culling, PushConstants);
+
+		VkBufferMemoryBarrier ReadbackBarriers[] =
+		{
+			CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT, Culling.CountBuffer, 4 * sizeof(uint32_t)),
+			CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT, Culling.IndirectBuffer, VK_WHOLE_SIZE),
+			CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT, Culling.VisibleDrawBuffer, VK_WHOLE_SIZE),
+			CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT, Culling.InstanceBuffer, VK_WHOLE_SIZE),
+		};
+		vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, 0, ArrayCount(ReadbackBarriers), ReadbackBarriers, 0, 0);
+
+		VkBufferCopy CountsCopy = { 0, CountsOffset, 4 * sizeof(uint32_t) };
+		VkBufferCopy CommandsCopy = { KeysCount * sizeof(VkDrawIndexedIndirectCommand), CommandsOffset, KeysCount * sizeof(VkDrawIndexedIndirectCommand) };
+		VkBufferCopy VisibleDrawsCopy = { ObjectsCount * 3 * sizeof(uint32_t), VisibleDrawsOffset, ObjectsCount * 3 * sizeof(uint32_t) };
+		VkBufferCopy InstancesCopy = { ObjectsCount * sizeof(uint32_t), InstancesOffset, ObjectsCount * sizeof(uint32_t) };
+		vkCmdCopyBuffer(CommandBuffer, Culling.CountBuffer.Buffer, ReadbackBuffer.Buffer, 1, &CountsCopy);
+		vkCmdCopyBuffer(CommandBuffer, Culling.IndirectBuffer.Buffer, ReadbackBuffer.Buffer, 1, &CommandsCopy);
+		vkCmdCopyBuffer(CommandBuffer, Culling.VisibleDrawBuffer.Buffer, ReadbackBuffer.Buffer, 1, &VisibleDrawsCopy);
+		vkCmdCopyBuffer(CommandBuffer, Culling.InstanceBuffer.Buffer, ReadbackBuffer.Buffer, 1, &InstancesCopy);
+
+		SubmitAndWait(Device, Queue, CommandBuffer);
+
+		CullReference(Instances, Geometry.Meshes, CameraBufferData, true, Lods, FrustumMargins, LodMargins);
+
+		const uint8_t* Readback = (const uint8_t*)ReadbackBuffer.Data;
+		const uint32_t* Counts = (const uint32_t*)(Readback + CountsOffset);
+		const VkDrawIndexedIndirectCommand* Commands = (const VkDrawIndexedIndirectCommand*)(Readback + CommandsOffset);
+		const uint32_t* VisibleDraws = (const uint32_t*)(Readback + VisibleDrawsOffset);
+		const uint32_t* DrawInstances = (const uint32_t*)(Readback + InstancesOffset);
+		uint32_t GpuDrawCount = std::min(Counts[1], ObjectsCount);
+		uint32_t GpuCommandCount = std::min(Counts[3], KeysCount);
+
+		// Mismatches within the tolerance of a frustum plane or a LOD switch are counted separately and don't fail the validation
+		uint32_t MissingCount = 0, ExtraCount = 0, WrongLodCount = 0, BadCommandCount = 0, BorderlineCount = 0;
+		uint32_t ReferenceLodCounts[LodsCount] = {}, GpuLodCounts[LodsCount] = {};
+
+		GpuLods.assign(ObjectsCount, -1);
+		for (uint32_t I = 0; I < GpuDrawCount; I++)
+		{
+			uint32_t DrawIndex = VisibleDraws[3 * I + 0];
+			uint32_t Key = VisibleDraws[3 * I + 1];
+			uint32_t MeshIndex = (Key % Culling.BucketsCount) / LodsCount;
+			if ((DrawIndex >= ObjectsCount) || (GpuLods[DrawIndex] != -1) || (MeshIndex != Instances.Slots[DrawIndex].MeshIndex))
+			{
+				ExtraCount++;
+				continue;
+			}
+
+			GpuLods[DrawIndex] = int(Key % LodsCount);
+			GpuLodCounts[Key % LodsCount]++;
+		}
+
+		for (uint32_t I = 0; I < ObjectsCount; I++)
+		{
+			if (Lods[I] != -1)
+				ReferenceLodCounts[Lods[I]]++;
+
+			if (Lods[I] == GpuLods[I])
+				continue;
+
+			bool bFrustumMismatch = (Lods[I] == -1) || (GpuLods[I] == -1);
+			vec4 Sphere = GetBoundingSphere(Instances.Slots[I], Geometry.Meshes[Instances.Slots[I].MeshIndex]);
+			float Distance = glm::length(vec3(Sphere) - Camera.Position);
+			if (bFrustumMismatch ? (FrustumMargins[I] <= Tolerance * (1.0f + Sphere.w + Distance)) : (LodMargins[I] <= Tolerance * (1.0f + Distance)))
+			{
+				BorderlineCount++;
+			}
+			else if (GpuLods[I] == -1)
+			{
+				MissingCount++;
+			}
+			else if (Lods[I] == -1)
+			{
+				ExtraCount++;
+			}
+			else
+			{
+				WrongLodCount++;
+			}
+		}
+
+		// Every command has to cover instances of its own mesh LOD, and all commands together exactly the visible draws
+		uint32_t CommandInstanceCount = 0;
+		for (uint32_t I = 0; I < GpuCommandCount; I++)
+		{
+			const VkDrawIndexedIndirectCommand& Command = Commands[I];
+			bool bCommandValid = (Command.firstInstance >= ObjectsCount) && (Command.firstInstance - ObjectsCount + Command.instanceCount <= GpuDrawCount);
+			for (uint32_t J = 0; bCommandValid && (J < Command.instanceCount); J++)
+			{
+				uint32_t DrawIndex = DrawInstances[Command.firstInstance - ObjectsCount + J];
+				bCommandValid = (DrawIndex < ObjectsCount) && (GpuLods[DrawIndex] != -1);
+				if (bCommandValid)
+				{
+					const SMesh& Mesh = Geometry.Meshes[Instances.Slots[DrawIndex].MeshIndex];
+					bCommandValid = (Command.indexCount == Mesh.IndexCount[GpuLods[DrawIndex]]) && (Command.firstIndex == Mesh.IndexOffset[GpuLods[DrawIndex]]) && (Command.vertexOffset == int32_t(Mesh.VertexOffset));
+				}
+			}
+
+			BadCommandCount += bCommandValid ? 0 : 1;
+			CommandInstanceCount += Command.instanceCount;
+		}
+		BadCommandCount += (CommandInstanceCount == GpuDrawCount) ? 0 : 1;
+
+		uint32_t ReferenceCount = 0;
+		for (uint32_t I = 0; I < LodsCount; I++)
+			ReferenceCount += ReferenceLodCounts[I];
+
+		printf("%-12s %10d %10d %10d %10d %10d %10d ", Camera.Name, ReferenceCount, Counts[1], MissingCount, ExtraCount, WrongLodCount, BadCommandCount);
+		for (uint32_t I = 0; I < LodsCount; I++)
+			printf(" %d/%d", ReferenceLodCounts[I], GpuLodCounts[I]);
+		if (BorderlineCount > 0)
+			printf("  (%d within tolerance)", BorderlineCount);
+
+		bool bCameraPassed = (MissingCount == 0) && (ExtraCount == 0) && (WrongLodCount == 0) && (BadCommandCount == 0) && (Counts[1] <= ObjectsCount);
+		printf(bCameraPassed ? "\n" : "   FAILED\n");
+		bPassed = bPassed && bCameraPassed;
+	}
+
+	printf("Culling validation %s\n", bPassed ? "passed" : "FAILED");
+
+	vmaDestroyBuffer(MemoryAllocator, ReadbackBuffer.Buffer, ReadbackBuffer.Allocation);
+
+	return bPassed;
+}
+
+// Ground truth for the HiZ test: every draw the reference puts in the frustum is drawn once more against the final depth buffer inside
+// its own occlusion query, so a passed sample means the draw really has pixels on screen
+struct SOcclusionStats
+{
+	FILE* File;
+	VkQueryPool QueryPool;
+	VkPipeline QueryPipeline;
+	VkDescriptorSet QueryDescriptorSet;
+	SBuffer QueryInstanceBuffer; // Identity list, every query draw picks its slot with firstInstance
+	SBuffer ReadbackBuffer; // Visibility bits before the early pass, then after the late pass
+	VkDeviceSize VisibilitySize;
+
+	std::vector<int> Lods;
+	std::vector<float> FrustumMargins;
+	std::vector<float> LodMargins;
+	std::vector<uint32_t> QueriedDraws;
+	std::vector<uint32_t> QueryResults;
+};
+
+void RecordVisibilityReadback(VkCommandBuffer CommandBuffer, const SCulling& Culling, const SBuffer& ReadbackBuffer, VkDeviceSize ReadbackOffset, VkDeviceSize Size)
+{
+	VkBufferMemoryBarrier ReadBarrier = CreateBufferMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT, Culling.VisibilityBuffer, VK_WHOLE_SIZE);
+	vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, 0, 1, &ReadBarrier, 0, 0);
+
+	VkBufferCopy CopyRegion = { 0, ReadbackOffset, Size };
+	vkCmdCopyBuffer(CommandBuffer, Culling.VisibilityBuffer.Buffer, ReadbackBuffer.Buffer, 1, &CopyRegion);
+
+	VkBufferMemoryBarrier WriteBarrier = CreateBufferMemoryBarrier(VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, Culling.VisibilityBuffer, VK_WHOLE_SIZE);
+	vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, 1, &WriteBarrier, 0, 0);
+}
+
+// Expects the late render pass to be active, depth test only so the final image stays untouched
+void RecordOcclusionQueries(VkCommandBuffer CommandBuffer, const SOcclusionStats& OcclusionStats, VkPipelineLayout PipelineLayout, VkDescriptorSet CameraDescriptorSet, const SInstances& Instances, const std::vector<SMesh>& Meshes)
+{
+	vkCmdBindPipeline(CommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, OcclusionStats.QueryPipeline);
+
+	VkDescriptorSet DescriptorSets[] = { CameraDescriptorSet, OcclusionStats.QueryDescriptorSet };
+	vkCmdBindDescriptorSets(CommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, PipelineLayout, 0, ArrayCount(DescriptorSets), DescriptorSets, 0, 0);
+
+	for (uint32_t I = 0; I < OcclusionStats.QueriedDraws.size(); I++)
+	{
+		uint32_t DrawIndex = OcclusionStats.QueriedDraws[I];
+		const SMesh& Mesh = Meshes[Instances.Slots[DrawIndex].MeshIndex];
+		uint32_t LodIndex = uint32_t(OcclusionStats.Lods[DrawIndex]);
+
+		vkCmdBeginQuery(CommandBuffer, OcclusionStats.QueryPool, I, 0);
+		vkCmdDrawIndexed(CommandBuffer, Mesh.IndexCount[LodIndex], 1, Mesh.IndexOffset[LodIndex], Mesh.VertexOffset, DrawIndex);
+		vkCmdEndQuery(CommandBuffer, OcclusionStats.QueryPool, I);
+	}
+}
+
+// Appends one CSV row. HiZ false negatives are draws the test rejected that have pixels on screen, false positives are accepted draws without any,
+// missing are visible draws drawn by neither pass and hidden are drawn ones without pixels. These columns stay empty without a CPU reference
+void WriteOcclusionStats(VkDevice Device, SOcclusionStats& OcclusionStats, const SCullStats& CullStats, uint32_t FrameID, float Time, float OcclusionBias, bool bReference)
+{
+	fprintf(OcclusionStats.File, "%u,%.4f,%g,%u,%u,%u,%u,%u", FrameID, Time, OcclusionBias, CullStats.CellCulledDraws, CullStats.TestedDraws, CullStats.FrustumCulledDraws, CullStats.OcclusionCulledDraws, CullStats.VisibleDraws);
+
+	if (!bReference)
+	{
+		fprintf(OcclusionStats.File, ",,,,,,\n");
+		return;
+	}
+
+	uint32_t QueriedCount = (uint32_t)OcclusionStats.QueriedDraws.size();
+	OcclusionStats.QueryResults.resize(QueriedCount);
+	if (QueriedCount > 0)
+		VkCheck(vkGetQueryPoolResults(Device, OcclusionStats.QueryPool, 0, QueriedCount, QueriedCount * sizeof(uint32_t), OcclusionStats.QueryResults.data(), sizeof(uint32_t), 0));
+
+	const uint32_t* VisibilityBefore = (const uint32_t*)OcclusionStats.ReadbackBuffer.Data;
+	const uint32_t* VisibilityAfter = VisibilityBefore + OcclusionStats.VisibilitySize / sizeof(uint32_t);
+
+	uint32_t TrulyVisibleCount = 0, FalseNegativeCount = 0, FalsePositiveCount = 0, MissingCount = 0, HiddenCount = 0;
+	for (uint32_t I = 0; I < QueriedCount; I++)
+	{
+		uint32_t DrawIndex = OcclusionStats.QueriedDraws[I];
+		uint32_t VisibilityMask = 1u << (DrawIndex & 31);
+		bool bWasVisible = (VisibilityBefore[DrawIndex >> 5] & VisibilityMask) != 0;
+		bool bAccepted = (VisibilityAfter[DrawIndex >> 5] & VisibilityMask) != 0;
+		bool bDrawn = bWasVisible || bAccepted;
+		bool bTrulyVisible = OcclusionStats.QueryResults[I] > 0;
+
+		TrulyVisibleCount += bTrulyVisible ? 1 : 0;
+		FalseNegativeCount += (bTrulyVisible && !bAccepted) ? 1 : 0;
+		FalsePositiveCount += (!bTrulyVisible && bAccepted) ? 1 : 0;
+		MissingCount += (bTrulyVisible && !bDrawn) ? 1 : 0;
+		HiddenCount += (!bTrulyVisible && bDrawn) ? 1 : 0;
+	}
+
+	fprintf(OcclusionStats.File, ",%u,%u,%u,%u,%u,%u\n", QueriedCount, TrulyVisibleCount, FalseNegativeCount, FalsePositiveCount, MissingCount, HiddenCount);
+}
+
+SMeshDraw CreateRandomMeshDraw(uint32_t MeshesCount, float SceneRadius)
+{
+	SMeshDraw MeshDraw = {};
+	uint32_t MeshIndex = rand() % MeshesCount;
+
+	MeshDraw.Position.x = 2.0f * SceneRadius * (float(rand()) / RAND_MAX) - SceneRadius;
+	MeshDraw.Position.y = 2.0f * SceneRadius * (float(rand()) / RAND_MAX) - SceneRadius;
+	MeshDraw.Position.z = 2.0f * SceneRadius * (float(rand()) / RAND_MAX) - SceneRadius;
+
+	MeshDraw.Scale = ((float(rand()) / RAND_MAX) + 1) * 2;
+	// Scaling for bunny.obj
+	if (MeshIndex == 1)
+		MeshDraw.Scale *= 0.25f;
+
+	float Angle = glm::radians(90.0f * (float(rand()) / RAND_MAX));
+	vec3 Axis = vec3((float(rand()) / RAND_MAX) * 2 - 1, (float(rand()) / RAND_MAX) * 2 - 1, (float(rand()) / RAND_MAX) * 2 - 1);
+	MeshDraw.Orientation = PackOrientation(glm::rotate(quat(1, 0, 0, 0), Angle, Axis));
+	MeshDraw.MeshIndex = MeshIndex;
+
+	return MeshDraw;
+}
+
+struct SCameraKey
+{
+	vec3 Position;
+	float Pitch;
+	float Head;
+};
+
+vec3 GetCameraDir(float Pitch, float Head)
+{
+	vec3 Dir;
+	Dir.x = -cosf(glm::radians(Pitch)) * sinf(glm::radians(Head));
+	Dir.y = sinf(glm::radians(Pitch));
+	Dir.z = -cosf(glm::radians(Pitch)) * cosf(glm::radians(Head));
+
+	return normalize(Dir);
+}
+
+// One "x y z pitch head" line per key, K appends the current camera to the file in interactive runs
+std::vector<SCameraKey> LoadCameraPath(const char* Path)
+{
+	std::vector<SCameraKey> Keys;
+
+	FILE* File = fopen(Path, "r");
+	if (!File)
+	{
+		printf("Can't open %s\n", Path);
+		return Keys;
+	}
+
+	SCameraKey Key = {};
+	while (fscanf(File, "%f %f %f %f %f", &Key.Position.x, &Key.Position.y, &Key.Position.z, &Key.Pitch, &Key.Head) == 5)
+		Keys.push_back(Key);
+	fclose(File);
+
+	return Keys;
+}
+
+void AppendCameraKey(const char* Path, vec3 Position, float Pitch, float Head)
+{
+	FILE* File = fopen(Path, "a");
+	if (File)
+	{
+		fprintf(File, "%f %f %f %f %f\n", Position.x, Position.y, Position.z, Pitch, Head);
+		fclose(File);
+	}
+}
+
+// T in [0, 1] along the recorded keys, or along a procedural loop through the scene volume without them
+void GetBenchmarkCamera(const std::vector<SCameraKey>& Path, float T, float SceneRadius, vec3& Position, vec3& Dir)
+{
+	if (!Path.empty())
+	{
+		float KeyT = T * float(Path.size() - 1);
+		uint32_t Key = std::min(uint32_t(KeyT), uint32_t(Path.size() - 1));
+		uint32_t NextKey = std::min(Key + 1, uint32_t(Path.size() - 1));
+		float Alpha = KeyT - float(Key);
+
+		Position = glm::mix(Path[Key].Position, Path[NextKey].Position, Alpha);
+		Dir = GetCameraDir(glm::mix(Path[Key].Pitch, Path[NextKey].Pitch, Alpha), glm::mix(Path[Key].Head, Path[NextKey].Head, Alpha));
+		return;
+	}
+
+	auto GetLoopPosition = [SceneRadius](float T)
+	{
+		float Angle = 2.0f * glm::pi<float>() * T;
+		return 0.6f * SceneRadius * vec3(sinf(Angle), 0.25f * sinf(3.0f * Angle), cosf(Angle) * cosf(0.5f * Angle));
+	};
+	Position = GetLoopPosition(T);
+	Dir = glm::normalize(GetLoopPosition(T + 0.01f) - Position);
+}
+
+// Every configuration runs the whole camera path after BenchmarkWarmupFrames unrecorded frames
+struct SBenchmarkConfig
+{
+	const char* Name;
+	bool bCulling;
+	bool bLods;
+	bool bOcclusionCulling;
+};
+
+const SBenchmarkConfig BenchmarkConfigs[] =
+{
+	{ "all", true, true, true },
+	{ "no-occlusion", true, true, false },
+	{ "no-lods", true, false, true },
+	{ "no-culling", false, true, false },
+};
+const uint32_t BenchmarkWarmupFrames = 16;
+const float BenchmarkFrameTime = 1.0f / 60.0f;
+
+// The benchmark CSV columns after config, objects and frame, the compare mode tests each of them
+const char* BenchmarkMetricNames[] = { "cpu_ms", "gpu_ms", "culling_ms", "render_ms", "hiz_ms" };
+const uint32_t BenchmarkMetricsCount = ArrayCount(BenchmarkMetricNames);
+
+// Cull stat columns the compare mode checks for behavior changes, after the timings come tested, frustum_culled, occlusion_culled, visible, triangles
+const char* BenchmarkStatNames[] = { "visible", "triangles" };
+const uint32_t BenchmarkStatColumns[] = { 3, 4 };
+const uint32_t BenchmarkStatsCount = ArrayCount(BenchmarkStatNames);
+
+struct SBenchmarkFrame
+{
+	uint32_t Config;
+	uint32_t PathFrame;
+	bool bRecorded;
+	double CpuTime;
+
+	bool bCpuCulling;
+	SCullStats CpuCullStats; // GPU culling stats come from the readback ring instead
+};
+
+struct SBenchmark
+{
+	FILE* File;
+	std::vector<SCameraKey> Path;
+	uint32_t FramesPerConfig;
+	uint32_t ObjectsCount;
+
+	// CPU side of the frames whose GPU timings and culling stats haven't been read back yet
+	SBenchmarkFrame Frames[GpuProfilerRingSize];
+};
+
+// Includes the frames it takes to read back the last recorded one
+uint32_t GetBenchmarkFramesCount(const SBenchmark& Benchmark)
+{
+	return ArrayCount(BenchmarkConfigs) * (BenchmarkWarmupFrames + Benchmark.FramesPerConfig) + GpuProfilerRingSize - 1;
+}
+
+SBenchmarkFrame GetBenchmarkFrame(const SBenchmark& Benchmark, uint32_t FrameID)
+{
+	uint32_t ConfigFramesCount = BenchmarkWarmupFrames + Benchmark.FramesPerConfig;
+
+	SBenchmarkFrame Frame = {};
+	Frame.Config = std::min(FrameID / ConfigFramesCount, uint32_t(ArrayCount(BenchmarkConfigs) - 1));
+	uint32_t Step = FrameID - Frame.Config * ConfigFramesCount;
+	Frame.bRecorded = (Step >= BenchmarkWarmupFrames) && (Step < ConfigFramesCount);
+	Frame.PathFrame = (Step >= BenchmarkWarmupFrames) ? std::min(Step - BenchmarkWarmupFrames, Benchmark.FramesPerConfig - 1) : 0;
+
+	return Frame;
+}
+
+// Writes the frame the GPU profiler and culling stats have just been read back for
+void WriteBenchmarkFrame(SBenchmark& Benchmark, const SGpuProfiler& GpuProfiler, const SCullStats& CullStats, uint32_t ResultsFrameID)
+{
+	const SBenchmarkFrame& Frame = Benchmark.Frames[ResultsFrameID % GpuProfilerRingSize];
+	if (!Frame.bRecorded)
+		return;
+
+	fprintf(Benchmark.File, "%s,%u,%u,%.4f,%.4f,%.4f,%.4f,%.4f,%u,%u,%u,%u,%" PRIu64 "\n", BenchmarkConfigs[Frame.Config].Name, Benchmark.ObjectsCount, Frame.PathFrame, Frame.CpuTime,
+			GetGpuScopeTime(GpuProfiler, "Frame"),
+			GetGpuScopeTime(GpuProfiler, "Early culling") + GetGpuScopeTime(GpuProfiler, "Late culling"),
+			GetGpuScopeTime(GpuProfiler, "Early render") + GetGpuScopeTime(GpuProfiler, "Late render"),
+			GetGpuScopeTime(GpuProfiler, "HiZ"),
+			CullStats.TestedDraws + CullStats.CellCulledDraws, CullStats.FrustumCulledDraws + CullStats.CellCulledDraws, CullStats.OcclusionCulledDraws, CullStats.VisibleDraws, CullStats.EmittedTriangles);
+}
+
+// Per configuration and metric samples of a benchmark CSV
+struct SBenchmarkSamples
+{
+	std::vector<double> Values[ArrayCount(BenchmarkConfigs)][BenchmarkMetricsCount];
+	std::vector<double> Stats[ArrayCount(BenchmarkConfigs)][BenchmarkStatsCount];
+};
+
+bool LoadBenchmarkSamples(const char* Path, SBenchmarkSamples& Samples)
+{
+	FILE* File = fopen(Path, "r");
+	if (!File)
+	{
+		printf("Can't open %s\n", Path);
+		return false;
+	}
+
+	char Line[512];
+	fgets(Line, sizeof(Line), File);
+	while (fgets(Line, sizeof(Line), File))
+	{
+		char ConfigName[32];
+		uint32_t ObjectsCount, Frame;
+		double Metrics[BenchmarkMetricsCount];
+		double Counts[5];
+		int ColumnsCount = sscanf(Line, "%31[^,],%u,%u,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf", ConfigName, &ObjectsCount, &Frame, &Metrics[0], &Metrics[1], &Metrics[2], &Metrics[3], &Metrics[4],
+								  &Counts[0], &Counts[1], &Counts[2], &Counts[3], &Counts[4]);
+		if (ColumnsCount < 3 + int(BenchmarkMetricsCount))
+			continue;
+
+		// CSVs written before the stat columns existed only have the timings
+		bool bStats = (ColumnsCount == 3 + int(BenchmarkMetricsCount) + int(ArrayCount(Counts)));
+		for (uint32_t Config = 0; Config < ArrayCount(BenchmarkConfigs); Config++)
+		{
+			if (strcmp(ConfigName, BenchmarkConfigs[Config].Name) == 0)
+			{
+				for (uint32_t Metric = 0; Metric < BenchmarkMetricsCount; Metric++)
+					Samples.Values[Config][Metric].push_back(Metrics[Metric]);
+				for (uint32_t Stat = 0; bStats && (Stat < BenchmarkStatsCount); Stat++)
+					Samples.Stats[Config][Stat].push_back(Counts[BenchmarkStatColumns[Stat]]);
+			}
+		}
+	}
+	fclose(File);
+
+	return true;
+}
+
+void GetMeanAndVariance(const std::vector<double>& Values, double& Mean, double& Variance)
+{
+	Mean = 0.0;
+	for (double Value : Values)
+		Mean += Value;
+	Mean /= double(std::max(Values.size(), size_t(1)));
+
+	Variance = 0.0;
+	for (double Value : Values)
+		Variance += (Value - Mean) * (Value - Mean);
+	Variance /= double(std::max(Values.size(), size_t(2)) - 1);
+}
+
+// Welch's t-test per configuration and metric. Frames along the path are correlated, which makes t overconfident,
+// so a regression also has to be slower by more than BenchmarkRegressionThreshold. The cull stats of the fixed path don't depend on timing,
+// so any mean that moves by more than BenchmarkStatsThreshold either way is a behavior change. Returns the number of regressions and changes
+const double BenchmarkRegressionThreshold = 0.03;
+const double BenchmarkSignificanceT = 3.3;
+const double BenchmarkStatsThreshold = 0.01;
+uint32_t CompareBenchmarks(const char* BaselinePath, const char* CurrentPath)
+{
+	SBenchmarkSamples Baseline, Current;
+	if (!LoadBenchmarkSamples(BaselinePath, Baseline) || !LoadBenchmarkSamples(CurrentPath, Current))
+		return 1;
+
+	uint32_t RegressionsCount = 0;
+	uint32_t ChangesCount = 0;
+	printf("%-14s%-12s%12s%12s%10s%10s\n", "config", "metric", "baseline", "current", "change", "t");
+	for (uint32_t Config = 0; Config < ArrayCount(BenchmarkConfigs); Config++)
+	{
+		for (uint32_t Metric = 0; Metric < BenchmarkMetricsCount; Metric++)
+		{
+			const std::vector<double>& BaselineValues = Baseline.Values[Config][Metric];
+			const std::vector<double>& CurrentValues = Current.Values[Config][Metric];
+			if (BaselineValues.empty() || CurrentValues.empty())
+				continue;
+
+			double BaselineMean, BaselineVariance, CurrentMean, CurrentVariance;
+			GetMeanAndVariance(BaselineValues, BaselineMean, BaselineVariance);
+			GetMeanAndVariance(CurrentValues, CurrentMean, CurrentVariance);
+
+			double StandardError = sqrt(BaselineVariance / double(BaselineValues.size()) + CurrentVariance / double(CurrentValues.size()));
+			double T = (StandardError > 0.0) ? (CurrentMean - BaselineMean) / StandardError : 0.0;
+			double Change = (BaselineMean > 0.0) ? (CurrentMean - BaselineMean) / BaselineMean : 0.0;
+
+			bool bRegression = (T > BenchmarkSignificanceT) && (Change > BenchmarkRegressionThreshold);
+			RegressionsCount += bRegression ? 1 : 0;
+
+			printf("%-14s%-12s%12.4f%12.4f%+9.1f%%%10.2f%s\n", BenchmarkConfigs[Config].Name, BenchmarkMetricNames[Metric], BaselineMean, CurrentMean, 100.0 * Change, T, bRegression ? "  REGRESSION" : "");
+		}
+
+		for (uint32_t Stat = 0; Stat < BenchmarkStatsCount; Stat++)
+		{
+			const std::vector<double>& BaselineValues = Baseline.Stats[Config][Stat];
+			const std::vector<double>& CurrentValues = Current.Stats[Config][Stat];
+			if (BaselineValues.empty() || CurrentValues.empty())
+				continue;
+
+			double BaselineMean, BaselineVariance, CurrentMean, CurrentVariance;
+			GetMeanAndVariance(BaselineValues, BaselineMean, BaselineVariance);
+			GetMeanAndVariance(CurrentValues, CurrentMean, CurrentVariance);
+
+			double Change = (BaselineMean > 0.0) ? (CurrentMean - BaselineMean) / BaselineMean : ((CurrentMean > 0.0) ? 1.0 : 0.0);
+			bool bChanged = fabs(Change) > BenchmarkStatsThreshold;
+			ChangesCount += bChanged ? 1 : 0;
+
+			printf("%-14s%-12s%12.1f%12.1f%+9.1f%%%10s%s\n", BenchmarkConfigs[Config].Name, BenchmarkStatNames[Stat], BaselineMean, CurrentMean, 100.0 * Change, "", bChanged ? "  CHANGED" : "");
+		}
+	}
+
+	printf("%u regressions, %u cull stat changes\n", RegressionsCount, ChangesCount);
+	return RegressionsCount + ChangesCount;
+}
+
+// cmd.exe strips the first and the last quote of a command that starts with one, an extra outer pair keeps the quoted exe path intact
+#if defined(_WIN32)
+const char* SystemCommandQuote = "\"";
+#else
+const char* SystemCommandQuote = "";
+#endif
+
+// Runs this executable headless once per scene size, every run writes PREFIX_N.csv. The other arguments are passed along
+int RunBenchmarkSweep(int ArgCount, char** Args, const char* Prefix)
+{
+	const uint32_t ObjectsCounts[] = { 1000, 10000, 100000, 1000000 };
+
+	int ExitCode = 0;
+	for (uint32_t I = 0; I < ArrayCount(ObjectsCounts); I++)
+	{
+		char Command[4096];
+		int Length = snprintf(Command, sizeof(Command), "%s\"%s\" -headless -objects %u -benchmark %s_%u.csv", SystemCommandQuote, Args[0], ObjectsCounts[I], Prefix, ObjectsCounts[I]);
+		for (int Arg = 1; Arg < ArgCount; Arg++)
+		{
+			if ((strcmp(Args[Arg], "-benchmark-sweep") == 0) || (strcmp(Args[Arg], "-objects") == 0) || (strcmp(Args[Arg], "-benchmark") == 0))
+			{
+				Arg++;
+				continue;
+			}
+			if (strcmp(Args[Arg], "-headless") == 0)
+				continue;
+
+			Length += snprintf(Command + Length, sizeof(Command) - Length, " \"%s\"", Args[Arg]);
+		}
+		snprintf(Command + Length, sizeof(Command) - Length, "%s", SystemCommandQuote);
+
+		printf("%s\n", Command);
+		if (system(Command) != 0)
+			ExitCode = 1;
+	}
+
+	return ExitCode;
+}
+
+// Heap allocations of the asset libraries: fast_obj always goes through CountedRealloc, meshoptimizer through CountedAllocate
+// once BenchmarkAssets installs it. Allocations of the engine's own containers aren't counted
+static std::atomic<uint64_t> GlobalAllocationsCount;
+static std::atomic<uint64_t> GlobalAllocatedBytes;
+
+void* CountedRealloc(void* Memory, size_t Size)
+{
+	GlobalAllocationsCount.fetch_add(1, std::memory_order_relaxed);
+	GlobalAllocatedBytes.fetch_add(Size, std::memory_order_relaxed);
+
+	return realloc(Memory, Size);
+}
+
+void CountedFree(void* Memory)
+{
+	free(Memory);
+}
+
+void* CountedAllocate(size_t Size)
+{
+	return CountedRealloc(0, Size);
+}
+
+const uint32_t AssetBenchWarmupRuns = 2;
+const uint32_t AssetBenchRuns = 10;
+
+struct SAssetBenchResult
+{
+	double MinTime;
+	double MeanTime;
+	double Allocations;
+	double AllocatedBytes;
+};
+
+// Stage runs after the warmup are timed one by one, Setup isn't timed and prepares the input of every run
+SAssetBenchResult BenchmarkAssetStage(const std::function<void()>& Setup, const std::function<void()>& Stage)
+{
+	SAssetBenchResult Result = {};
+	Result.MinTime = DBL_MAX;
+
+	for (uint32_t Run = 0; Run < AssetBenchWarmupRuns + AssetBenchRuns; Run++)
+	{
+		Setup();
+
+		uint64_t AllocationsBegin = GlobalAllocationsCount.load();
+		uint64_t AllocatedBytesBegin = GlobalAllocatedBytes.load();
+		uint64_t BeginTicks = GetCpuTicks();
+		Stage();
+		double Time = double(GetCpuTicks() - BeginTicks) * 1e-9;
+
+		if (Run >= AssetBenchWarmupRuns)
+		{
+			Result.MinTime = std::min(Result.MinTime, Time);
+			Result.MeanTime += Time / AssetBenchRuns;
+			Result.Allocations += double(GlobalAllocationsCount.load() - AllocationsBegin) / AssetBenchRuns;
+			Result.AllocatedBytes += double(GlobalAllocatedBytes.load() - AllocatedBytesBegin) / AssetBenchRuns;
+		}
+	}
+
+	return Result;
+}
+
+// Throughput is of the stage input, in triangles or draws and in bytes
+void PrintAssetBenchResult(const char* Mesh, const char* Stage, const SAssetBenchResult& Result, double Items, const char* ItemName, double Bytes)
+{
+	printf("%-16s %-18s %9.3f %9.3f %10.2f M%s/s %9.1f MB/s %10.0f %10.2f MB\n", Mesh, Stage, 1000.0 * Result.MinTime, 1000.0 * Result.MeanTime,
+		   Items / Result.MeanTime * 1e-6, ItemName, Bytes / Result.MeanTime / (1024.0 * 1024.0), Result.Allocations, Result.AllocatedBytes / (1024.0 * 1024.0));
+}
+
+// Unindexed UV sphere with 2 * Segments * Segments triangles, shaped like what ParseObj returns
+std::vector<SVertex> CreateSyntheticMesh(uint32_t Segments)
+{
+	std::vector<SVertex> Vertices;
+	Vertices.reserve(6 * Segments * Segments);
+
+	auto GetVertex = [Segments](uint32_t X, uint32_t Y)
+	{
+		float Theta = glm::pi<float>() * float(Y) / float(Segments);
+		float Phi = 2.0f * glm::pi<float>() * float(X % Segments) / float(Segments);
+
+		SVertex Vertex = {};
+		Vertex.Normal = vec3(sinf(Theta) * cosf(Phi), cosf(Theta), sinf(Theta) * sinf(Phi));
+		Vertex.Position = Vertex.Normal;
+		return Vertex;
+	};
+
+	for (uint32_t Y = 0; Y < Segments; Y++)
+	{
+		for (uint32_t X = 0; X < Segments; X++)
+		{
+			SVertex Quad[] = { GetVertex(X, Y), GetVertex(X + 1, Y), GetVertex(X + 1, Y + 1), GetVertex(X, Y + 1) };
+			Vertices.insert(Vertices.end(), { Quad[0], Quad[1], Quad[2], Quad[0], Quad[2], Quad[3] });
+		}
+	}
+
+	return Vertices;
+}
+
+// Times every LoadMesh stage on the engine meshes and on synthetic spheres, then the scene generation, and prints a table
+void BenchmarkAssets(uint32_t ObjectsCount, bool bSpatialSort)
+{
+	// Set before the first meshoptimizer call, blocks have to be freed by the allocator that made them
+	meshopt_setAllocator(CountedAllocate, CountedFree);
+
+	printf("%-16s %-18s %9s %9s %15s %14s %10s %13s\n", "mesh", "stage", "min ms", "mean ms", "throughput", "bandwidth", "allocs", "allocated");
+
+	const char* Paths[] = { "meshes\\kitten.obj", "meshes\\bunny.obj" };
+	const uint32_t SyntheticSegments[] = { 100, 300 };
+	for (uint32_t MeshIndex = 0; MeshIndex < ArrayCount(Paths) + ArrayCount(SyntheticSegments); MeshIndex++)
+	{
+		char Name[64];
+		std::vector<SVertex> Vertices;
+		if (MeshIndex < ArrayCount(Paths))
+		{
+			const char* Path = Paths[MeshIndex];
+			FILE* File = fopen(Path, "rb");
+			if (!File)
+			{
+				printf("%-16s can't open %s\n", "", Path);
+				continue;
+			}
+			fseek(File, 0, SEEK_END);
+			double FileSize = double(ftell(File));
+			fclose(File);
+
+			const char* FileName = std::max(strrchr(Path, '\\'), strrchr(Path, '/'));
+			snprintf(Name, sizeof(Name), "%s", FileName ? FileName + 1 : Path);
+
+			SAssetBenchResult Result = BenchmarkAssetStage([&]() { Vertices.clear(); Vertices.shrink_to_fit(); }, [&]() { Vertices = ParseObj(Path); });
+			PrintAssetBenchResult(Name, "parse obj", Result, double(Vertices.size() / 3), "tri", FileSize);
+		}
+		else
+		{
+			uint32_t Segments = SyntheticSegments[MeshIndex - ArrayCount(Paths)];
+			Vertices = CreateSyntheticMesh(Segments);
+			snprintf(Name, sizeof(Name), "sphere %uk", 2 * Segments * Segments / 1000);
+		}
+
+		double Triangles = double(Vertices.size() / 3);
+		double VertexBytes = double(Vertices.size() * sizeof(SVertex));
+
+		vec3 SphereCenter;
+		float SphereRadius;
+		SAssetBenchResult Result = BenchmarkAssetStage([]() {}, [&]() { ComputeBoundingSphere(Vertices, SphereCenter, SphereRadius); });
+		PrintAssetBenchResult(Name, "bounds", Result, Triangles, "tri", VertexBytes);
+
+		std::vector<SVertex> UniqueVertices;
+		std::vector<uint32_t> UniqueIndices;
+		Result = BenchmarkAssetStage([&]() { UniqueVertices = std::vector<SVertex>(); UniqueIndices = std::vector<uint32_t>(); },
+									 [&]() { DeduplicateVertices(Vertices, UniqueVertices, UniqueIndices); });
+		PrintAssetBenchResult(Name, "dedup", Result, Triangles, "tri", VertexBytes);
+
+		std::vector<SVertex> OptimizedVertices;
+		std::vector<uint32_t> OptimizedIndices;
+		Result = BenchmarkAssetStage([&]() { OptimizedVertices = UniqueVertices; OptimizedIndices = UniqueIndices; }, [&]() { OptimizeMesh(OptimizedVertices, OptimizedIndices); });
+		PrintAssetBenchResult(Name, "cache/fetch opt", Result, Triangles, "tri", double(UniqueVertices.size() * sizeof(SVertex) + UniqueIndices.size() * sizeof(uint32_t)));
+
+		std::vector<uint32_t> Lods[LodsCount];
+		Result = BenchmarkAssetStage([&]() { for (uint32_t I = 0; I < LodsCount; I++) Lods[I] = std::vector<uint32_t>(); }, [&]() { SimplifyLods(OptimizedVertices, OptimizedIndices, Lods); });
+		PrintAssetBenchResult(Name, "lod simplify", Result, Triangles, "tri", double(OptimizedVertices.size() * sizeof(SVertex) + OptimizedIndices.size() * sizeof(uint32_t)));
+	}
+
+	// Scene generation as in main, rand is reseeded so every run places the same draws
+	const float SceneRadius = 100.0f;
+	std::vector<SMeshDraw> MeshDraws;
+	SAssetBenchResult Result = BenchmarkAssetStage([&]() { MeshDraws = std::vector<SMeshDraw>(); srand(1); },
+												   [&]() { MeshDraws.resize(ObjectsCount); for (uint32_t I = 0; I < ObjectsCount; I++) MeshDraws[I] = CreateRandomMeshDraw(2, SceneRadius); });
+	PrintAssetBenchResult("scene", "mesh draws", Result, double(ObjectsCount), "draw", double(ObjectsCount * sizeof(SMeshDraw)));
+
+	std::vector<SMeshDraw> SortedMeshDraws;
+	Result = BenchmarkAssetStage([&]() { SortedMeshDraws = MeshDraws; }, [&]() { BuildCellGrid(SortedMeshDraws, 64, bSpatialSort); });
+	PrintAssetBenchResult("scene", "cell grid", Result, double(ObjectsCount), "draw", double(ObjectsCount * sizeof(SMeshDraw)));
+}
+
+// Reads the uncompressed 32 bit TGAs that stbi_write_tga writes with stbi_write_tga_with_rle off into RGBA
+bool LoadTga(const char* Path, uint32_t& Width, uint32_t& Height, std::vector<uint8_t>& Pixels)
+{
+	FILE* File = fopen(Path, "rb");
+	if (!File)
+		return false;
+
+	uint8_t Header[18];
+	bool bValid = (fread(Header, 1, sizeof(Header), File) == sizeof(Header)) && (Header[0] == 0) && (Header[1] == 0) && (Header[2] == 2) && (Header[16] == 32);
+	if (bValid)
+	{
+		Width = uint32_t(Header[12]) | (uint32_t(Header[13]) << 8);
+		Height = uint32_t(Header[14]) | (uint32_t(Header[15]) << 8);
+		Pixels.resize(size_t(Width) * Height * 4);
+		bValid = (fread(Pixels.data(), 1, Pixels.size(), File) == Pixels.size());
+	}
+	fclose(File);
+	if (!bValid)
+		return false;
+
+	// Pixels are BGRA, rows go bottom up unless descriptor bit 5 is set
+	size_t Stride = size_t(Width) * 4;
+	bool bTopDown = (Header[17] & 0x20) != 0;
+	for (uint32_t Y = 0; !bTopDown && (Y < Height / 2); Y++)
+		std::swap_ranges(Pixels.begin() + Y * Stride, Pixels.begin() + (Y + 1) * Stride, Pixels.begin() + (Height - 1 - Y) * Stride);
+	for (size_t I = 0; I < size_t(Width) * Height; I++)
+		std::swap(Pixels[4 * I + 0], Pixels[4 * I + 2]);
+
+	return true;
+}
+
+// Frame captures copy the final image into their ring slot's host buffer and are read CaptureRingSize - 1 frames later, so capturing never waits on the GPU
+const uint32_t CaptureRingSize = 3;
+
+struct SCaptureSlot
+{
+	SBuffer Buffer;
+	VkDeviceSize BufferSize;
+	bool bPending;
+	uint32_t Width, Height;
+	VkFormat Format;
+	uint32_t Tag; // Caller data, the golden pose index or the frame
+};
+
+struct SCapture
+{
+	SCaptureSlot Slots[CaptureRingSize];
+};
+
+// Leaves the image in TRANSFER_SRC_OPTIMAL
+void RecordCapture(VkCommandBuffer CommandBuffer, VmaAllocator MemoryAllocator, SCapture& Capture, const SSwapchain& Swapchain, VkFormat Format, uint32_t ImageIndex, uint32_t FrameID, uint32_t Tag)
+{
+	Assert(IsCaptureFormat(Format));
+
+	SCaptureSlot& Slot = Capture.Slots[FrameID % CaptureRingSize];
+	VkDeviceSize Size = VkDeviceSize(Swapchain.Width) * Swapchain.Height * 4;
+	if (Slot.BufferSize < Size)
+	{
+		if (Slot.Buffer.Buffer)
+			vmaDestroyBuffer(MemoryAllocator, Slot.Buffer.Buffer, Slot.Buffer.Allocation);
+		Slot.Buffer = CreateBuffer(MemoryAllocator, Size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
+		Slot.BufferSize = Size;
+	}
+
+	VkImageMemoryBarrier CopyBarrier = CreateImageMemoryBarrier(VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, Swapchain.Images[ImageIndex], VK_IMAGE_ASPECT_COLOR_BIT);
+	vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, 0, 0, 0, 1, &CopyBarrier);
+
+	VkBufferImageCopy Region = {};
+	Region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	Region.imageSubresource.layerCount = 1;
+	Region.imageExtent = { Swapchain.Width, Swapchain.Height, 1 };
+	vkCmdCopyImageToBuffer(CommandBuffer, Swapchain.Images[ImageIndex], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, Slot.Buffer.Buffer, 1, &Region);
+
+	Slot.bPending = true;
+	Slot.Width = Swapchain.Width;
+	Slot.Height = Swapchain.Height;
+	Slot.Format = Format;
+	Slot.Tag = Tag;
+}
+
+// Returns the capture recorded CaptureRingSize - 1 frames ago as RGBA, if there is one
+bool ReadCapture(SCapture& Capture, uint32_t FrameID, std::vector<uint8_t>& Pixels, uint32_t& Width, uint32_t& Height, uint32_t& Tag)
+{
+	if (FrameID + 1 < CaptureRingSize)
+		return false;
+
+	SCaptureSlot& Slot = Capture.Slots[(FrameID + 1) % CaptureRingSize];
+	if (!Slot.bPending)
+		return false;
+	Slot.bPending = false;
+
+	Width = Slot.Width;
+	Height = Slot.Height;
+	Tag = Slot.Tag;
+
+	bool bBGRA = (Slot.Format == VK_FORMAT_B8G8R8A8_UNORM) || (Slot.Format == VK_FORMAT_B8G8R8A8_SRGB);
+	const uint8_t* Source = (const uint8_t*)Slot.Buffer.Data;
+	Pixels.resize(size_t(Width) * Height * 4);
+	for (size_t I = 0; I < size_t(Width) * Height; I++)
+	{
+		Pixels[4 * I + 0] = Source[4 * I + (bBGRA ? 2 : 0)];
+		Pixels[4 * I + 1] = Source[4 * I + 1];
+		Pixels[4 * I + 2] = Source[4 * I + (bBGRA ? 0 : 2)];
+		Pixels[4 * I + 3] = 255;
+	}
+
+	return true;
+}
+
+// Fixed camera poses for golden images, taken from the benchmark path. Every pose renders GoldenFramesPerPose frames
+// so the visibility of the two phase occlusion culling settles before the last one is captured
+const uint32_t GoldenPosesCount = 8;
+const uint32_t GoldenFramesPerPose = 8;
+
+struct SGolden
+{
+	const char* Directory;
+	std::vector<SCameraKey> Path;
+	bool bCompare;
+	uint32_t Tolerance;
+	uint32_t FailedPosesCount;
+};
+
+uint32_t GetGoldenFramesCount()
+{
+	return GoldenPosesCount * GoldenFramesPerPose + CaptureRingSize - 1;
+}
+
+// Writes the capture as the golden image of its pose, or compares it against it and writes a diff image with differing pixels in red
+void ProcessGoldenCapture(SGolden& Golden, const std::vector<uint8_t>& Pixels, uint32_t Width, uint32_t Height, uint32_t Pose)
+{
+	char Path[512];
+	snprintf(Path, sizeof(Path), "%s/pose_%u.tga", Golden.Directory, Pose);
+	if (!Golden.bCompare)
+	{
+		stbi_write_tga_with_rle = 0;
+		stbi_write_tga(Path, Width, Height, 4, Pixels.data());
+		printf("Golden image written to %s\n", Path);
+		return;
+	}
+
+	uint32_t GoldenWidth = 0, GoldenHeight = 0;
+	std::vector<uint8_t> GoldenPixels;
+	if (!LoadTga(Path, GoldenWidth, GoldenHeight, GoldenPixels))
+	{
+		printf("pose %u: can't read %s\n", Pose, Path);
+		Golden.FailedPosesCount++;
+		return;
+	}
+	if ((GoldenWidth != Width) || (GoldenHeight != Height))
+	{
+		printf("pose %u: golden image is %ux%u, the capture is %ux%u\n", Pose, GoldenWidth, GoldenHeight, Width, Height);
+		Golden.FailedPosesCount++;
+		return;
+	}
+
+	uint32_t DifferentCount = 0;
+	uint32_t MaxDifference = 0;
+	std::vector<uint8_t> Diff(Pixels.size());
+	for (size_t I = 0; I < size_t(Width) * Height; I++)
+	{
+		uint32_t Difference = 0;
+		for (uint32_t Channel = 0; Channel < 3; Channel++)
+			Difference = std::max(Difference, uint32_t(abs(int(Pixels[4 * I + Channel]) - int(GoldenPixels[4 * I + Channel]))));
+		MaxDifference = std::max(MaxDifference, Difference);
+
+		uint8_t Gray = uint8_t((GoldenPixels[4 * I + 0] + GoldenPixels[4 * I + 1] + GoldenPixels[4 * I + 2]) / 12);
+		bool bDifferent = Difference > Golden.Tolerance;
+		DifferentCount += bDifferent ? 1 : 0;
+		Diff[4 * I + 0] = bDifferent ? 255 : Gray;
+		Diff[4 * I + 1] = bDifferent ? 0 : Gray;
+		Diff[4 * I + 2] = bDifferent ? 0 : Gray;
+		Diff[4 * I + 3] = 255;
+	}
+
+	printf("pose %u: %u pixels differ (%.3f%%), max difference %u\n", Pose, DifferentCount, 100.0 * double(DifferentCount) / double(Width * Height), MaxDifference);
+	if (DifferentCount > 0)
+	{
+		snprintf(Path, sizeof(Path), "%s/pose_%u_diff.png", Golden.Directory, Pose);
+		stbi_write_png(Path, Width, Height, 4, Diff.data(), Width * 4);
+		Golden.FailedPosesCount++;
+	}
+}
+
+struct SOptions
+{
+	uint32_t ObjectsCount;
+	bool bBenchCompaction;
+	bool bQuantizeDraws;
+	bool bSpatialSort;
+	uint32_t MovingCount;
+	uint32_t ChurnCount;
+	bool bAnimate;
+	uint32_t PlatformsCount;
+	bool bCpuCulling;
+	bool bValidateCulling;
+	const char* OcclusionStatsPath;
+	float OcclusionBias;
+	bool bCullStats;
+	const char* TracePath;
+	uint32_t TraceFramesCount;
+	bool bHeadless;
+	bool bValidation;
+	uint32_t FramesCount; // 0 runs until the window is closed
+	uint32_t Width;
+	uint32_t Height;
+	const char* BenchmarkPath;
+	uint32_t BenchmarkFramesPerConfig;
+	const char* BenchmarkSweepPrefix;
+	const char* CameraPath;
+	uint32_t Seed;
+	const char* CompareBaselinePath;
+	const char* CompareCurrentPath;
+	const char* GoldenDirectory;
+	bool bGoldenCompare;
+	uint32_t GoldenTolerance;
+	const char* RecordPath;
+	const char* ReplayPath;
+	bool bReplayFixedTimeStep;
+	bool bBenchAssets;
+	bool bBenchKernels;
+	bool bRetuneKernels;
+	bool bPipelineCache;
+};
+
+SOptions ParseOptions(int ArgCount, char** Args)
+{
+	SOptions Options = {};
+	Options.ObjectsCount = 100000;
+	Options.bSpatialSort = true;
+	Options.OcclusionBias = 0.0001f;
+	Options.bCullStats = true;
+	Options.TraceFramesCount = 100;
+	Options.bValidation = true;
+	Options.Width = 1024;
+	Options.Height = 720;
+	Options.BenchmarkFramesPerConfig = 600;
+	Options.Seed = 1;
+	Options.bPipelineCache = true;
+	Options.GoldenTolerance = 2;
+
+	for (int I = 1; I < ArgCount; I++)
+	{
+		if ((strcmp(Args[I], "-objects") == 0) && (I + 1 < ArgCount))
+		{
+			Options.ObjectsCount = (uint32_t)atoi(Args[++I]);
+		}
+		else if (strcmp(Args[I], "-bench-compaction") == 0)
+		{
+			Options.bBenchCompaction = true;
+		}
+		else if (strcmp(Args[I], "-quantize") == 0)
+		{
+			Options.bQuantizeDraws = true;
+		}
+		else if (strcmp(Args[I], "-no-spatial-sort") == 0)
+		{
+			Options.bSpatialSort = false;
+		}
+		else if ((strcmp(Args[I], "-move") == 0) && (I + 1 < ArgCount))
+		{
+			Options.MovingCount = (uint32_t)atoi(Args[++I]);
+		}
+		else if ((strcmp(Args[I], "-churn") == 0) && (I + 1 < ArgCount))
+		{
+			Options.ChurnCount = (uint32_t)atoi(Args[++I]);
+		}
+		else if (strcmp(Args[I], "-animate") == 0)
+		{
+			Options.bAnimate = true;
+		}
+		else if ((strcmp(Args[I], "-platforms") == 0) && (I + 1 < ArgCount))
+		{
+			Options.PlatformsCount = (uint32_t)atoi(Args[++I]);
+		}
+		else if (strcmp(Args[I], "-cpu-culling") == 0)
+		{
+			Options.bCpuCulling = true;
+		}
+		else if (strcmp(Args[I], "-validate-culling") == 0)
+		{
+			Options.bValidateCulling = true;
+		}
+		else if ((strcmp(Args[I], "-occlusion-stats") == 0) && (I + 1 < ArgCount))
+		{
+			Options.OcclusionStatsPath = Args[++I];
+		}
+		else if ((strcmp(Args[I], "-occlusion-bias") == 0) && (I + 1 < ArgCount))
+		{
+			Options.OcclusionBias = (float)atof(Args[++I]);
+		}
+		else if (strcmp(Args[I], "-no-cull-stats") == 0)
+		{
+			Options.bCullStats = false;
+		}
+		else if ((strcmp(Args[I], "-trace") == 0) && (I + 1 < ArgCount))
+		{
+			Options.TracePath = Args[++I];
+		}
+		else if ((strcmp(Args[I], "-trace-frames") == 0) && (I + 1 < ArgCount))
+		{
+			Options.TraceFramesCount = std::max(atoi(Args[++I]), 1);
+		}
+		else if (strcmp(Args[I], "-headless") == 0)
+		{
+			Options.bHeadless = true;
+		}
+		else if (strcmp(Args[I], "-no-validation") == 0)
+		{
+			Options.bValidation = false;
+		}
+		else if ((strcmp(Args[I], "-frames") == 0) && (I + 1 < ArgCount))
+		{
+			Options.FramesCount = (uint32_t)std::max(atoi(Args[++I]), 0);
+		}
+		else if ((strcmp(Args[I], "-resolution") == 0) && (I + 2 < ArgCount))
+		{
+			Options.Width = (uint32_t)std::max(atoi(Args[++I]), 2);
+			Options.Height = (uint32_t)std::max(atoi(Args[++I]), 2);
+		}
+		else if ((strcmp(Args[I], "-benchmark") == 0) && (I + 1 < ArgCount))
+		{
+			Options.BenchmarkPath = Args[++I];
+		}
+		else if ((strcmp(Args[I], "-benchmark-frames") == 0) && (I + 1 < ArgCount))
+		{
+			Options.BenchmarkFramesPerConfig = (uint32_t)std::max(atoi(Args[++I]), 1);
+		}
+		else if ((strcmp(Args[I], "-benchmark-sweep") == 0) && (I + 1 < ArgCount))
+		{
+			Options.BenchmarkSweepPrefix = Args[++I];
+		}
+		else if ((strcmp(Args[I], "-camera-path") == 0) && (I + 1 < ArgCount))
+		{
+			Options.CameraPath = Args[++I];
+		}
+		else if ((strcmp(Args[I], "-seed") == 0) && (I + 1 < ArgCount))
+		{
+			Options.Seed = (uint32_t)atoi(Args[++I]);
+		}
+		else if ((strcmp(Args[I], "-compare") == 0) && (I + 2 < ArgCount))
+		{
+			Options.CompareBaselinePath = Args[++I];
+			Options.CompareCurrentPath = Args[++I];
+		}
+		else if ((strcmp(Args[I], "-golden") == 0) && (I + 1 < ArgCount))
+		{
+			Options.GoldenDirectory = Args[++I];
+			Options.bGoldenCompare = false;
+		}
+		else if ((strcmp(Args[I], "-golden-compare") == 0) && (I + 1 < ArgCount))
+		{
+			Options.GoldenDirectory = Args[++I];
+			Options.bGoldenCompare = true;
+		}
+		else if ((strcmp(Args[I], "-golden-tolerance") == 0) && (I + 1 < ArgCount))
+		{
+			Options.GoldenTolerance = (uint32_t)std::max(atoi(Args[++I]), 0);
+		}
+		else if ((strcmp(Args[I], "-record") == 0) && (I + 1 < ArgCount))
+		{
+			Options.RecordPath = Args[++I];
+		}
+		else if ((strcmp(Args[I], "-replay") == 0) && (I + 1 < ArgCount))
+		{
+			Options.ReplayPath = Args[++I];
+		}
+		else if (strcmp(Args[I], "-replay-fixed-step") == 0)
+		{
+			Options.bReplayFixedTimeStep = true;
+		}
+		else if (strcmp(Args[I], "-bench-assets") == 0)
+		{
+			Options.bBenchAssets = true;
+		}
+		else if (strcmp(Args[I], "-bench-kernels") == 0)
+		{
+			Options.bBenchKernels = true;
+		}
+		else if (strcmp(Args[I], "-retune") == 0)
+		{
+			Options.bRetuneKernels = true;
+		}
+		else if (strcmp(Args[I], "-no-pipeline-cache") == 0)
+		{
+			Options.bPipelineCache = false;
+		}
+		else
+		{
+			printf("Unknown option: %s\n", Args[I]);
+			printf("Usage: Cringengine [-objects N] [-bench-compaction] [-quantize] [-no-spatial-sort] [-move N] [-churn N] [-animate] [-platforms N] [-cpu-culling] [-validate-culling] [-occlusion-stats FILE] [-occlusion-bias X] [-no-cull-stats] [-trace FILE] [-trace-frames N] [-headless] [-no-validation] [-frames N] [-resolution W H] [-benchmark FILE] [-benchmark-frames N] [-benchmark-sweep PREFIX] [-camera-path FILE] [-seed N] [-compare BASELINE CURRENT] [-golden DIR] [-golden-compare DIR] [-golden-tolerance N] [-record FILE] [-replay FILE] [-replay-fixed-step] [-bench-assets] [-bench-kernels] [-retune] [-no-pipeline-cache]\n");
+		}
+	}
 
-	VkPipeline ComputePipeline = 0;
-	VkCheck(vkCreateComputePipelines(Device, 0, 1, &CreateInfo, 0, &ComputePipeline));
-	Assert(ComputePipeline);
+	// Headless runs have no window to close, so they always end after a fixed number of frames and skip validation
+	if (Options.bHeadless)
+	{
+		Options.bValidation = false;
+		if (Options.FramesCount == 0)
+			Options.FramesCount = 1000;
+	}
 
-	return ComputePipeline;
+	return Options;
 }
 
 static bool bGlobalCullingEnabled = true;
 static bool bGlobalLodsEnabled = true;
 static bool bGlobalOcclusionCullingEnabled = true;
+static bool bGlobalDepthSortEnabled = true;
+static bool bGlobalCpuCullingEnabled = false;
+static bool bGlobalPrintGpuProfile = false;
+static bool bGlobalCaptureTrace = false;
+static bool bGlobalRecordCameraKey = false;
+static bool bGlobalCaptureFrame = false;
 void GLFWKeyCallback(GLFWwindow* Window, int Key, int Scancode, int Action, int Mods)
 {
 	if (Key == GLFW_KEY_C)
@@ -1130,6 +4912,53 @@ void GLFWKeyCallback(GLFWwindow* Window, int Key, int Scancode, int Action, int
 			bGlobalOcclusionCullingEnabled = true;
 		}
 	}
+	else if (Key == GLFW_KEY_F)
+	{
+		if (Action == GLFW_PRESS)
+		{
+			bGlobalDepthSortEnabled = false;
+		}
+		else if (Action == GLFW_RELEASE)
+		{
+			bGlobalDepthSortEnabled = true;
+		}
+	}
+	else if (Key == GLFW_KEY_G)
+	{
+		// Switching the culling backend is a toggle, not a hold
+		if (Action == GLFW_PRESS)
+		{
+			bGlobalCpuCullingEnabled = !bGlobalCpuCullingEnabled;
+		}
+	}
+	else if (Key == GLFW_KEY_P)
+	{
+		if (Action == GLFW_PRESS)
+		{
+			bGlobalPrintGpuProfile = true;
+		}
+	}
+	else if (Key == GLFW_KEY_T)
+	{
+		if (Action == GLFW_PRESS)
+		{
+			bGlobalCaptureTrace = true;
+		}
+	}
+	else if (Key == GLFW_KEY_K)
+	{
+		if (Action == GLFW_PRESS)
+		{
+			bGlobalRecordCameraKey = true;
+		}
+	}
+	else if (Key == GLFW_KEY_I)
+	{
+		if (Action == GLFW_PRESS)
+		{
+			bGlobalCaptureFrame = true;
+		}
+	}
 }
 
 static float GlobalCameraPitch = 0.0f;
@@ -1151,21 +4980,185 @@ void GLFWCursorPositionCallback(GLFWwindow* Window, double XPos, double YPos)
 	LastY = YPos;
 }
 
-int main()
+// Input recordings are a header and one SInputFrame per frame. Replays drive the main loop from them instead of GLFW
+const uint32_t InputFileMagic = 0x504E4943; // "CINP"
+const uint32_t InputFileVersion = 2;
+
+const uint32_t InputFlagCulling = 1 << 0;
+const uint32_t InputFlagLods = 1 << 1;
+const uint32_t InputFlagOcclusionCulling = 1 << 2;
+const uint32_t InputFlagDepthSort = 1 << 3;
+const uint32_t InputFlagCpuCulling = 1 << 4;
+const uint32_t InputFlagPrintGpuProfile = 1 << 5;
+const uint32_t InputFlagCaptureTrace = 1 << 6;
+const uint32_t InputFlagCaptureFrame = 1 << 7;
+
+// Scene options of the recorded run, so a replay builds and updates the same scene whatever is on its command line
+const uint32_t InputSceneFlagAnimate = 1 << 0;
+const uint32_t InputSceneFlagQuantizeDraws = 1 << 1;
+const uint32_t InputSceneFlagSpatialSort = 1 << 2;
+
+struct SInputFileHeader
+{
+	uint32_t Magic;
+	uint32_t Version;
+	uint32_t Seed;
+	uint32_t ObjectsCount;
+	uint32_t MovingCount;
+	uint32_t ChurnCount;
+	uint32_t PlatformsCount;
+	uint32_t SceneFlags;
+};
+
+// 36 bytes per frame
+struct SInputFrame
+{
+	float Time;
+	float DeltaTime;
+	float CameraPitch, CameraHead;
+	float CameraPosition[3];
+	uint16_t Width, Height;
+	uint32_t Flags;
+};
+
+FILE* BeginInputRecording(const char* Path, const SOptions& Options)
+{
+	FILE* File = fopen(Path, "wb");
+	Assert(File);
+
+	SInputFileHeader Header = { InputFileMagic, InputFileVersion, Options.Seed, Options.ObjectsCount, Options.MovingCount, Options.ChurnCount, Options.PlatformsCount };
+	Header.SceneFlags |= Options.bAnimate ? InputSceneFlagAnimate : 0;
+	Header.SceneFlags |= Options.bQuantizeDraws ? InputSceneFlagQuantizeDraws : 0;
+	Header.SceneFlags |= Options.bSpatialSort ? InputSceneFlagSpatialSort : 0;
+	fwrite(&Header, sizeof(Header), 1, File);
+
+	return File;
+}
+
+bool LoadInputRecording(const char* Path, SInputFileHeader& Header, std::vector<SInputFrame>& Frames)
+{
+	FILE* File = fopen(Path, "rb");
+	if (!File)
+		return false;
+
+	bool bValid = (fread(&Header, sizeof(Header), 1, File) == 1) && (Header.Magic == InputFileMagic) && (Header.Version == InputFileVersion);
+
+	SInputFrame Frame;
+	while (bValid && (fread(&Frame, sizeof(Frame), 1, File) == 1))
+		Frames.push_back(Frame);
+	fclose(File);
+
+	return bValid && !Frames.empty();
+}
+
+// The window size, camera and toggles as they are after polling the events of this frame
+SInputFrame GetInputFrame(vec3 CameraPosition, uint32_t Width, uint32_t Height)
+{
+	SInputFrame Frame = {};
+	Frame.CameraPitch = GlobalCameraPitch;
+	Frame.CameraHead = GlobalCameraHead;
+	Frame.CameraPosition[0] = CameraPosition.x;
+	Frame.CameraPosition[1] = CameraPosition.y;
+	Frame.CameraPosition[2] = CameraPosition.z;
+	Frame.Width = uint16_t(Width);
+	Frame.Height = uint16_t(Height);
+	Frame.Flags = (bGlobalCullingEnabled ? InputFlagCulling : 0) |
+				  (bGlobalLodsEnabled ? InputFlagLods : 0) |
+				  (bGlobalOcclusionCullingEnabled ? InputFlagOcclusionCulling : 0) |
+				  (bGlobalDepthSortEnabled ? InputFlagDepthSort : 0) |
+				  (bGlobalCpuCullingEnabled ? InputFlagCpuCulling : 0) |
+				  (bGlobalPrintGpuProfile ? InputFlagPrintGpuProfile : 0) |
+				  (bGlobalCaptureTrace ? InputFlagCaptureTrace : 0) |
+				  (bGlobalCaptureFrame ? InputFlagCaptureFrame : 0);
+
+	return Frame;
+}
+
+void ApplyInputFrame(const SInputFrame& Frame, vec3& CameraPosition)
+{
+	GlobalCameraPitch = Frame.CameraPitch;
+	GlobalCameraHead = Frame.CameraHead;
+	CameraPosition = vec3(Frame.CameraPosition[0], Frame.CameraPosition[1], Frame.CameraPosition[2]);
+	bGlobalCullingEnabled = (Frame.Flags & InputFlagCulling) != 0;
+	bGlobalLodsEnabled = (Frame.Flags & InputFlagLods) != 0;
+	bGlobalOcclusionCullingEnabled = (Frame.Flags & InputFlagOcclusionCulling) != 0;
+	bGlobalDepthSortEnabled = (Frame.Flags & InputFlagDepthSort) != 0;
+	bGlobalCpuCullingEnabled = (Frame.Flags & InputFlagCpuCulling) != 0;
+	bGlobalPrintGpuProfile = (Frame.Flags & InputFlagPrintGpuProfile) != 0;
+	bGlobalCaptureTrace = (Frame.Flags & InputFlagCaptureTrace) != 0;
+	bGlobalCaptureFrame = (Frame.Flags & InputFlagCaptureFrame) != 0;
+}
+
+int main(int ArgCount, char** Args)
 {
-	if (glfwInit())
+	SOptions Options = ParseOptions(ArgCount, Args);
+	int ExitCode = 0;
+
+	// Tool modes that don't render themselves
+	if (Options.CompareBaselinePath)
+		return (CompareBenchmarks(Options.CompareBaselinePath, Options.CompareCurrentPath) == 0) ? 0 : 1;
+	if (Options.BenchmarkSweepPrefix)
+		return RunBenchmarkSweep(ArgCount, Args, Options.BenchmarkSweepPrefix);
+
+	// Replays rebuild the recorded scene with the recorded scene options and size and run exactly the recorded frames
+	SInputFileHeader ReplayHeader = {};
+	std::vector<SInputFrame> ReplayFrames;
+	if (Options.ReplayPath)
 	{
-		glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-		GLFWwindow* Window = glfwCreateWindow(1024, 720, "Cringengine", 0, 0);
-		if (Window)
+		if (!LoadInputRecording(Options.ReplayPath, ReplayHeader, ReplayFrames))
 		{
-			glfwSetInputMode(Window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+			printf("Can't read input recording %s\n", Options.ReplayPath);
+			return 1;
+		}
+
+		Options.Seed = ReplayHeader.Seed;
+		Options.ObjectsCount = ReplayHeader.ObjectsCount;
+		Options.MovingCount = ReplayHeader.MovingCount;
+		Options.ChurnCount = ReplayHeader.ChurnCount;
+		Options.PlatformsCount = ReplayHeader.PlatformsCount;
+		Options.bAnimate = (ReplayHeader.SceneFlags & InputSceneFlagAnimate) != 0;
+		Options.bQuantizeDraws = (ReplayHeader.SceneFlags & InputSceneFlagQuantizeDraws) != 0;
+		Options.bSpatialSort = (ReplayHeader.SceneFlags & InputSceneFlagSpatialSort) != 0;
+		Options.Width = ReplayFrames[0].Width;
+		Options.Height = ReplayFrames[0].Height;
+		Options.FramesCount = (uint32_t)ReplayFrames.size();
+	}
+
+	srand(Options.Seed);
+
+	if (Options.bBenchAssets)
+	{
+		BenchmarkAssets(Options.ObjectsCount, Options.bSpatialSort);
+		return 0;
+	}
+
+	// -trace captures from startup, so asset loading is in it too
+	SetCpuThreadName("Main");
+	const char* TracePath = Options.TracePath ? Options.TracePath : "trace.json";
+	if (Options.TracePath)
+		BeginCpuCapture(0, Options.TraceFramesCount);
 
-			glfwSetKeyCallback(Window, GLFWKeyCallback);
-			glfwSetCursorPosCallback(Window, GLFWCursorPositionCallback);
+	// Headless runs don't touch GLFW at all, so they work on machines without a display
+	if (Options.bHeadless || glfwInit())
+	{
+		GLFWwindow* Window = 0;
+		if (!Options.bHeadless)
+		{
+			glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+			Window = glfwCreateWindow(Options.Width, Options.Height, "Cringengine", 0, 0);
+		}
+		if (Options.bHeadless || Window)
+		{
+			if (Window)
+			{
+				glfwSetInputMode(Window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+
+				glfwSetKeyCallback(Window, GLFWKeyCallback);
+				glfwSetCursorPosCallback(Window, GLFWCursorPositionCallback);
+			}
 
-			VkInstance Instance = CreateInstance();
-			VkPhysicalDevice PhysicalDevice = PickPhysicalDevice(Instance);
+			VkInstance Instance = CreateInstance(Options.bHeadless, Options.bValidation);
+			VkPhysicalDevice PhysicalDevice = PickPhysicalDevice(Instance, Options.bHeadless);
 
 			VkPhysicalDeviceProperties PhysicalDeviceProps = {};
 			vkGetPhysicalDeviceProperties(PhysicalDevice, &PhysicalDeviceProps);
@@ -1173,21 +5166,29 @@ int main()
 			uint32_t GraphicsFamilyIndex = GetGraphicsFamilyIndex(PhysicalDevice);
 			Assert(GraphicsFamilyIndex != VK_QUEUE_FAMILY_IGNORED);
 
-			VkDevice Device = CreateDevice(PhysicalDevice, GraphicsFamilyIndex);
+			bool bPipelineStatistics = SupportsPipelineStatistics(PhysicalDevice);
+			VkDevice Device = CreateDevice(PhysicalDevice, GraphicsFamilyIndex, Options.bHeadless, bPipelineStatistics);
+			bool bSubgroupCompaction = SupportsSubgroupCompaction(PhysicalDevice);
 
-			VkSurfaceKHR Surface = CreateSurface(Instance, Window);
-			Assert(SurfaceSupportsPresentation(PhysicalDevice, GraphicsFamilyIndex, Surface));
+			VkSurfaceKHR Surface = 0;
+			if (Window)
+			{
+				Surface = CreateSurface(Instance, Window);
+				Assert(SurfaceSupportsPresentation(PhysicalDevice, GraphicsFamilyIndex, Surface));
+			}
 
 			VkQueue GraphicsQueue = 0;
 			vkGetDeviceQueue(Device, GraphicsFamilyIndex, 0, &GraphicsQueue);
 
-			VkFormat SwapchainFormat = GetSwapchainFormat(PhysicalDevice, Surface);
+			VkFormat SwapchainFormat = Window ? GetSwapchainFormat(PhysicalDevice, Surface) : VK_FORMAT_R8G8B8A8_UNORM;
 			VkFormat DepthFormat = FindDepthFormat(PhysicalDevice);
 
 			VkRenderPass RenderPass = CreateRenderPass(Device, SwapchainFormat, DepthFormat);
+			VkRenderPass LateRenderPass = CreateRenderPass(Device, SwapchainFormat, DepthFormat, true);
 
 			VmaAllocator MemoryAllocator = CreateVulkanMemoryAllocator(Instance, PhysicalDevice, Device);
-			SSwapchain Swapchain = CreateSwapchain(Device, PhysicalDevice, Surface, SwapchainFormat, DepthFormat, RenderPass, MemoryAllocator);
+			SSwapchain Swapchain = Window ? CreateSwapchain(Device, PhysicalDevice, Surface, SwapchainFormat, DepthFormat, RenderPass, MemoryAllocator) :
+											CreateOffscreenSwapchain(Device, SwapchainFormat, DepthFormat, RenderPass, MemoryAllocator, Options.Width, Options.Height);
 
 			VkCommandPool CommandPool = CreateCommandPool(Device, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT, GraphicsFamilyIndex);
 
@@ -1197,16 +5198,54 @@ int main()
 			VkSemaphore AcquireSemaphore = CreateSemaphore(Device);
 			VkSemaphore ReleaseSemaphore = CreateSemaphore(Device);
 
-			VkQueryPool QueryPool = CreateQueryPool(Device);
+			SGpuProfiler GpuProfiler = CreateGpuProfiler(Device, PhysicalDeviceProps, bPipelineStatistics);
 
 			SBuffer StagingBuffer = CreateBuffer(MemoryAllocator, 64 * 1024 * 1024, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
 			SBuffer VertexBuffer = CreateBuffer(MemoryAllocator, 64 * 1024 * 1024, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
 			SBuffer IndexBuffer = CreateBuffer(MemoryAllocator, 64 * 1024 * 1024, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
 			SBuffer MeshDrawBuffer = CreateBuffer(MemoryAllocator, 64 * 1024 * 1024, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
-			SBuffer IndirectBuffer = CreateBuffer(MemoryAllocator, 64 * 1024 * 1024, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
-			SBuffer CountBuffer = CreateBuffer(MemoryAllocator, sizeof(uint32_t), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
 
-			VkShaderModule CS = LoadShader(Device, "shaders_bytecode\\cull.comp.spv");
+			SCulling Culling = {};
+			// Early and late pass instanced commands, one per (mesh, LOD) bucket
+			Culling.IndirectBuffer = CreateBuffer(MemoryAllocator, 1024 * 1024, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+			// Early and late pass visible draw counts, then early and late pass command counts
+			Culling.CountBuffer = CreateBuffer(MemoryAllocator, 4 * sizeof(uint32_t), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+			Culling.VisibilityBuffer = CreateBuffer(MemoryAllocator, 4 * 1024 * 1024, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+			Culling.CellBuffer = CreateBuffer(MemoryAllocator, 16 * 1024 * 1024, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+			Culling.VisibleCellBuffer = CreateBuffer(MemoryAllocator, 4 * 1024 * 1024, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+			Culling.CellDispatchBuffer = CreateBuffer(MemoryAllocator, CellDispatchBufferSize, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+			Culling.MeshBuffer = CreateBuffer(MemoryAllocator, 1024 * 1024, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+			Culling.VisibleDrawBuffer = CreateBuffer(MemoryAllocator, 32 * 1024 * 1024, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+			Culling.BucketBuffer = CreateBuffer(MemoryAllocator, 64 * 1024, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+			Culling.InstanceBuffer = CreateBuffer(MemoryAllocator, 16 * 1024 * 1024, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+			Culling.ScatterDispatchBuffer = CreateBuffer(MemoryAllocator, 2 * sizeof(VkDispatchIndirectCommand), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+			// Written by the CPU every frame, one frame in flight so a single buffer is enough
+			Culling.DrawUpdateBuffer = CreateBuffer(MemoryAllocator, DrawUpdateBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+			// Only the animation pass reads motions, without it the buffer just keeps the descriptor valid
+			Culling.MotionBuffer = CreateBuffer(MemoryAllocator, Options.bAnimate ? 96 * 1024 * 1024 : sizeof(SMotion), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+			// Local node transforms are written by the CPU in place, world transforms live only on the GPU
+			Culling.NodeBuffer = CreateBuffer(MemoryAllocator, 16 * 1024 * 1024, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+			Culling.NodeWorldBuffer = CreateBuffer(MemoryAllocator, 16 * 1024 * 1024, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+			Culling.CullStatsBuffer = CreateBuffer(MemoryAllocator, sizeof(SCullStats), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+			Culling.CullStatsReadbackBuffer = CreateBuffer(MemoryAllocator, CullStatsRingSize * sizeof(SCullStats), VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
+
+			// CPU culling writes its commands and instances in place, sizes match the GPU path so both can be drawn with the same limits
+			SCpuCulling CpuCulling;
+			CpuCulling.IndirectBuffer = CreateBuffer(MemoryAllocator, 1024 * 1024, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+			CpuCulling.CountBuffer = CreateBuffer(MemoryAllocator, 4 * sizeof(uint32_t), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+			CpuCulling.InstanceBuffer = CreateBuffer(MemoryAllocator, 16 * 1024 * 1024, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+			CreateWorkerPool(CpuCulling.Workers, glm::clamp(std::thread::hardware_concurrency(), 1u, 16u));
+
+			GlobalPipelineCache = CreatePipelineCache(Device, PhysicalDeviceProps, Options.bPipelineCache ? PipelineCachePath : 0);
+			uint64_t PipelineBatchTicks = 0;
+
+			VkShaderModule CellCullCS = LoadShader(Device, "shaders_bytecode\\cellcull.comp.spv");
+			VkShaderModule CellRefitCS = LoadShader(Device, "shaders_bytecode\\cellrefit.comp.spv");
+			VkShaderModule DrawUpdateCS = LoadShader(Device, "shaders_bytecode\\drawupdate.comp.spv");
+			VkShaderModule AnimateCS = LoadShader(Device, "shaders_bytecode\\animate.comp.spv");
+			VkShaderModule HierarchyCS = LoadShader(Device, "shaders_bytecode\\hierarchy.comp.spv");
+			VkShaderModule BucketPrefixCS = LoadShader(Device, "shaders_bytecode\\bucketprefix.comp.spv");
+			VkShaderModule BucketScatterCS = LoadShader(Device, "shaders_bytecode\\bucketscatter.comp.spv");
 			VkShaderModule DownscaleCS = LoadShader(Device, "shaders_bytecode\\downscale.comp.spv");
 			VkShaderModule VS = LoadShader(Device, "shaders_bytecode\\default.vert.spv");
 			VkShaderModule FS = LoadShader(Device, "shaders_bytecode\\default.frag.spv");
@@ -1224,27 +5263,70 @@ int main()
 			UpdateDescriptorSetBuffer(Device, CameraDescriptorSet, 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, CameraDescriptorSetBindingBuffer, sizeof(SCameraBuffer));
 
 			VkDescriptorSetLayoutBinding MeshDrawDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT);
-			VkDescriptorSetLayout MeshDrawDescriptorSetLayout = CreateDescriptorSetLayout(Device, 1, &MeshDrawDescriptorSetLayoutBinding);
+			VkDescriptorSetLayoutBinding InstanceDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT);
+			VkDescriptorSetLayoutBinding MeshDrawDescriptorSetLayoutBindings[] = { MeshDrawDescriptorSetLayoutBinding, InstanceDescriptorSetLayoutBinding };
+			VkDescriptorSetLayout MeshDrawDescriptorSetLayout = CreateDescriptorSetLayout(Device, ArrayCount(MeshDrawDescriptorSetLayoutBindings), MeshDrawDescriptorSetLayoutBindings);
 
 			VkDescriptorSet MeshDrawDescriptorSet = CreateDescriptorSet(Device, DescriptorPool, MeshDrawDescriptorSetLayout);
 			UpdateDescriptorSetBuffer(Device, MeshDrawDescriptorSet, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, MeshDrawBuffer, MeshDrawBuffer.Allocation->GetSize());
+			UpdateDescriptorSetBuffer(Device, MeshDrawDescriptorSet, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, Culling.InstanceBuffer, Culling.InstanceBuffer.Allocation->GetSize());
+
+			VkDescriptorSet CpuMeshDrawDescriptorSet = CreateDescriptorSet(Device, DescriptorPool, MeshDrawDescriptorSetLayout);
+			UpdateDescriptorSetBuffer(Device, CpuMeshDrawDescriptorSet, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, MeshDrawBuffer, MeshDrawBuffer.Allocation->GetSize());
+			UpdateDescriptorSetBuffer(Device, CpuMeshDrawDescriptorSet, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, CpuCulling.InstanceBuffer, CpuCulling.InstanceBuffer.Allocation->GetSize());
 
 			VkDescriptorSetLayout DescriptorSetLayouts[] = { CameraDescriptorSetLayout, MeshDrawDescriptorSetLayout };
 			VkPipelineLayout PipelineLayout = CreatePipelineLayout(Device, ArrayCount(DescriptorSetLayouts), DescriptorSetLayouts);
-			VkPipeline GraphicsPipeline = CreateGraphicsPipeline(Device, RenderPass, PipelineLayout, VS, FS);
+
+			// Shaders that read MeshDraws pick their layout with constant_id 0
+			VkBool32 bQuantizedDraws = Options.bQuantizeDraws ? VK_TRUE : VK_FALSE;
+			VkSpecializationMapEntry QuantizedDrawsMapEntry = { 0, 0, sizeof(VkBool32) };
+			VkSpecializationInfo DrawLayoutSpecialization = { 1, &QuantizedDrawsMapEntry, sizeof(VkBool32), &bQuantizedDraws };
+
+			VkPipeline GraphicsPipeline = 0;
 
 			// Create compute pipeline and its descriptors
 			VkDescriptorSetLayoutBinding CullDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);;
 			VkDescriptorSetLayoutBinding CmdDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);;
 			VkDescriptorSetLayoutBinding CountDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);;
-
-			VkDescriptorSetLayoutBinding ComputeDescriptorSetLayoutBindings[] = { CullDescriptorSetLayoutBinding, CmdDescriptorSetLayoutBinding, CountDescriptorSetLayoutBinding };
+			VkDescriptorSetLayoutBinding VisibilityDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+			VkDescriptorSetLayoutBinding CellDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+			VkDescriptorSetLayoutBinding VisibleCellDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+			VkDescriptorSetLayoutBinding CellDispatchDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+			VkDescriptorSetLayoutBinding MeshDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(7, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+			VkDescriptorSetLayoutBinding VisibleDrawDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(8, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+			VkDescriptorSetLayoutBinding BucketDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(9, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+			VkDescriptorSetLayoutBinding InstanceListDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(10, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+			VkDescriptorSetLayoutBinding ScatterDispatchDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(11, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+			VkDescriptorSetLayoutBinding DrawUpdateDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(12, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+			VkDescriptorSetLayoutBinding MotionDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(13, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+			VkDescriptorSetLayoutBinding NodeDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(14, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+			VkDescriptorSetLayoutBinding NodeWorldDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(15, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+			VkDescriptorSetLayoutBinding CullStatsDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(16, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+
+			VkDescriptorSetLayoutBinding ComputeDescriptorSetLayoutBindings[] = { CullDescriptorSetLayoutBinding, CmdDescriptorSetLayoutBinding, CountDescriptorSetLayoutBinding, VisibilityDescriptorSetLayoutBinding, CellDescriptorSetLayoutBinding, VisibleCellDescriptorSetLayoutBinding, CellDispatchDescriptorSetLayoutBinding,
+																			  MeshDescriptorSetLayoutBinding, VisibleDrawDescriptorSetLayoutBinding, BucketDescriptorSetLayoutBinding, InstanceListDescriptorSetLayoutBinding, ScatterDispatchDescriptorSetLayoutBinding,
+																			  DrawUpdateDescriptorSetLayoutBinding, MotionDescriptorSetLayoutBinding, NodeDescriptorSetLayoutBinding, NodeWorldDescriptorSetLayoutBinding, CullStatsDescriptorSetLayoutBinding };
 			VkDescriptorSetLayout ComputeDescriptorSetLayout = CreateDescriptorSetLayout(Device, ArrayCount(ComputeDescriptorSetLayoutBindings), ComputeDescriptorSetLayoutBindings);
 
 			VkDescriptorSet CullDescriptorSet = CreateDescriptorSet(Device, DescriptorPool, ComputeDescriptorSetLayout);
 			UpdateDescriptorSetBuffer(Device, CullDescriptorSet, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, MeshDrawBuffer, MeshDrawBuffer.Allocation->GetSize());
-			UpdateDescriptorSetBuffer(Device, CullDescriptorSet, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, IndirectBuffer, IndirectBuffer.Allocation->GetSize());
-			UpdateDescriptorSetBuffer(Device, CullDescriptorSet, 2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, CountBuffer, sizeof(uint32_t));
+			UpdateDescriptorSetBuffer(Device, CullDescriptorSet, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, Culling.IndirectBuffer, Culling.IndirectBuffer.Allocation->GetSize());
+			UpdateDescriptorSetBuffer(Device, CullDescriptorSet, 2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, Culling.CountBuffer, 4 * sizeof(uint32_t));
+			UpdateDescriptorSetBuffer(Device, CullDescriptorSet, 3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, Culling.VisibilityBuffer, Culling.VisibilityBuffer.Allocation->GetSize());
+			UpdateDescriptorSetBuffer(Device, CullDescriptorSet, 4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, Culling.CellBuffer, Culling.CellBuffer.Allocation->GetSize());
+			UpdateDescriptorSetBuffer(Device, CullDescriptorSet, 5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, Culling.VisibleCellBuffer, Culling.VisibleCellBuffer.Allocation->GetSize());
+			UpdateDescriptorSetBuffer(Device, CullDescriptorSet, 6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, Culling.CellDispatchBuffer, CellDispatchBufferSize);
+			UpdateDescriptorSetBuffer(Device, CullDescriptorSet, 7, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, Culling.MeshBuffer, Culling.MeshBuffer.Allocation->GetSize());
+			UpdateDescriptorSetBuffer(Device, CullDescriptorSet, 8, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, Culling.VisibleDrawBuffer, Culling.VisibleDrawBuffer.Allocation->GetSize());
+			UpdateDescriptorSetBuffer(Device, CullDescriptorSet, 9, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, Culling.BucketBuffer, Culling.BucketBuffer.Allocation->GetSize());
+			UpdateDescriptorSetBuffer(Device, CullDescriptorSet, 10, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, Culling.InstanceBuffer, Culling.InstanceBuffer.Allocation->GetSize());
+			UpdateDescriptorSetBuffer(Device, CullDescriptorSet, 11, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, Culling.ScatterDispatchBuffer, 2 * sizeof(VkDispatchIndirectCommand));
+			UpdateDescriptorSetBuffer(Device, CullDescriptorSet, 12, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, Culling.DrawUpdateBuffer, DrawUpdateBufferSize);
+			UpdateDescriptorSetBuffer(Device, CullDescriptorSet, 13, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, Culling.MotionBuffer, Culling.MotionBuffer.Allocation->GetSize());
+			UpdateDescriptorSetBuffer(Device, CullDescriptorSet, 14, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, Culling.NodeBuffer, Culling.NodeBuffer.Allocation->GetSize());
+			UpdateDescriptorSetBuffer(Device, CullDescriptorSet, 15, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, Culling.NodeWorldBuffer, Culling.NodeWorldBuffer.Allocation->GetSize());
+			UpdateDescriptorSetBuffer(Device, CullDescriptorSet, 16, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, Culling.CullStatsBuffer, sizeof(SCullStats));
 
 			VkDescriptorSetLayoutBinding HiZDescriptorSetLayoutBinding = CreateDescriptorSetLayoutBinding(0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT);;
 			VkDescriptorSetLayout HiDepthDescriptorSetLayout = CreateDescriptorSetLayout(Device, 1, &HiZDescriptorSetLayoutBinding);
@@ -1253,8 +5335,36 @@ int main()
 			UpdateDescriptorSetImage(Device, HiZDescriptorSet, 0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, Sampler, Swapchain.DepthMipView, VK_IMAGE_LAYOUT_GENERAL);
 
 			VkDescriptorSetLayout ComputeDescriptorSetLayouts[] = { CameraDescriptorSetLayout, ComputeDescriptorSetLayout, HiDepthDescriptorSetLayout };
-			VkPipelineLayout ComputePipelineLayout = CreatePipelineLayout(Device, ArrayCount(ComputeDescriptorSetLayouts), ComputeDescriptorSetLayouts, sizeof(SPushConstantsCompute));
-			VkPipeline ComputePipeline = CreateComputePipeline(Device, ComputePipelineLayout, CS);
+			Culling.PipelineLayout = CreatePipelineLayout(Device, ArrayCount(ComputeDescriptorSetLayouts), ComputeDescriptorSetLayouts, sizeof(SPushConstantsCompute));
+
+			// Cell and draw culling count their outcomes with constant_id 2, -no-cull-stats leaves them out unless the occlusion CSV needs them
+			VkBool32 CullSpecializationData[] = { bQuantizedDraws, VkBool32(Options.bCullStats || (Options.OcclusionStatsPath != 0)) };
+			VkSpecializationMapEntry CullMapEntries[] = { { 0, 0, sizeof(VkBool32) }, { 2, sizeof(VkBool32), sizeof(VkBool32) } };
+			VkSpecializationInfo CullSpecialization = { ArrayCount(CullMapEntries), CullMapEntries, sizeof(CullSpecializationData), CullSpecializationData };
+
+			// Same refit shader, constant_id 1 makes it go over the cells listed in DrawUpdateBuffer
+			VkBool32 RefitDirtySpecializationData[] = { bQuantizedDraws, VK_TRUE };
+			VkSpecializationMapEntry RefitDirtyMapEntries[] = { { 0, 0, sizeof(VkBool32) }, { 1, sizeof(VkBool32), sizeof(VkBool32) } };
+			VkSpecializationInfo RefitDirtySpecialization = { ArrayCount(RefitDirtyMapEntries), RefitDirtyMapEntries, sizeof(RefitDirtySpecializationData), RefitDirtySpecializationData };
+
+			// Startup pipelines don't depend on each other, so the culling workers compile them side by side
+			uint64_t PipelineBatchBeginTicks = GetCpuTicks();
+			RunJobsParallel(CpuCulling.Workers,
+			{
+				[&]() { GraphicsPipeline = CreateGraphicsPipeline(Device, RenderPass, PipelineLayout, VS, FS, &DrawLayoutSpecialization); },
+				[&]() { Culling.CellCullPipeline = CreateComputePipeline(Device, Culling.PipelineLayout, CellCullCS, &CullSpecialization); },
+				[&]() { Culling.CellRefitPipeline = CreateComputePipeline(Device, Culling.PipelineLayout, CellRefitCS, &DrawLayoutSpecialization); },
+				[&]() { Culling.DrawUpdatePipeline = CreateComputePipeline(Device, Culling.PipelineLayout, DrawUpdateCS, &DrawLayoutSpecialization); },
+				[&]() { Culling.AnimatePipeline = CreateComputePipeline(Device, Culling.PipelineLayout, AnimateCS, &DrawLayoutSpecialization); },
+				[&]() { Culling.HierarchyPipeline = CreateComputePipeline(Device, Culling.PipelineLayout, HierarchyCS, &DrawLayoutSpecialization); },
+				[&]() { Culling.CellRefitDirtyPipeline = CreateComputePipeline(Device, Culling.PipelineLayout, CellRefitCS, &RefitDirtySpecialization); },
+				[&]() { Culling.BucketPrefixPipeline = CreateComputePipeline(Device, Culling.PipelineLayout, BucketPrefixCS); },
+				[&]() { Culling.BucketScatterPipeline = CreateComputePipeline(Device, Culling.PipelineLayout, BucketScatterCS); },
+			});
+			PipelineBatchTicks += GetCpuTicks() - PipelineBatchBeginTicks;
+			Culling.DescriptorSets[0] = CameraDescriptorSet;
+			Culling.DescriptorSets[1] = CullDescriptorSet;
+			Culling.DescriptorSets[2] = HiZDescriptorSet;
 
 			// Create compute depth downscale pipeline and its descriptors
 			VkDescriptorSetLayoutBinding DownscaleOutDescriptorSetLayoutBinging = CreateDescriptorSetLayoutBinding(0, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT);
@@ -1281,51 +5391,230 @@ int main()
 			}
 
 			VkPipelineLayout DownscalePipelineLayout = CreatePipelineLayout(Device, 1, &DownscaleDescriptorSetLayout, sizeof(vec2));
-			VkPipeline DownscalePipeline = CreateComputePipeline(Device, DownscalePipelineLayout, DownscaleCS);
 
+			BeginCpuScope("Asset loading");
 			SGeometry Geometry = {};
 			LoadMesh(Geometry, "meshes\\kitten.obj");
 			LoadMesh(Geometry, "meshes\\bunny.obj");
+			EndCpuScope();
+
+			uint32_t ObjectsCount = Options.ObjectsCount;
 
-			uint32_t ObjectsCount = 100000;
-			if (ObjectsCount & 31)
-				ObjectsCount += 32 - (ObjectsCount & 31);
+			Culling.BucketsCount = (uint32_t)Geometry.Meshes.size() * LodsCount;
+			Assert(2 * Culling.BucketsCount * DepthBinsCount * sizeof(SBucket) <= Culling.BucketBuffer.Allocation->GetSize());
+			Assert(2 * Culling.BucketsCount * DepthBinsCount * sizeof(VkDrawIndexedIndirectCommand) <= Culling.IndirectBuffer.Allocation->GetSize());
 			
 			const float SceneRadius = 100.0f;
 			std::vector<SMeshDraw> MeshDraws(ObjectsCount);
 			for (uint32_t I = 0; I < ObjectsCount; I++)
-			{
-				SMeshDraw& MeshDraw = MeshDraws[I];
-				uint32_t MeshIndex = rand() % Geometry.Meshes.size();
-
-				MeshDraw.SphereCenter = Geometry.Meshes[MeshIndex].SphereCenter;
-				MeshDraw.SphereRadius = Geometry.Meshes[MeshIndex].SphereRadius;
+				MeshDraws[I] = CreateRandomMeshDraw((uint32_t)Geometry.Meshes.size(), SceneRadius);
 
-				MeshDraw.Position.x = 2.0f * SceneRadius * (float(rand()) / RAND_MAX) - SceneRadius;
-				MeshDraw.Position.y = 2.0f * SceneRadius * (float(rand()) / RAND_MAX) - SceneRadius;
-				MeshDraw.Position.z = 2.0f * SceneRadius * (float(rand()) / RAND_MAX) - SceneRadius;
+			// Spinning platforms, each carries a ring of props with a smaller prop on top. Node draws are draw handles until the slots are known
+			SHierarchy Hierarchy = {};
+			std::vector<uint32_t> PlatformNodes;
+			for (uint32_t Platform = 0; Platform < Options.PlatformsCount; Platform++)
+			{
+				vec3 Position = CreateRandomMeshDraw(1, SceneRadius).Position;
+				uint32_t PlatformNode = AddNode(Hierarchy, ~0u, Position, 1.0f, quat(1, 0, 0, 0), ~0u);
+				PlatformNodes.push_back(PlatformNode);
 
-				MeshDraw.Scale = ((float(rand()) / RAND_MAX) + 1) * 2;
-				// Scaling for bunny.obj
-				if (MeshIndex == 1)
-					MeshDraw.Scale *= 0.25f;
+				const uint32_t PropsCount = 8;
+				for (uint32_t Prop = 0; Prop < PropsCount; Prop++)
+				{
+					float Angle = 2.0f * glm::pi<float>() * float(Prop) / float(PropsCount);
+					SMeshDraw PropDraw = CreateRandomMeshDraw((uint32_t)Geometry.Meshes.size(), SceneRadius);
+					uint32_t PropNode = AddNode(Hierarchy, PlatformNode, vec3(6.0f * cosf(Angle), 0.0f, 6.0f * sinf(Angle)), PropDraw.Scale, quat(1, 0, 0, 0), (uint32_t)MeshDraws.size());
+					MeshDraws.push_back(PropDraw);
+
+					SMeshDraw TopDraw = CreateRandomMeshDraw((uint32_t)Geometry.Meshes.size(), SceneRadius);
+					AddNode(Hierarchy, PropNode, vec3(0.0f, 1.5f, 0.0f), 0.5f, glm::angleAxis(Angle, vec3(0.0f, 1.0f, 0.0f)), (uint32_t)MeshDraws.size());
+					MeshDraws.push_back(TopDraw);
+				}
+			}
 
-				float Angle = glm::radians(90.0f * (float(rand()) / RAND_MAX));
-				vec3 Axis = vec3((float(rand()) / RAND_MAX) * 2 - 1, (float(rand()) / RAND_MAX) * 2 - 1, (float(rand()) / RAND_MAX) * 2 - 1);
-				MeshDraw.Orientation = glm::rotate(quat(1, 0, 0, 0), Angle, Axis);
+			std::vector<uint32_t> NodeRemap = SortHierarchyLevels(Hierarchy);
+			for (uint32_t I = 0; I < PlatformNodes.size(); I++)
+				PlatformNodes[I] = NodeRemap[PlatformNodes[I]];
 
-				for (uint32_t J = 0; J < LodsCount; J++)
+			std::vector<SNodeWorld> NodeWorlds = ComputeWorldTransforms(Hierarchy);
+			for (uint32_t I = 0; I < Hierarchy.Nodes.size(); I++)
+			{
+				if (Hierarchy.Nodes[I].DrawIndex != ~0u)
 				{
-					MeshDraw.IndexCount[J] = Geometry.Meshes[MeshIndex].IndexCount[J];
-					MeshDraw.IndexOffset[J] = Geometry.Meshes[MeshIndex].IndexOffset[J];
+					SMeshDraw& MeshDraw = MeshDraws[Hierarchy.Nodes[I].DrawIndex];
+					MeshDraw.Position = NodeWorlds[I].Position;
+					MeshDraw.Scale = NodeWorlds[I].Scale;
+					MeshDraw.Orientation = PackOrientation(NodeWorlds[I].Orientation);
 				}
-				MeshDraw.VertexOffset = Geometry.Meshes[MeshIndex].VertexOffset;
-				MeshDraw.FirstInstance = I;
 			}
 
 			UploadBuffer(Device, CommandPool, CommandBuffer, GraphicsQueue, VertexBuffer, StagingBuffer, Geometry.Vertices.data(), Geometry.Vertices.size() * sizeof(SVertex));
 			UploadBuffer(Device, CommandPool, CommandBuffer, GraphicsQueue, IndexBuffer, StagingBuffer, Geometry.Indices.data(), Geometry.Indices.size() * sizeof(uint32_t));
-			UploadBuffer(Device, CommandPool, CommandBuffer, GraphicsQueue, MeshDrawBuffer, StagingBuffer, MeshDraws.data(), MeshDraws.size() * sizeof(SMeshDraw));
+			UploadBuffer(Device, CommandPool, CommandBuffer, GraphicsQueue, Culling.MeshBuffer, StagingBuffer, Geometry.Meshes.data(), Geometry.Meshes.size() * sizeof(SMesh));
+
+			// Compaction variant and workgroup sizes are timed once per device and driver, the scene buffers are filled after it. Devices without subgroup ballots
+			// in compute never get the subgroup variant. Golden and benchmark runs keep the defaults so their results don't depend on a local tuning file
+			bool bKernelTuning = Options.bRetuneKernels || !(Options.GoldenDirectory || Options.BenchmarkPath || Options.bBenchCompaction || Options.bBenchKernels);
+			char KernelConfigKey[64];
+			GetKernelConfigKey(PhysicalDevice, KernelConfigKey);
+			SKernelConfig KernelConfig = GetDefaultKernelConfig(PhysicalDeviceProps, bSubgroupCompaction);
+			if (bKernelTuning && (Options.bRetuneKernels || !LoadKernelConfig(KernelConfigPath, KernelConfigKey, bSubgroupCompaction, KernelConfig)))
+			{
+				KernelConfig = TuneKernels(Device, PhysicalDevice, GraphicsQueue, CommandPool, CommandBuffer, MemoryAllocator, Culling, StagingBuffer, MeshDrawBuffer, CameraDescriptorSetBindingBuffer,
+										   Sampler, DownscaleDescriptorSetLayout, DownscalePipelineLayout, HiDepthDescriptorSetLayout, (uint32_t)Geometry.Meshes.size(), KernelTuningObjectsCount, bSubgroupCompaction);
+				SaveKernelConfig(KernelConfigPath, KernelConfigKey, KernelConfig);
+			}
+			printf("Kernels: %s compaction, draw cull %u wide, downscale %ux%u\n", CullVariantNames[KernelConfig.CullVariant], KernelConfig.CullGroupSize, KernelConfig.DownscaleGroupSize, KernelConfig.DownscaleGroupSize);
+
+			VkShaderModule CS = LoadShader(Device, CullVariantPaths[KernelConfig.CullVariant]);
+			VkPipeline DownscalePipeline = 0;
+			PipelineBatchBeginTicks = GetCpuTicks();
+			RunJobsParallel(CpuCulling.Workers,
+			{
+				[&]() { Culling.DrawCullPipeline = CreateDrawCullPipeline(Device, Culling.PipelineLayout, CS, bQuantizedDraws, CullSpecializationData[1], KernelConfig.CullGroupSize); },
+				[&]() { DownscalePipeline = CreateDownscalePipeline(Device, DownscalePipelineLayout, DownscaleCS, KernelConfig.DownscaleGroupSize); },
+			});
+			PipelineBatchTicks += GetCpuTicks() - PipelineBatchBeginTicks;
+
+			// Compile time is summed over the workers and includes the tuning pipelines, wall time covers only the startup batches
+			printf("Pipelines: %u created, %.2f ms compiling, startup batches %.2f ms on %u threads\n", GlobalPipelinesCount.load(), double(GlobalPipelineCreationTicks.load()) * 1e-6,
+				   double(PipelineBatchTicks) * 1e-6, GetThreadsCount(CpuCulling.Workers));
+
+			SCellGrid CellGrid = BuildCellGrid(MeshDraws, 64, Options.bSpatialSort);
+			printf("Cell grid: %u cells, %s draw order, average neighbour distance %.3f\n", (uint32_t)CellGrid.Cells.size(), Options.bSpatialSort ? "Morton" : "generation", CellGrid.NeighbourDistance);
+
+			// Culling works on draw slots, ObjectsCount from here on includes the spare ones
+			SInstances Instances = {};
+			CreateInstances(Instances, MeshDraws, CellGrid, 16);
+			ObjectsCount = (uint32_t)Instances.Slots.size();
+
+			for (uint32_t I = 0; I < Hierarchy.Nodes.size(); I++)
+			{
+				if (Hierarchy.Nodes[I].DrawIndex != ~0u)
+				{
+					Hierarchy.Nodes[I].DrawIndex = Instances.HandleSlots[Hierarchy.Nodes[I].DrawIndex];
+					Hierarchy.DrawCells.push_back(Instances.SlotCells[Hierarchy.Nodes[I].DrawIndex]);
+				}
+			}
+			std::sort(Hierarchy.DrawCells.begin(), Hierarchy.DrawCells.end());
+			Hierarchy.DrawCells.erase(std::unique(Hierarchy.DrawCells.begin(), Hierarchy.DrawCells.end()), Hierarchy.DrawCells.end());
+			Assert(Hierarchy.Nodes.size() * sizeof(SNode) <= Culling.NodeBuffer.Allocation->GetSize());
+			Assert(Hierarchy.Nodes.size() * sizeof(SNodeWorld) <= Culling.NodeWorldBuffer.Allocation->GetSize());
+			if (!Hierarchy.Nodes.empty())
+				memcpy(Culling.NodeBuffer.Data, Hierarchy.Nodes.data(), Hierarchy.Nodes.size() * sizeof(SNode));
+			Assert(ObjectsCount * sizeof(SMeshDraw) <= MeshDrawBuffer.Allocation->GetSize());
+			Assert(2 * ObjectsCount * sizeof(uint32_t) <= Culling.InstanceBuffer.Allocation->GetSize());
+			Assert(2 * ObjectsCount * 3 * sizeof(uint32_t) <= Culling.VisibleDrawBuffer.Allocation->GetSize());
+			Assert(!Options.bAnimate || (ObjectsCount * sizeof(SMotion) <= Culling.MotionBuffer.Allocation->GetSize()));
+			Assert(ObjectsCount * sizeof(uint32_t) <= CpuCulling.InstanceBuffer.Allocation->GetSize());
+
+			// GPU animation and the hierarchy pass move draws the CPU never sees, CPU culling would test stale spheres
+			bool bCpuCullingSupported = !Options.bAnimate && Hierarchy.Nodes.empty();
+			if (Options.bCpuCulling && !bCpuCullingSupported)
+				printf("CPU culling isn't supported with -animate or -platforms, using GPU culling\n");
+			bGlobalCpuCullingEnabled = Options.bCpuCulling && bCpuCullingSupported;
+			for (uint32_t Slot = 0; Slot < Instances.Slots.size(); Slot++)
+				UpdateCpuCullingSphere(CpuCulling, Instances, Geometry.Meshes, Slot);
+
+			// Ground truth needs the CPU draws, so it has the same limits as CPU culling and only the GPU counters are written without it
+			SOcclusionStats OcclusionStats = {};
+			if (Options.OcclusionStatsPath)
+			{
+				OcclusionStats.File = fopen(Options.OcclusionStatsPath, "w");
+				Assert(OcclusionStats.File);
+				fprintf(OcclusionStats.File, "frame,time,occlusion_bias,cell_culled,tested,frustum_culled,occlusion_culled,visible,in_frustum,truly_visible,hiz_false_negatives,hiz_false_positives,missing,hidden_drawn\n");
+
+				OcclusionStats.VisibilitySize = ((ObjectsCount + 31) / 32) * sizeof(uint32_t);
+				OcclusionStats.ReadbackBuffer = CreateBuffer(MemoryAllocator, 2 * OcclusionStats.VisibilitySize, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
+				OcclusionStats.QueryPool = CreateQueryPool(Device, ObjectsCount, VK_QUERY_TYPE_OCCLUSION);
+				OcclusionStats.QueryPipeline = CreateGraphicsPipeline(Device, RenderPass, PipelineLayout, VS, FS, &DrawLayoutSpecialization, true);
+
+				OcclusionStats.QueryInstanceBuffer = CreateBuffer(MemoryAllocator, ObjectsCount * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+				for (uint32_t I = 0; I < ObjectsCount; I++)
+					((uint32_t*)OcclusionStats.QueryInstanceBuffer.Data)[I] = I;
+
+				OcclusionStats.QueryDescriptorSet = CreateDescriptorSet(Device, DescriptorPool, MeshDrawDescriptorSetLayout);
+				UpdateDescriptorSetBuffer(Device, OcclusionStats.QueryDescriptorSet, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, MeshDrawBuffer, MeshDrawBuffer.Allocation->GetSize());
+				UpdateDescriptorSetBuffer(Device, OcclusionStats.QueryDescriptorSet, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, OcclusionStats.QueryInstanceBuffer, OcclusionStats.QueryInstanceBuffer.Allocation->GetSize());
+			}
+
+			// Scene orbits the vertical axis, angular speed falls off with the distance so nearby draws and their cells move together
+			if (Options.bAnimate)
+			{
+				for (uint32_t Handle = 0; Handle < Options.ObjectsCount; Handle++)
+				{
+					uint32_t Slot = Instances.HandleSlots[Handle];
+					vec3 Position = Instances.Slots[Slot].Position;
+					vec3 SpinAxis = glm::normalize(vec3((float(rand()) / RAND_MAX) * 2 - 1, 1.0f, (float(rand()) / RAND_MAX) * 2 - 1));
+
+					SMotion& Motion = Instances.Motions[Slot];
+					Motion.LinearVelocity = vec4(0.0f, 0.0f, 0.0f, 0.5f / (1.0f + 0.05f * glm::length(vec2(Position.x, Position.z))));
+					Motion.AngularVelocity = vec4(SpinAxis * (1.0f + 2.0f * (float(rand()) / RAND_MAX)), 0.0f);
+					Motion.OrbitCenter = vec4(0.0f);
+				}
+			}
+
+			Culling.CellsCount = (uint32_t)Instances.Grid.Cells.size();
+			Assert(!Options.bAnimate || (Culling.CellsCount <= 65535));
+			Assert(Culling.CellsCount * sizeof(SCell) <= Culling.CellBuffer.Allocation->GetSize());
+			Assert(Culling.CellsCount * sizeof(uint32_t) <= Culling.VisibleCellBuffer.Allocation->GetSize());
+			Culling.bCellsDirty = true;
+
+			// Packed positions cover the spawn volume, dead slots at the origin and the way of the moving draws, not just the initial cells
+			const float MoveAmplitude = 2.0f;
+			vec3 MotionMin = glm::min(CellGrid.Origin, vec3(-SceneRadius));
+			vec3 MotionMax = glm::max(CellGrid.Origin + CellGrid.CellSize * vec3(float(CellGrid.ResolutionX), float(CellGrid.ResolutionY), float(CellGrid.ResolutionZ)), vec3(SceneRadius));
+			if (Options.MovingCount)
+			{
+				MotionMin.y -= MoveAmplitude;
+				MotionMax.y += MoveAmplitude;
+			}
+			// Orbits keep the distance to their vertical axis, linear drift has no bound and isn't used by this scene
+			for (uint32_t Slot = 0; Options.bAnimate && (Slot < Instances.Slots.size()); Slot++)
+			{
+				const SMotion& Motion = Instances.Motions[Slot];
+				Assert(Motion.LinearVelocity.x == 0.0f && Motion.LinearVelocity.y == 0.0f && Motion.LinearVelocity.z == 0.0f);
+				if (Motion.LinearVelocity.w != 0.0f)
+				{
+					float OrbitRadius = glm::length(vec2(Instances.Slots[Slot].Position.x - Motion.OrbitCenter.x, Instances.Slots[Slot].Position.z - Motion.OrbitCenter.z));
+					MotionMin = glm::min(MotionMin, vec3(Motion.OrbitCenter.x - OrbitRadius, MotionMin.y, Motion.OrbitCenter.z - OrbitRadius));
+					MotionMax = glm::max(MotionMax, vec3(Motion.OrbitCenter.x + OrbitRadius, MotionMax.y, Motion.OrbitCenter.z + OrbitRadius));
+				}
+			}
+			// Nodes are sorted by level, so roots come before their descendants. A draw stays within its distance to the root whatever the nodes turn
+			std::vector<uint32_t> NodeRoots(Hierarchy.Nodes.size());
+			for (uint32_t I = 0; I < Hierarchy.Nodes.size(); I++)
+			{
+				const SNode& Node = Hierarchy.Nodes[I];
+				NodeRoots[I] = (Node.Parent == ~0u) ? I : NodeRoots[Node.Parent];
+				if (Node.DrawIndex != ~0u)
+				{
+					vec3 RootPosition = NodeWorlds[NodeRoots[I]].Position;
+					float Distance = glm::length(NodeWorlds[I].Position - RootPosition);
+					MotionMin = glm::min(MotionMin, RootPosition - Distance);
+					MotionMax = glm::max(MotionMax, RootPosition + Distance);
+				}
+			}
+			FitQuantization(Instances.Grid, MotionMin, MotionMax);
+
+			if (Options.bQuantizeDraws)
+			{
+				std::vector<SPackedMeshDraw> PackedMeshDraws = PackMeshDraws(Instances.Slots, Instances.Grid);
+				UploadBuffer(Device, CommandPool, CommandBuffer, GraphicsQueue, MeshDrawBuffer, StagingBuffer, PackedMeshDraws.data(), PackedMeshDraws.size() * sizeof(SPackedMeshDraw));
+			}
+			else
+			{
+				UploadBuffer(Device, CommandPool, CommandBuffer, GraphicsQueue, MeshDrawBuffer, StagingBuffer, Instances.Slots.data(), Instances.Slots.size() * sizeof(SMeshDraw));
+			}
+			UploadBuffer(Device, CommandPool, CommandBuffer, GraphicsQueue, Culling.CellBuffer, StagingBuffer, Instances.Grid.Cells.data(), Instances.Grid.Cells.size() * sizeof(SCell));
+			if (Options.bAnimate)
+				UploadBuffer(Device, CommandPool, CommandBuffer, GraphicsQueue, Culling.MotionBuffer, StagingBuffer, Instances.Motions.data(), Instances.Motions.size() * sizeof(SMotion));
+
+			// Instances moved or respawned every frame to exercise the sparse updates
+			uint32_t MovingCount = std::min(Options.MovingCount, Options.ObjectsCount);
+			std::vector<vec3> MovingBasePositions(MovingCount);
+			for (uint32_t Handle = 0; Handle < MovingCount; Handle++)
+				MovingBasePositions[Handle] = Instances.Slots[Instances.HandleSlots[Handle]].Position;
 
 			VkEventCreateInfo CreateInfo = { VK_STRUCTURE_TYPE_EVENT_CREATE_INFO };
 			VkEvent Event = 0;
@@ -1333,19 +5622,100 @@ int main()
 			Assert(Event);
 
 			SCameraBuffer CameraBufferData = {};
+			CameraBufferData.QuantizationGrid = Instances.Grid.Quantization;
 			vec3 CameraPosition = vec3(0.0f, 0.0f, 3.0f);
 			vec3 CameraDir = vec3(0.0f);
 
+			bool bQuit = false;
+
+			// Runs before the benchmark, which replaces the scene
+			if (Options.bValidateCulling)
+			{
+				if (!ValidateCulling(Device, GraphicsQueue, CommandPool, CommandBuffer, MemoryAllocator, Culling, CameraDescriptorSetBindingBuffer, Swapchain.DepthMipsImage.Image, Geometry, Instances,
+								SceneRadius, float(Swapchain.Width) / float(Swapchain.Height), Options.bQuantizeDraws))
+				{
+					ExitCode = 1;
+				}
+				bQuit = true;
+			}
+
+			if (Options.bBenchCompaction)
+			{
+				BenchmarkCompaction(Device, PhysicalDevice, GraphicsQueue, CommandPool, CommandBuffer, MemoryAllocator, Culling, StagingBuffer, MeshDrawBuffer, CameraDescriptorSetBindingBuffer,
+									Swapchain.DepthMipsImage.Image, Geometry, Options.ObjectsCount, bSubgroupCompaction);
+				bQuit = true;
+			}
+
+			if (Options.bBenchKernels)
+			{
+				BenchmarkKernels(Device, PhysicalDevice, GraphicsQueue, CommandPool, CommandBuffer, MemoryAllocator, Culling, StagingBuffer, MeshDrawBuffer, CameraDescriptorSetBindingBuffer,
+								 Geometry, Options.ObjectsCount, bSubgroupCompaction);
+				bQuit = true;
+			}
+
+			SBenchmark Benchmark = {};
+			if (Options.BenchmarkPath)
+			{
+				Benchmark.File = fopen(Options.BenchmarkPath, "w");
+				Assert(Benchmark.File);
+				fprintf(Benchmark.File, "config,objects,frame,cpu_ms,gpu_ms,culling_ms,render_ms,hiz_ms,tested,frustum_culled,occlusion_culled,visible,triangles\n");
+
+				if (Options.CameraPath)
+					Benchmark.Path = LoadCameraPath(Options.CameraPath);
+				Benchmark.FramesPerConfig = Options.BenchmarkFramesPerConfig;
+				Benchmark.ObjectsCount = Options.ObjectsCount;
+				Options.FramesCount = GetBenchmarkFramesCount(Benchmark);
+			}
+
+			SCapture Capture = {};
+			SGolden Golden = {};
+			if (Options.GoldenDirectory)
+			{
+				Assert(Swapchain.bCapturable);
+				Golden.Directory = Options.GoldenDirectory;
+				if (Options.CameraPath)
+					Golden.Path = LoadCameraPath(Options.CameraPath);
+				Golden.bCompare = Options.bGoldenCompare;
+				Golden.Tolerance = Options.GoldenTolerance;
+				Options.FramesCount = GetGoldenFramesCount();
+			}
+
 			uint32_t FrameID = 0;
 			double FrameCpuTimeAverage = 0.0f;
 			double FrameGpuTimeAverage = 0.0f;
-			while (!glfwWindowShouldClose(Window))
+			double OverdrawAverage = 0.0f;
+			FILE* InputRecordingFile = Options.RecordPath ? BeginInputRecording(Options.RecordPath, Options) : 0;
+
+			bool bFixedTimeStep = Benchmark.File || Golden.Directory || (Options.ReplayPath && Options.bReplayFixedTimeStep);
+			float PreviousFrameTime = bFixedTimeStep ? -BenchmarkFrameTime : float(GetTime());
+			uint64_t FrameSubmitTicks[GpuProfilerRingSize] = {};
+			std::vector<SGpuScopeTotal> GpuScopeTotals;
+			double FrameCpuTimeTotal = 0.0;
+			while (!bQuit && !(Window && glfwWindowShouldClose(Window)) && ((Options.FramesCount == 0) || (FrameID < Options.FramesCount)))
 			{
-				double FrameCpuBeginTime = glfwGetTime();
+				if (bGlobalCaptureTrace && !GlobalCpuProfiler.bCapturePending)
+					BeginCpuCapture(FrameID, Options.TraceFramesCount);
+				bGlobalCaptureTrace = false;
+
+				double FrameCpuBeginTime = GetTime();
+				BeginCpuScope("Frame");
 
-				glfwPollEvents();
+				if (Window)
+					glfwPollEvents();
 
-				bool bSwapchainWasResized = ResizeSwapchainIfChanged(Swapchain, Device, PhysicalDevice, Surface, SwapchainFormat, DepthFormat, RenderPass, MemoryAllocator);
+				// Windows may apply the replayed size a frame late, offscreen targets are recreated right away
+				const SInputFrame* ReplayFrame = (FrameID < ReplayFrames.size()) ? &ReplayFrames[FrameID] : 0;
+				if (ReplayFrame)
+				{
+					ApplyInputFrame(*ReplayFrame, CameraPosition);
+					if (Window && ((ReplayFrame->Width != Swapchain.Width) || (ReplayFrame->Height != Swapchain.Height)))
+						glfwSetWindowSize(Window, ReplayFrame->Width, ReplayFrame->Height);
+				}
+				SInputFrame InputFrame = GetInputFrame(CameraPosition, Swapchain.Width, Swapchain.Height);
+
+				BeginCpuScope("Swapchain resize check");
+				bool bSwapchainWasResized = Window ? ResizeSwapchainIfChanged(Swapchain, Device, PhysicalDevice, Surface, SwapchainFormat, DepthFormat, RenderPass, MemoryAllocator) :
+													 (ReplayFrame && ResizeOffscreenSwapchain(Swapchain, Device, SwapchainFormat, DepthFormat, RenderPass, MemoryAllocator, ReplayFrame->Width, ReplayFrame->Height));
 				if (bSwapchainWasResized)
 				{
 					UpdateDescriptorSetImage(Device, HiZDescriptorSet, 0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, Sampler, Swapchain.DepthMipView, VK_IMAGE_LAYOUT_GENERAL);
@@ -1364,81 +5734,137 @@ int main()
 						}
 					}
 				}
+				EndCpuScope();
 
-				CameraDir.x = -cosf(glm::radians(GlobalCameraPitch)) * sinf(glm::radians(GlobalCameraHead));
-				CameraDir.y = sinf(glm::radians(GlobalCameraPitch));
-				CameraDir.z = -cosf(glm::radians(GlobalCameraPitch)) * cosf(glm::radians(GlobalCameraHead));
-				CameraDir = normalize(CameraDir);
+				BeginCpuScope("Camera setup");
+				CameraDir = GetCameraDir(GlobalCameraPitch, GlobalCameraHead);
+				if (bGlobalRecordCameraKey)
+				{
+					AppendCameraKey(Options.CameraPath ? Options.CameraPath : "camera_path.txt", CameraPosition, GlobalCameraPitch, GlobalCameraHead);
+					bGlobalRecordCameraKey = false;
+				}
 
-				vec3 CameraRight = glm::normalize(glm::cross(CameraDir, vec3(0.0f, 1.0f, 0.0f)));
-				vec3 CameraUp = glm::cross(CameraRight, CameraDir);
-				float CameraNear = 0.1f;
-				float CameraFar = 100000.0f;
-				float FoV = 70.0f;
-				float AspectRatio = float(Swapchain.Width) / float(Swapchain.Height);
-				float NearHalfHeight = CameraNear * tanf(0.5f*glm::radians(FoV));
-				float NearHalfWidth = AspectRatio * NearHalfHeight;
-				float FarHalfHeight = CameraFar * tanf(0.5f*glm::radians(FoV));
-				float FarHalfWidth = AspectRatio * FarHalfHeight;
-
-				CameraBufferData.PrevView = CameraBufferData.View;
-				CameraBufferData.PrevProj = CameraBufferData.Proj;
-				CameraBufferData.View = glm::lookAt(CameraPosition, CameraPosition + CameraDir, CameraUp);
-				CameraBufferData.Proj = glm::perspective(FoV, AspectRatio, CameraNear, CameraFar);
-				CameraBufferData.CameraPosition = vec4(CameraPosition, -CameraNear);
-				if (FrameID == 0)
+				// The benchmark owns the camera and the culling toggles
+				if (Benchmark.File)
 				{
-					CameraBufferData.PrevView = CameraBufferData.View;
-					CameraBufferData.PrevProj = CameraBufferData.Proj;
+					SBenchmarkFrame BenchmarkFrame = GetBenchmarkFrame(Benchmark, FrameID);
+					const SBenchmarkConfig& Config = BenchmarkConfigs[BenchmarkFrame.Config];
+					bGlobalCullingEnabled = Config.bCulling;
+					bGlobalLodsEnabled = Config.bLods;
+					bGlobalOcclusionCullingEnabled = Config.bOcclusionCulling;
+
+					float PathT = float(BenchmarkFrame.PathFrame) / float(std::max(Benchmark.FramesPerConfig - 1, 1u));
+					GetBenchmarkCamera(Benchmark.Path, PathT, SceneRadius, CameraPosition, CameraDir);
+
+					Benchmark.Frames[FrameID % GpuProfilerRingSize] = BenchmarkFrame;
 				}
 
-				memset(CameraBufferData.Frustums, 0, sizeof(CameraBufferData.Frustums));
-				if (bGlobalCullingEnabled)
+				// Golden runs hold every pose for a few frames and capture the last one
+				uint32_t GoldenPose = FrameID / GoldenFramesPerPose;
+				bool bGoldenCapture = Golden.Directory && (GoldenPose < GoldenPosesCount) && ((FrameID % GoldenFramesPerPose) == GoldenFramesPerPose - 1);
+				if (Golden.Directory)
 				{
-					vec3 FrustumPoints[8] = {};
-					FrustumPoints[0] = CameraPosition + CameraNear*CameraDir + NearHalfWidth*CameraRight + NearHalfHeight*CameraUp; // near right top
-					FrustumPoints[1] = CameraPosition + CameraNear*CameraDir + NearHalfWidth*CameraRight - NearHalfHeight*CameraUp; // near right bot
-					FrustumPoints[2] = CameraPosition + CameraNear*CameraDir - NearHalfWidth*CameraRight + NearHalfHeight*CameraUp; // near left top
-					FrustumPoints[3] = CameraPosition + CameraNear*CameraDir - NearHalfWidth*CameraRight - NearHalfHeight*CameraUp; // naer left bot
-					FrustumPoints[4] = CameraPosition + CameraFar*CameraDir + FarHalfWidth*CameraRight + FarHalfHeight*CameraUp; // far right top
-					FrustumPoints[5] = CameraPosition + CameraFar*CameraDir + FarHalfWidth*CameraRight - FarHalfHeight*CameraUp; // far right bot
-					FrustumPoints[6] = CameraPosition + CameraFar*CameraDir - FarHalfWidth*CameraRight + FarHalfHeight*CameraUp; // far left top
-					FrustumPoints[7] = CameraPosition + CameraFar*CameraDir - FarHalfWidth*CameraRight - FarHalfHeight*CameraUp; // far left bot
-
-					vec3 FrustumPlaneNormals[6] = {};
-					FrustumPlaneNormals[0] = glm::normalize(glm::cross(FrustumPoints[1] - FrustumPoints[0], FrustumPoints[2] - FrustumPoints[0])); // near
-					FrustumPlaneNormals[1] = glm::normalize(glm::cross(FrustumPoints[6] - FrustumPoints[4], FrustumPoints[5] - FrustumPoints[4])); // far
-					FrustumPlaneNormals[2] = glm::normalize(glm::cross(FrustumPoints[4] - FrustumPoints[0], FrustumPoints[1] - FrustumPoints[0])); // right
-					FrustumPlaneNormals[3] = glm::normalize(glm::cross(FrustumPoints[3] - FrustumPoints[2], FrustumPoints[6] - FrustumPoints[2])); // left
-					FrustumPlaneNormals[4] = glm::normalize(glm::cross(FrustumPoints[6] - FrustumPoints[2], FrustumPoints[0] - FrustumPoints[2])); // top
-					FrustumPlaneNormals[5] = glm::normalize(glm::cross(FrustumPoints[5] - FrustumPoints[1], FrustumPoints[3] - FrustumPoints[1])); // bot
-
-					CameraBufferData.Frustums[0] = vec4(FrustumPlaneNormals[0], glm::dot(FrustumPlaneNormals[0], FrustumPoints[0])); // near
-					CameraBufferData.Frustums[1] = vec4(FrustumPlaneNormals[1], glm::dot(FrustumPlaneNormals[1], FrustumPoints[4])); // far
-					CameraBufferData.Frustums[2] = vec4(FrustumPlaneNormals[2], glm::dot(FrustumPlaneNormals[2], FrustumPoints[0])); // right
-					CameraBufferData.Frustums[3] = vec4(FrustumPlaneNormals[3], glm::dot(FrustumPlaneNormals[3], FrustumPoints[2])); // left
-					CameraBufferData.Frustums[4] = vec4(FrustumPlaneNormals[4], glm::dot(FrustumPlaneNormals[4], FrustumPoints[2])); // top
-					CameraBufferData.Frustums[5] = vec4(FrustumPlaneNormals[5], glm::dot(FrustumPlaneNormals[5], FrustumPoints[1])); // bot
+					GetBenchmarkCamera(Golden.Path, float(std::min(GoldenPose, GoldenPosesCount - 1)) / float(GoldenPosesCount), SceneRadius, CameraPosition, CameraDir);
 				}
 
+				float AspectRatio = float(Swapchain.Width) / float(Swapchain.Height);
+				UpdateCameraBuffer(CameraBufferData, CameraPosition, CameraDir, AspectRatio, bGlobalCullingEnabled);
+
 				memcpy(CameraDescriptorSetBindingBuffer.Data, &CameraBufferData, sizeof(CameraBufferData));
+				EndCpuScope();
 
-				uint32_t ImageIndex = 0;
-				VkCheck(vkAcquireNextImageKHR(Device, Swapchain.VkSwapchain, UINT64_MAX, AcquireSemaphore, VK_NULL_HANDLE, &ImageIndex));
+				// Benchmarks step time by a fixed amount, so moving instances are where they were in the baseline run
+				float Time = bFixedTimeStep ? float(FrameID) * BenchmarkFrameTime : float(GetTime());
+				float DeltaTime = std::min(Time - PreviousFrameTime, 0.1f);
+				if (ReplayFrame && !bFixedTimeStep)
+				{
+					Time = ReplayFrame->Time;
+					DeltaTime = ReplayFrame->DeltaTime;
+				}
+				PreviousFrameTime = Time;
+
+				if (InputRecordingFile)
+				{
+					InputFrame.Time = Time;
+					InputFrame.DeltaTime = DeltaTime;
+					InputFrame.Width = uint16_t(Swapchain.Width);
+					InputFrame.Height = uint16_t(Swapchain.Height);
+					fwrite(&InputFrame, sizeof(InputFrame), 1, InputRecordingFile);
+				}
+
+				BeginCpuScope("Scene updates");
+				for (uint32_t Handle = 0; Handle < MovingCount; Handle++)
+				{
+					vec3 Offset = vec3(0.0f, MoveAmplitude * sinf(2.0f * Time + float(Handle)), 0.0f);
+					MoveInstance(Instances, Handle, MovingBasePositions[Handle] + Offset, glm::angleAxis(Time + float(Handle), vec3(0.0f, 1.0f, 0.0f)));
+				}
+				// Platform props are left alone, respawns reuse the freed handles so they stay below ObjectsCount
+				for (uint32_t I = 0; (I < Options.ChurnCount) && (Options.ObjectsCount > MovingCount); I++)
+				{
+					uint32_t Handle = MovingCount + (uint32_t(rand()) * (uint32_t(RAND_MAX) + 1) + uint32_t(rand())) % (Options.ObjectsCount - MovingCount);
+					if (Instances.HandleSlots[Handle] != ~0u)
+					{
+						DespawnInstance(Instances, Handle);
+						SpawnInstance(Instances, CreateRandomMeshDraw((uint32_t)Geometry.Meshes.size(), SceneRadius));
+					}
+				}
+
+				// Platforms turn on the CPU, the hierarchy pass carries their props along on the GPU
+				SNode* Nodes = (SNode*)Culling.NodeBuffer.Data;
+				for (uint32_t I = 0; I < PlatformNodes.size(); I++)
+					Nodes[PlatformNodes[I]].Orientation = glm::angleAxis(0.5f * Time + float(I), vec3(0.0f, 1.0f, 0.0f));
 
-				VkCheck(vkResetCommandPool(Device, CommandPool, 0));
+				for (uint32_t I = 0; I < Instances.DirtySlots.size(); I++)
+					UpdateCpuCullingSphere(CpuCulling, Instances, Geometry.Meshes, Instances.DirtySlots[I]);
+				EndCpuScope();
 
-				VkCommandBufferBeginInfo CommandBufferBeginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
-				CommandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-				VkCheck(vkBeginCommandBuffer(CommandBuffer, &CommandBufferBeginInfo));
+				bool bCpuCulling = bGlobalCpuCullingEnabled && bCpuCullingSupported;
+				double CpuCullingTime = 0.0;
+				SCullStats CpuCullStats = {};
+				if (bCpuCulling)
+				{
+					double CpuCullingBeginTime = GetTime();
+					CullOnCpu(CpuCulling, Geometry.Meshes, CameraBufferData, bGlobalLodsEnabled, CpuCullStats);
+					CpuCullingTime = 1000.0*(GetTime() - CpuCullingBeginTime);
+				}
+
+				bool bOcclusionStats = Options.OcclusionStatsPath && !bCpuCulling;
+				bool bOcclusionReference = bOcclusionStats && bCpuCullingSupported;
+				if (bOcclusionReference)
+				{
+					SCpuScope ReferenceScope("Occlusion reference");
+					CullReference(Instances, Geometry.Meshes, CameraBufferData, bGlobalLodsEnabled, OcclusionStats.Lods, OcclusionStats.FrustumMargins, OcclusionStats.LodMargins);
+
+					OcclusionStats.QueriedDraws.clear();
+					for (uint32_t I = 0; I < OcclusionStats.Lods.size(); I++)
+					{
+						if (OcclusionStats.Lods[I] != -1)
+							OcclusionStats.QueriedDraws.push_back(I);
+					}
+				}
 
-				vkCmdResetQueryPool(CommandBuffer, QueryPool, 0, 4);
-				vkCmdWriteTimestamp(CommandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, QueryPool, 0);
+				uint32_t DrawUpdateCount = 0;
+				uint32_t DirtyCellCount = 0;
+				BeginCpuScope("Flush instance updates");
+				FlushInstanceUpdates(Instances, Culling.DrawUpdateBuffer.Data, Options.bQuantizeDraws, Options.bAnimate, Hierarchy.DrawCells, DrawUpdateCount, DirtyCellCount);
+				EndCpuScope();
 
-				vkCmdFillBuffer(CommandBuffer, CountBuffer.Buffer, 0, sizeof(uint32_t), 0);
+				BeginCpuScope("Acquire");
+				uint32_t ImageIndex = 0;
+				if (Window)
+					VkCheck(vkAcquireNextImageKHR(Device, Swapchain.VkSwapchain, UINT64_MAX, AcquireSemaphore, VK_NULL_HANDLE, &ImageIndex));
+				EndCpuScope();
+
+				BeginCpuScope("Record");
+				BeginCommandBuffer(Device, CommandPool, CommandBuffer);
 
-				VkBufferMemoryBarrier FillBufferBarrier = CreateBufferMemoryBarrier(VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, CountBuffer, sizeof(uint32_t));
-				vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, 1, &FillBufferBarrier, 0, 0);
+				BeginGpuFrame(CommandBuffer, GpuProfiler, FrameID);
+				if (bOcclusionReference)
+					vkCmdResetQueryPool(CommandBuffer, OcclusionStats.QueryPool, 0, ObjectsCount);
+				BeginGpuScope(CommandBuffer, GpuProfiler, "Frame");
+				BeginGpuScope(CommandBuffer, GpuProfiler, "Early culling", true);
+
+				RecordCullingReset(CommandBuffer, Culling, FrameID == 0);
 
 				if ((FrameID == 0) || (bSwapchainWasResized))
 				{
@@ -1451,20 +5877,41 @@ int main()
 					vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, 0, 0, 1, &HiZBarrier);
 				}
 
-				vkCmdBindPipeline(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, ComputePipeline);
-
-				VkDescriptorSet ComputeDescriptorSets[] = { CameraDescriptorSet, CullDescriptorSet, HiZDescriptorSet };
-				vkCmdBindDescriptorSets(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, ComputePipelineLayout, 0, ArrayCount(ComputeDescriptorSets), ComputeDescriptorSets, 0, 0);
-
-				SPushConstantsCompute PushConstants = { bGlobalLodsEnabled, LodsCount, bGlobalOcclusionCullingEnabled, Swapchain.Width, Swapchain.Height };
-				vkCmdPushConstants(CommandBuffer, ComputePipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(SPushConstantsCompute), &PushConstants);
-
-				vkCmdDispatch(CommandBuffer, (ObjectsCount + 31) / 32, 1, 1);
-
-				VkBufferMemoryBarrier CullBufferBarrier = CreateBufferMemoryBarrier(VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT, CountBuffer, sizeof(uint32_t));
-				vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0, 0, 0, 1, &CullBufferBarrier, 0, 0);
+				SPushConstantsCompute PushConstants = { bGlobalLodsEnabled, LodsCount, bGlobalOcclusionCullingEnabled, Swapchain.Width, Swapchain.Height, false, ObjectsCount, Culling.CellsCount, Culling.BucketsCount, bGlobalDepthSortEnabled ? DepthBinsCount : 1, DeltaTime };
+				PushConstants.OcclusionBias = Options.OcclusionBias;
+				if (bOcclusionStats)
+					RecordVisibilityReadback(CommandBuffer, Culling, OcclusionStats.ReadbackBuffer, 0, OcclusionStats.VisibilitySize);
+				uint32_t KeysCount = PushConstants.BucketsCount * PushConstants.DepthBinsCount;
+				BeginGpuScope(CommandBuffer, GpuProfiler, "Draw updates");
+				RecordDrawUpdates(CommandBuffer, Culling, MeshDrawBuffer, PushConstants, DrawUpdateCount, DirtyCellCount);
+				EndGpuScope(CommandBuffer, GpuProfiler);
+				if (Options.bAnimate)
+				{
+					BeginGpuScope(CommandBuffer, GpuProfiler, "Animation");
+					RecordAnimation(CommandBuffer, Culling, MeshDrawBuffer, PushConstants);
+					EndGpuScope(CommandBuffer, GpuProfiler);
+				}
+				BeginGpuScope(CommandBuffer, GpuProfiler, "Hierarchy");
+				RecordHierarchy(CommandBuffer, Culling, MeshDrawBuffer, Hierarchy, PushConstants, DirtyCellCount);
+				EndGpuScope(CommandBuffer, GpuProfiler);
+				// Early pass: draw objects that were visible last frame, with CPU culling it draws everything in the frustum
+				if (!bCpuCulling)
+				{
+					BeginGpuScope(CommandBuffer, GpuProfiler, "Cell culling");
+					RecordCellCulling(CommandBuffer, Culling, PushConstants);
+					EndGpuScope(CommandBuffer, GpuProfiler);
+					BeginGpuScope(CommandBuffer, GpuProfiler, "Draw culling");
+					RecordDrawCulling(CommandBuffer, Culling, Culling.DrawCullPipeline, PushConstants);
+					EndGpuScope(CommandBuffer, GpuProfiler);
+					BeginGpuScope(CommandBuffer, GpuProfiler, "Bucketing");
+					RecordDrawBucketing(CommandBuffer, Culling, PushConstants);
+					EndGpuScope(CommandBuffer, GpuProfiler);
+				}
+				SBuffer& IndirectBuffer = bCpuCulling ? CpuCulling.IndirectBuffer : Culling.IndirectBuffer;
+				SBuffer& CountBuffer = bCpuCulling ? CpuCulling.CountBuffer : Culling.CountBuffer;
 
-				vkCmdWriteTimestamp(CommandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, QueryPool, 1);
+				EndGpuScope(CommandBuffer, GpuProfiler);
+				BeginGpuScope(CommandBuffer, GpuProfiler, "Early render", true);
 
 				VkViewport Viewport = { 0.0f, float(Swapchain.Height), float(Swapchain.Width), -float(Swapchain.Height), 0.0f, 1.0f };
 				VkRect2D Scissor = { {0, 0}, {Swapchain.Width, Swapchain.Height} };
@@ -1487,26 +5934,26 @@ int main()
 				RenderPassBeginInfo.renderArea.extent.height = Swapchain.Height;
 				RenderPassBeginInfo.clearValueCount = ArrayCount(ClearValues);
 				RenderPassBeginInfo.pClearValues = ClearValues;
+
 				vkCmdBeginRenderPass(CommandBuffer, &RenderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
 
 				vkCmdBindPipeline(CommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, GraphicsPipeline);
 
-				VkDescriptorSet DescriptorSets[] = { CameraDescriptorSet, MeshDrawDescriptorSet };
+				VkDescriptorSet DescriptorSets[] = { CameraDescriptorSet, bCpuCulling ? CpuMeshDrawDescriptorSet : MeshDrawDescriptorSet };
 				vkCmdBindDescriptorSets(CommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, PipelineLayout, 0, ArrayCount(DescriptorSets), DescriptorSets, 0, 0);
 
 				VkDeviceSize Offset = 0;
 				vkCmdBindVertexBuffers(CommandBuffer, 0, 1, &VertexBuffer.Buffer, &Offset);
 				vkCmdBindIndexBuffer(CommandBuffer, IndexBuffer.Buffer, 0, VK_INDEX_TYPE_UINT32);
 				
-				vkCmdDrawIndexedIndirectCount(CommandBuffer, IndirectBuffer.Buffer, 0, CountBuffer.Buffer, 0, ObjectsCount, sizeof(VkDrawIndexedIndirectCommand));
+				vkCmdDrawIndexedIndirectCount(CommandBuffer, IndirectBuffer.Buffer, 0, CountBuffer.Buffer, 2 * sizeof(uint32_t), KeysCount, sizeof(VkDrawIndexedIndirectCommand));
 
 				vkCmdEndRenderPass(CommandBuffer);
 
-				VkImageMemoryBarrier RenderEndBarrier = CreateImageMemoryBarrier(VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, 0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, Swapchain.Images[ImageIndex], VK_IMAGE_ASPECT_COLOR_BIT);
-				vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_DEPENDENCY_BY_REGION_BIT, 0, 0, 0, 0, 1, &RenderEndBarrier);
-
-				vkCmdWriteTimestamp(CommandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, QueryPool, 2);
+				EndGpuScope(CommandBuffer, GpuProfiler);
+				BeginGpuScope(CommandBuffer, GpuProfiler, "HiZ", true);
 
+				// Build depth pyramid from the early pass depth
 				VkImageMemoryBarrier DownscaleDepthBarriers[] =
 				{
 					CreateImageMemoryBarrier(VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, Swapchain.DepthImage.Image, VK_IMAGE_ASPECT_DEPTH_BIT),
@@ -1523,26 +5970,103 @@ int main()
 					vec2 ImageSize = vec2(std::max(Swapchain.Width >> (I + 1), 1u), std::max(Swapchain.Height >> (I + 1), 1u));
 					vkCmdPushConstants(CommandBuffer, DownscalePipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(vec2), &ImageSize);
 
-					vkCmdDispatch(CommandBuffer, ((uint32_t)ImageSize.x + 31) / 32, ((uint32_t)ImageSize.y + 31) / 32, 1);
+					uint32_t GroupSize = KernelConfig.DownscaleGroupSize;
+					vkCmdDispatch(CommandBuffer, ((uint32_t)ImageSize.x + GroupSize - 1) / GroupSize, ((uint32_t)ImageSize.y + GroupSize - 1) / GroupSize, 1);
 
 					VkImageMemoryBarrier MipDownscaleDepthBarrier = CreateImageMemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL, Swapchain.DepthMipsImage.Image, VK_IMAGE_ASPECT_COLOR_BIT, I, 1);
 					vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_DEPENDENCY_BY_REGION_BIT, 0, 0, 0, 0, 1, &MipDownscaleDepthBarrier);
 				}
 
-				vkCmdWriteTimestamp(CommandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, QueryPool, 3);
+				EndGpuScope(CommandBuffer, GpuProfiler);
+				BeginGpuScope(CommandBuffer, GpuProfiler, "Late culling", true);
+
+				// Late pass: test everything against the fresh pyramid and draw objects that became visible this frame
+				PushConstants.bLatePass = true;
+				if (!bCpuCulling)
+				{
+					BeginGpuScope(CommandBuffer, GpuProfiler, "Draw culling");
+					RecordDrawCulling(CommandBuffer, Culling, Culling.DrawCullPipeline, PushConstants);
+					EndGpuScope(CommandBuffer, GpuProfiler);
+					BeginGpuScope(CommandBuffer, GpuProfiler, "Bucketing");
+					RecordDrawBucketing(CommandBuffer, Culling, PushConstants);
+					EndGpuScope(CommandBuffer, GpuProfiler);
+				}
+				RecordCullStatsReadback(CommandBuffer, Culling, FrameID);
+				if (bOcclusionStats)
+					RecordVisibilityReadback(CommandBuffer, Culling, OcclusionStats.ReadbackBuffer, OcclusionStats.VisibilitySize, OcclusionStats.VisibilitySize);
+
+				EndGpuScope(CommandBuffer, GpuProfiler);
+				BeginGpuScope(CommandBuffer, GpuProfiler, "Late render", true);
+
+				VkImageMemoryBarrier LateRenderDepthBarrier = CreateImageMemoryBarrier(VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, Swapchain.DepthImage.Image, VK_IMAGE_ASPECT_DEPTH_BIT);
+				vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT, VK_DEPENDENCY_BY_REGION_BIT, 0, 0, 0, 0, 1, &LateRenderDepthBarrier);
+
+				RenderPassBeginInfo.renderPass = LateRenderPass;
+				RenderPassBeginInfo.clearValueCount = 0;
+				RenderPassBeginInfo.pClearValues = 0;
+				vkCmdBeginRenderPass(CommandBuffer, &RenderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+				vkCmdBindPipeline(CommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, GraphicsPipeline);
+				vkCmdBindDescriptorSets(CommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, PipelineLayout, 0, ArrayCount(DescriptorSets), DescriptorSets, 0, 0);
+				vkCmdBindVertexBuffers(CommandBuffer, 0, 1, &VertexBuffer.Buffer, &Offset);
+				vkCmdBindIndexBuffer(CommandBuffer, IndexBuffer.Buffer, 0, VK_INDEX_TYPE_UINT32);
+
+				vkCmdDrawIndexedIndirectCount(CommandBuffer, IndirectBuffer.Buffer, KeysCount * sizeof(VkDrawIndexedIndirectCommand), CountBuffer.Buffer, 3 * sizeof(uint32_t), KeysCount, sizeof(VkDrawIndexedIndirectCommand));
+
+				vkCmdEndRenderPass(CommandBuffer);
+				EndGpuScope(CommandBuffer, GpuProfiler);
+
+				if (bOcclusionReference && !OcclusionStats.QueriedDraws.empty())
+				{
+					VkImageMemoryBarrier QueryBarriers[] =
+					{
+						CreateImageMemoryBarrier(VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, Swapchain.Images[ImageIndex], VK_IMAGE_ASPECT_COLOR_BIT),
+						CreateImageMemoryBarrier(VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, Swapchain.DepthImage.Image, VK_IMAGE_ASPECT_DEPTH_BIT),
+					};
+					vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT, VK_DEPENDENCY_BY_REGION_BIT, 0, 0, 0, 0, ArrayCount(QueryBarriers), QueryBarriers);
+
+					BeginGpuScope(CommandBuffer, GpuProfiler, "Occlusion queries");
+					vkCmdBeginRenderPass(CommandBuffer, &RenderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+					RecordOcclusionQueries(CommandBuffer, OcclusionStats, PipelineLayout, CameraDescriptorSet, Instances, Geometry.Meshes);
+					vkCmdEndRenderPass(CommandBuffer);
+					EndGpuScope(CommandBuffer, GpuProfiler);
+				}
+
+				bool bCaptureFrame = bGoldenCapture || (bGlobalCaptureFrame && !Golden.Directory && Swapchain.bCapturable);
+				bGlobalCaptureFrame = false;
+				if (bCaptureFrame)
+				{
+					BeginGpuScope(CommandBuffer, GpuProfiler, "Capture");
+					RecordCapture(CommandBuffer, MemoryAllocator, Capture, Swapchain, SwapchainFormat, ImageIndex, FrameID, bGoldenCapture ? GoldenPose : FrameID);
+					EndGpuScope(CommandBuffer, GpuProfiler);
+				}
+
+				// The offscreen image stays a color attachment, the next frame discards it anyway
+				if (Window)
+				{
+					VkImageMemoryBarrier RenderEndBarrier = bCaptureFrame ? CreateImageMemoryBarrier(VK_ACCESS_TRANSFER_READ_BIT, 0, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, Swapchain.Images[ImageIndex], VK_IMAGE_ASPECT_COLOR_BIT) :
+																			 CreateImageMemoryBarrier(VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, 0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, Swapchain.Images[ImageIndex], VK_IMAGE_ASPECT_COLOR_BIT);
+					vkCmdPipelineBarrier(CommandBuffer, bCaptureFrame ? VK_PIPELINE_STAGE_TRANSFER_BIT : VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, bCaptureFrame ? 0 : VK_DEPENDENCY_BY_REGION_BIT, 0, 0, 0, 0, 1, &RenderEndBarrier);
+				}
+
+				EndGpuScope(CommandBuffer, GpuProfiler);
 
 				VkCheck(vkEndCommandBuffer(CommandBuffer));
+				EndCpuScope();
 
 				VkPipelineStageFlags SubmitWaitStage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
 				VkSubmitInfo SubmitInfo = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
-				SubmitInfo.waitSemaphoreCount = 1;
+				SubmitInfo.waitSemaphoreCount = Window ? 1 : 0;
 				SubmitInfo.pWaitSemaphores = &AcquireSemaphore;
 				SubmitInfo.pWaitDstStageMask = &SubmitWaitStage;
 				SubmitInfo.commandBufferCount = 1;
 				SubmitInfo.pCommandBuffers = &CommandBuffer;
-				SubmitInfo.signalSemaphoreCount = 1;
+				SubmitInfo.signalSemaphoreCount = Window ? 1 : 0;
 				SubmitInfo.pSignalSemaphores = &ReleaseSemaphore;
+				BeginCpuScope("Submit");
+				FrameSubmitTicks[FrameID % GpuProfilerRingSize] = GetCpuTicks();
 				VkCheck(vkQueueSubmit(GraphicsQueue, 1, &SubmitInfo, 0));
+				EndCpuScope();
 
 				VkPresentInfoKHR PresentInfo = { VK_STRUCTURE_TYPE_PRESENT_INFO_KHR };
 				PresentInfo.waitSemaphoreCount = 1;
@@ -1550,40 +6074,148 @@ int main()
 				PresentInfo.swapchainCount = 1;
 				PresentInfo.pSwapchains = &Swapchain.VkSwapchain;
 				PresentInfo.pImageIndices = &ImageIndex;
-				VkCheck(vkQueuePresentKHR(GraphicsQueue, &PresentInfo));
+				if (Window)
+				{
+					BeginCpuScope("Present");
+					VkCheck(vkQueuePresentKHR(GraphicsQueue, &PresentInfo));
+					EndCpuScope();
+				}
 
+				BeginCpuScope("Wait idle");
 				VkCheck(vkDeviceWaitIdle(Device));
+				EndCpuScope();
+
+				// Timings are GpuProfilerRingSize - 1 frames old, like the culling stats
+				bool bGpuResults = ReadGpuProfiler(Device, GpuProfiler, FrameID);
+				if (bGpuResults)
+				{
+					AddGpuTraceEvents(GpuProfiler, FrameID + 1 - GpuProfilerRingSize, FrameSubmitTicks[(FrameID + 1) % GpuProfilerRingSize]);
+					AccumulateGpuProfiler(GpuScopeTotals, GpuProfiler);
+				}
+				std::vector<uint8_t> CapturePixels;
+				uint32_t CaptureWidth = 0, CaptureHeight = 0, CaptureTag = 0;
+				if (ReadCapture(Capture, FrameID, CapturePixels, CaptureWidth, CaptureHeight, CaptureTag))
+				{
+					SCpuScope CaptureScope("Write capture");
+					if (Golden.Directory)
+					{
+						ProcessGoldenCapture(Golden, CapturePixels, CaptureWidth, CaptureHeight, CaptureTag);
+					}
+					else
+					{
+						char CapturePath[64];
+						snprintf(CapturePath, sizeof(CapturePath), "capture_%u.png", CaptureTag);
+						stbi_write_png(CapturePath, CaptureWidth, CaptureHeight, 4, CapturePixels.data(), CaptureWidth * 4);
+						printf("Frame captured to %s\n", CapturePath);
+					}
+				}
+				if (bGlobalPrintGpuProfile)
+				{
+					PrintGpuProfiler(GpuProfiler);
+					bGlobalPrintGpuProfile = false;
+				}
 
-				uint64_t Timestamps[4] = {};
-				VkCheck(vkGetQueryPoolResults(Device, QueryPool, 0, ArrayCount(Timestamps), sizeof(Timestamps), Timestamps, sizeof(Timestamps[0]), VK_QUERY_RESULT_64_BIT));
+				double FrameGpuCullingTime = GetGpuScopeTime(GpuProfiler, "Early culling") + GetGpuScopeTime(GpuProfiler, "Late culling");
+				double FrameGpuRenderTime = GetGpuScopeTime(GpuProfiler, "Early render") + GetGpuScopeTime(GpuProfiler, "Late render");
+				double FrameGpuHiZTime = GetGpuScopeTime(GpuProfiler, "HiZ");
+				double FrameGpuTime = GetGpuScopeTime(GpuProfiler, "Frame");
 
-				double FrameGpuBeginTime = double(Timestamps[0]) * PhysicalDeviceProps.limits.timestampPeriod * 1e-6;
-				double FrameGpuCullingEndTime = double(Timestamps[1]) * PhysicalDeviceProps.limits.timestampPeriod * 1e-6;
-				double FrameGpuRenderEndTime = double(Timestamps[2]) * PhysicalDeviceProps.limits.timestampPeriod * 1e-6;
-				double FrameGpuEndTime = double(Timestamps[3]) * PhysicalDeviceProps.limits.timestampPeriod * 1e-6;
+				// The CSV needs the stats of this frame, fine here since the frame has already been waited for
+				if (bOcclusionStats)
+					WriteOcclusionStats(Device, OcclusionStats, GetCullStats(Culling, FrameID), FrameID, Time, Options.OcclusionBias, bOcclusionReference);
 
-				double FrameGpuCullingTime = FrameGpuCullingEndTime - FrameGpuBeginTime;
-				double FrameGpuRenderTime = FrameGpuRenderEndTime - FrameGpuCullingEndTime;
-				double FrameGpuHiZTime = FrameGpuEndTime - FrameGpuRenderEndTime;
-				double FrameGpuTime = FrameGpuEndTime - FrameGpuBeginTime;
+				SCullStats CullStats = {};
+				if (bCpuCulling)
+					CullStats = CpuCullStats;
+				else if (Options.bCullStats && (FrameID + 1 >= CullStatsRingSize))
+					CullStats = GetCullStats(Culling, FrameID + 1 - CullStatsRingSize);
 
-				double FrameCpuEndTime = glfwGetTime();
+				char LodDraws[128] = {};
+				for (uint32_t I = 0, Length = 0; I < LodsCount; I++)
+					Length += snprintf(LodDraws + Length, sizeof(LodDraws) - Length, I ? "/%u" : "%u", CullStats.EmittedLodDraws[I]);
+
+				// Fragment shader invocations of both render passes divided by the pixel count
+				uint64_t FragmentInvocations = GetGpuScopeStatistic(GpuProfiler, "Early render", GpuStatisticFragmentInvocations) + GetGpuScopeStatistic(GpuProfiler, "Late render", GpuStatisticFragmentInvocations);
+				double Overdraw = double(FragmentInvocations) / double(Swapchain.Width * Swapchain.Height);
+
+				double FrameCpuEndTime = GetTime();
 				double FrameCpuTime = 1000.0*(FrameCpuEndTime - FrameCpuBeginTime);
 
+				FrameCpuTimeTotal += FrameCpuTime;
+
+				if (Benchmark.File)
+				{
+					SBenchmarkFrame& BenchmarkFrame = Benchmark.Frames[FrameID % GpuProfilerRingSize];
+					BenchmarkFrame.CpuTime = FrameCpuTime;
+					BenchmarkFrame.bCpuCulling = bCpuCulling;
+					BenchmarkFrame.CpuCullStats = CpuCullStats;
+
+					if (bGpuResults)
+					{
+						uint32_t ResultsFrameID = FrameID + 1 - GpuProfilerRingSize;
+						const SBenchmarkFrame& ResultsFrame = Benchmark.Frames[ResultsFrameID % GpuProfilerRingSize];
+						WriteBenchmarkFrame(Benchmark, GpuProfiler, ResultsFrame.bCpuCulling ? ResultsFrame.CpuCullStats : GetCullStats(Culling, ResultsFrameID), ResultsFrameID);
+					}
+				}
 				FrameCpuTimeAverage = 0.95*FrameCpuTimeAverage + 0.05*FrameCpuTime;
 				FrameGpuTimeAverage = 0.95*FrameGpuTimeAverage + 0.05*FrameGpuTime;
+				OverdrawAverage = 0.95*OverdrawAverage + 0.05*Overdraw;
 
-				char Title[512];
-				sprintf(Title, "cpu: %.2f ms; gpu: %.2f ms; culling: %s; lods: %s; occlusion culling: %s; culling gpu: %.2f ms; render gpu: %.2f ms; hi-z gpu: %0.2f ms", FrameCpuTimeAverage, FrameGpuTimeAverage, 
+				char Title[1024];
+				sprintf(Title, "cpu: %.2f ms; gpu: %.2f ms; culling: %s; lods: %s; occlusion culling: %s; depth sort: %s; culling gpu: %.2f ms; render gpu: %.2f ms; hi-z gpu: %0.2f ms; overdraw: %.2f; draw updates: %u; culling backend: %s; culling cpu: %.2f ms; "
+							   "tested: %u; frustum culled: %u; occlusion culled: %u; draws per lod: %s; triangles: %.2fM", FrameCpuTimeAverage, FrameGpuTimeAverage, 
 																																										  bGlobalCullingEnabled ? "ON" : "OFF",
 																																										  bGlobalLodsEnabled ? "ON" : "OFF",
 																																										  bGlobalOcclusionCullingEnabled ? "ON" : "OFF",
-																																										  FrameGpuCullingTime, FrameGpuRenderTime, FrameGpuHiZTime);
+																																										  bGlobalDepthSortEnabled ? "ON" : "OFF",
+																																										  FrameGpuCullingTime, FrameGpuRenderTime, FrameGpuHiZTime, OverdrawAverage, DrawUpdateCount,
+																																										  bCpuCulling ? "CPU" : "GPU", CpuCullingTime,
+																																										  CullStats.TestedDraws + CullStats.CellCulledDraws, CullStats.FrustumCulledDraws + CullStats.CellCulledDraws, CullStats.OcclusionCulledDraws, LodDraws, CullStats.EmittedTriangles * 1e-6);
 
-				glfwSetWindowTitle(Window, Title);
+				if (Window)
+					glfwSetWindowTitle(Window, Title);
+
+				EndCpuScope();
+
+				// CPU markers stop with the last captured frame, the file is written once its GPU scopes are read back too
+				if (GlobalCpuProfiler.bCapturing && (FrameID + 1 >= GlobalCpuProfiler.CaptureEndFrame))
+					GlobalCpuProfiler.bCapturing = false;
+				if (GlobalCpuProfiler.bCapturePending && (FrameID + 2 >= GlobalCpuProfiler.CaptureEndFrame + GpuProfilerRingSize))
+				{
+					WriteChromeTrace(TracePath);
+					GlobalCpuProfiler.bCapturePending = false;
+				}
 
 				FrameID++;
 			}
+
+			if (GlobalCpuProfiler.bCapturePending)
+				WriteChromeTrace(TracePath);
+			if (Benchmark.File)
+				fclose(Benchmark.File);
+			if (InputRecordingFile)
+				fclose(InputRecordingFile);
+			if (Golden.bCompare)
+			{
+				printf("%u of %u golden poses differ\n", Golden.FailedPosesCount, GoldenPosesCount);
+				if (Golden.FailedPosesCount)
+					ExitCode = 1;
+			}
+
+			// Fixed length runs are scripted, so they print per pass averages over the whole run
+			if ((Options.FramesCount != 0) && (FrameID > 0))
+			{
+				printf("%u frames, %ux%u, %u objects\n", FrameID, Swapchain.Width, Swapchain.Height, Options.ObjectsCount);
+				printf("cpu: %.3f ms\n", FrameCpuTimeTotal / double(FrameID));
+				PrintGpuScopeTotals(GpuScopeTotals);
+			}
+
+			if (Options.bPipelineCache)
+				SavePipelineCache(Device, GlobalPipelineCache, PipelineCachePath);
+
+			DestroyWorkerPool(CpuCulling.Workers);
+			if (OcclusionStats.File)
+				fclose(OcclusionStats.File);
 		}
 		else
 		{
@@ -1595,5 +6227,5 @@ int main()
 		printf("Can't initalize GLFW\n");
 	}
 
-	return 0;
+	return ExitCode;
 }
\ No newline at end of file
@@ -0,0 +1,83 @@
+#version 460
+
+#extension GL_GOOGLE_include_directive : require
+
+#define DRAW_UPDATE
+
+#include "common.h"
+#include "cull.h"
+
+shared vec3 WorkgroupBoundsMin[32];
+shared vec3 WorkgroupBoundsMax[32];
+
+// One workgroup per cell: advances the motion of the cell draws in place and refits the cell to their new spheres
+layout (local_size_x = 32, local_size_y = 1, local_size_z = 1) in;
+void main()
+{
+	uint CellIndex = gl_WorkGroupID.x;
+	uint FirstDraw = Cells[CellIndex].FirstDraw;
+	uint CellDrawCount = Cells[CellIndex].DrawCount;
+
+	vec3 BoundsMin = vec3(1e30);
+	vec3 BoundsMax = vec3(-1e30);
+	for (uint I = gl_LocalInvocationID.x; I < CellDrawCount; I += gl_WorkGroupSize.x)
+	{
+		uint Index = FirstDraw + I;
+		SMeshDraw MeshDraw = LoadMeshDraw(Index);
+		if (MeshDraw.MeshIndex == DeadMeshIndex)
+			continue;
+
+		SMotion Motion = Motions[Index];
+		if (any(notEqual(Motion.LinearVelocity, vec4(0.0))) || any(notEqual(Motion.AngularVelocity.xyz, vec3(0.0))))
+		{
+			vec3 Position = MeshDraw.Position + Motion.LinearVelocity.xyz * DeltaTime;
+
+			float OrbitAngle = Motion.LinearVelocity.w * DeltaTime;
+			vec2 Offset = Position.xz - Motion.OrbitCenter.xz;
+			Position.xz = Motion.OrbitCenter.xz + mat2(cos(OrbitAngle), sin(OrbitAngle), -sin(OrbitAngle), cos(OrbitAngle)) * Offset;
+			MeshDraw.Position = Position;
+
+			float AngularSpeed = length(Motion.AngularVelocity.xyz);
+			if (AngularSpeed > 0.0)
+			{
+				float HalfAngle = 0.5 * AngularSpeed * DeltaTime;
+				vec4 Rotation = vec4(Motion.AngularVelocity.xyz * (sin(HalfAngle) / AngularSpeed), cos(HalfAngle));
+				MeshDraw.Orientation = normalize(MultiplyQuaternion(Rotation, MeshDraw.Orientation));
+			}
+
+			StoreMeshDraw(Index, MeshDraw);
+		}
+
+		vec4 Sphere = GetBoundingSphere(MeshDraw, vec4(Meshes[MeshDraw.MeshIndex].SphereCenter, Meshes[MeshDraw.MeshIndex].SphereRadius));
+		BoundsMin = min(BoundsMin, Sphere.xyz - Sphere.w);
+		BoundsMax = max(BoundsMax, Sphere.xyz + Sphere.w);
+	}
+
+	WorkgroupBoundsMin[gl_LocalInvocationID.x] = BoundsMin;
+	WorkgroupBoundsMax[gl_LocalInvocationID.x] = BoundsMax;
+	barrier();
+
+	for (uint Stride = gl_WorkGroupSize.x / 2; Stride > 0; Stride /= 2)
+	{
+		if (gl_LocalInvocationID.x < Stride)
+		{
+			WorkgroupBoundsMin[gl_LocalInvocationID.x] = min(WorkgroupBoundsMin[gl_LocalInvocationID.x], WorkgroupBoundsMin[gl_LocalInvocationID.x + Stride]);
+			WorkgroupBoundsMax[gl_LocalInvocationID.x] = max(WorkgroupBoundsMax[gl_LocalInvocationID.x], WorkgroupBoundsMax[gl_LocalInvocationID.x + Stride]);
+		}
+		barrier();
+	}
+
+	if (gl_LocalInvocationID.x == 0)
+	{
+		BoundsMin = WorkgroupBoundsMin[0];
+		BoundsMax = WorkgroupBoundsMax[0];
+		if (BoundsMin.x > BoundsMax.x)
+		{
+			BoundsMin = vec3(0.0);
+			BoundsMax = vec3(0.0);
+		}
+
+		Cells[CellIndex].BoundsMin = BoundsMin;
+		Cells[CellIndex].BoundsMax = BoundsMax;
+	}
+}
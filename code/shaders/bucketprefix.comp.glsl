@@ -0,0 +1,72 @@
+#version 460
+
+#extension GL_GOOGLE_include_directive : require
+
+#include "common.h"
+#include "cull.h"
+
+shared uvec2 Scan[256];
+shared uvec2 Carry;
+
+// Single workgroup: prefix sum over bucket sizes gives every bucket its instance range, and every non-empty bucket gets one instanced command
+layout (local_size_x = 256, local_size_y = 1, local_size_z = 1) in;
+void main()
+{
+	uint Thread = gl_LocalInvocationIndex;
+	uint KeysCount = BucketsCount * DepthBinsCount;
+	uint PassBucketBase = bLatePass * KeysCount;
+
+	if (Thread == 0)
+		Carry = uvec2(0);
+	barrier();
+
+	for (uint Block = 0; Block < KeysCount; Block += gl_WorkGroupSize.x)
+	{
+		uint Bucket = Block + Thread;
+		uint InstanceCount = (Bucket < KeysCount) ? Buckets[PassBucketBase + Bucket].InstanceCount : 0;
+
+		// x - instances, y - commands
+		uvec2 Value = uvec2(InstanceCount, (InstanceCount > 0) ? 1 : 0);
+		Scan[Thread] = Value;
+		barrier();
+
+		for (uint Offset = 1; Offset < gl_WorkGroupSize.x; Offset <<= 1)
+		{
+			uvec2 Sum = (Thread >= Offset) ? Scan[Thread - Offset] : uvec2(0);
+			barrier();
+			Scan[Thread] += Sum;
+			barrier();
+		}
+
+		uvec2 Exclusive = Carry + Scan[Thread] - Value;
+		if (InstanceCount > 0)
+		{
+			uint MeshIndex = (Bucket % BucketsCount) / LodsCount;
+			uint LodIndex = Bucket % LodsCount;
+			uint FirstInstance = bLatePass * ObjectsCount + Exclusive.x;
+			uint CommandIndex = PassBucketBase + Exclusive.y;
+
+			Buckets[PassBucketBase + Bucket].FirstInstance = FirstInstance;
+
+			DrawCommand[CommandIndex].IndexCount = Meshes[MeshIndex].IndexCount[LodIndex];
+			DrawCommand[CommandIndex].InstanceCount = InstanceCount;
+			DrawCommand[CommandIndex].FirstIndex = Meshes[MeshIndex].FirstIndex[LodIndex];
+			DrawCommand[CommandIndex].VertexOffset = Meshes[MeshIndex].VertexOffset;
+			DrawCommand[CommandIndex].FirstInstance = FirstInstance;
+		}
+		barrier();
+
+		if (Thread == gl_WorkGroupSize.x - 1)
+			Carry += Scan[Thread];
+		barrier();
+	}
+
+	if (Thread == 0)
+	{
+		CommandCount[bLatePass] = Carry.y;
+
+		ScatterDispatch[bLatePass].X = (DrawCount[bLatePass] + 63) / 64;
+		ScatterDispatch[bLatePass].Y = 1;
+		ScatterDispatch[bLatePass].Z = 1;
+	}
+}
\ No newline at end of file
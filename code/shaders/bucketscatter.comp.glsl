@@ -0,0 +1,20 @@
+#version 460
+
+#extension GL_GOOGLE_include_directive : require
+
+#include "common.h"
+#include "cull.h"
+
+// Moves every visible draw to its slot inside the bucket instance range
+layout (local_size_x = 64, local_size_y = 1, local_size_z = 1) in;
+void main()
+{
+	uint Index = gl_GlobalInvocationID.x;
+	if (Index >= DrawCount[bLatePass])
+		return;
+
+	uint VisibleIndex = bLatePass * ObjectsCount + Index;
+	uint Bucket = bLatePass * BucketsCount * DepthBinsCount + VisibleDraws[VisibleIndex].Key;
+
+	Instances[Buckets[Bucket].FirstInstance + VisibleDraws[VisibleIndex].Slot] = VisibleDraws[VisibleIndex].DrawIndex;
+}
\ No newline at end of file
@@ -0,0 +1,35 @@
+#version 460
+
+#extension GL_GOOGLE_include_directive : require
+
+#include "common.h"
+#include "cull.h"
+
+layout (local_size_x = 32, local_size_y = 1, local_size_z = 1) in;
+void main()
+{
+	uint CellIndex = gl_GlobalInvocationID.x;
+	if (CellIndex >= CellsCount)
+		return;
+
+	vec3 Center = 0.5 * (Cells[CellIndex].BoundsMax + Cells[CellIndex].BoundsMin);
+	vec3 Extent = 0.5 * (Cells[CellIndex].BoundsMax - Cells[CellIndex].BoundsMin);
+
+	// Box is outside of the plane if even its closest corner is, so the box extent gets projected on the plane normal
+	bool bVisible = Cells[CellIndex].DrawCount > 0;
+	for (uint I = 0; I < 6; I++)
+		bVisible = bVisible && (dot(vec4(Center, -1.0), Frustum[I]) >= -dot(abs(Frustum[I].xyz), Extent));
+
+	if (bVisible)
+	{
+		uint Slot = atomicAdd(VisibleCellCount, 1);
+		VisibleCells[Slot] = CellIndex;
+
+		atomicMax(CellDispatchX, min(Slot + 1, MaxCellDispatchX));
+		atomicMax(CellDispatchY, Slot / MaxCellDispatchX + 1);
+	}
+	else if (bCullStats && (Cells[CellIndex].DrawCount > 0))
+	{
+		atomicAdd(CullStats[CULL_STAT_CELL_CULLED_DRAWS], Cells[CellIndex].DrawCount);
+	}
+}
@@ -0,0 +1,45 @@
+#version 460
+
+#extension GL_GOOGLE_include_directive : require
+
+#include "common.h"
+#include "cull.h"
+
+// Refit only the cells listed by the draw update pass instead of every cell
+layout (constant_id = 1) const bool bRefitDirtyCells = false;
+
+// Fits cell bounds to the bounding spheres of its draws, so draws can move without being rebinned
+layout (local_size_x = 32, local_size_y = 1, local_size_z = 1) in;
+void main()
+{
+	uint Index = gl_GlobalInvocationID.x;
+	if (Index >= (bRefitDirtyCells ? DirtyCellCount : CellsCount))
+		return;
+
+	uint CellIndex = bRefitDirtyCells ? DirtyCells[Index] : Index;
+
+	uint FirstDraw = Cells[CellIndex].FirstDraw;
+	uint CellDrawCount = Cells[CellIndex].DrawCount;
+
+	vec3 BoundsMin = vec3(1e30);
+	vec3 BoundsMax = vec3(-1e30);
+	for (uint I = 0; I < CellDrawCount; I++)
+	{
+		SMeshDraw MeshDraw = LoadMeshDraw(FirstDraw + I);
+		if (MeshDraw.MeshIndex == DeadMeshIndex)
+			continue;
+
+		vec4 Sphere = GetBoundingSphere(MeshDraw, vec4(Meshes[MeshDraw.MeshIndex].SphereCenter, Meshes[MeshDraw.MeshIndex].SphereRadius));
+		BoundsMin = min(BoundsMin, Sphere.xyz - Sphere.w);
+		BoundsMax = max(BoundsMax, Sphere.xyz + Sphere.w);
+	}
+
+	if (BoundsMin.x > BoundsMax.x)
+	{
+		BoundsMin = vec3(0.0);
+		BoundsMax = vec3(0.0);
+	}
+
+	Cells[CellIndex].BoundsMin = BoundsMin;
+	Cells[CellIndex].BoundsMax = BoundsMax;
+}
@@ -0,0 +1,191 @@
+layout (set = 0, binding = 0) uniform CameraBuffer
+{
+	mat4 View;
+	mat4 Proj;
+
+	vec4 CameraPosition; // w = Near
+	vec4 Frustum[6];
+
+	vec4 QuantizationGrid; // xyz = origin, w = cell size of the packed draw positions
+};
+
+// Draws are 8 uints {vec3 Position, float Scale, vec3 Orientation xyz, uint MeshIndex} or, when quantized, 6 uints:
+// 0-1 - position inside its grid cell, 3 x 21 bit fixed point
+// 2   - grid cell coordinates, 3 x 10 bit
+// 3-4 - orientation, 4 x int16 smallest three, same layout as meshopt_decodeFilterQuat
+// 5   - half float scale | mesh index << 16
+layout (constant_id = 0) const bool bQuantizedDraws = false;
+
+// Only the draw update and animation passes write draws
+#ifdef DRAW_UPDATE
+layout (set = 1, binding = 0) buffer Draws
+#else
+layout (set = 1, binding = 0) readonly buffer Draws
+#endif
+{
+	uint DrawData[];
+};
+
+// Free draw slot, culling and cell refit skip it
+const uint DeadMeshIndex = 0xFFFF;
+
+// Decoded instance transform and mesh, bounds and LODs are in the mesh table
+struct SMeshDraw
+{
+	vec3 Position;
+	float Scale;
+	vec4 Orientation;
+	uint MeshIndex;
+};
+
+// Mesh table entry, every LOD of one mesh
+struct SMesh
+{
+	vec3 SphereCenter;
+	float SphereRadius;
+
+	uint IndexCount[7];
+	uint FirstIndex[7];
+	uint VertexOffset;
+};
+
+struct SMeshDrawCommand
+{
+	uint IndexCount;
+	uint InstanceCount;
+	uint FirstIndex;
+	uint VertexOffset;
+	uint FirstInstance;
+};
+
+// Loose grid cell, owns MeshDraws [FirstDraw, FirstDraw + DrawCount)
+struct SCell
+{
+	vec3 BoundsMin;
+	uint FirstDraw;
+	vec3 BoundsMax;
+	uint DrawCount;
+};
+
+vec3 RotateQuaternion(vec3 V, vec4 Q)
+{
+	return V + 2.0 * cross(Q.xyz, cross(Q.xyz, V) + Q.w * V);
+}
+
+vec4 MultiplyQuaternion(vec4 A, vec4 B)
+{
+	return vec4(A.w * B.xyz + B.w * A.xyz + cross(A.xyz, B.xyz), A.w * B.w - dot(A.xyz, B.xyz));
+}
+
+// Reconstructs the dropped component, xyz - components after it in cyclic order, D.w & 3 - its index
+vec4 DecodeQuaternion(ivec4 D)
+{
+	vec3 V = vec3(D.xyz) * (inversesqrt(2.0) / float(D.w | 3));
+	float W = sqrt(max(0.0, 1.0 - dot(V, V)));
+
+	switch (D.w & 3)
+	{
+		case 0: return vec4(W, V.x, V.y, V.z);
+		case 1: return vec4(V.z, W, V.x, V.y);
+		case 2: return vec4(V.y, V.z, W, V.x);
+		default: return vec4(V.x, V.y, V.z, W);
+	}
+}
+
+SMeshDraw LoadMeshDraw(uint Index)
+{
+	SMeshDraw MeshDraw;
+
+	if (bQuantizedDraws)
+	{
+		uint Base = 6 * Index;
+		uint P0 = DrawData[Base + 0];
+		uint P1 = DrawData[Base + 1];
+		uint Cell = DrawData[Base + 2];
+
+		uvec3 Fixed = uvec3(P0 & 0x1FFFFF, (P0 >> 21) | ((P1 & 0x3FF) << 11), (P1 >> 10) & 0x1FFFFF);
+		uvec3 CellCoords = uvec3(Cell & 0x3FF, (Cell >> 10) & 0x3FF, (Cell >> 20) & 0x3FF);
+		MeshDraw.Position = QuantizationGrid.xyz + (vec3(CellCoords) + vec3(Fixed) / 2097151.0) * QuantizationGrid.w;
+
+		int Q0 = int(DrawData[Base + 3]);
+		int Q1 = int(DrawData[Base + 4]);
+		MeshDraw.Orientation = DecodeQuaternion(ivec4(bitfieldExtract(Q0, 0, 16), bitfieldExtract(Q0, 16, 16), bitfieldExtract(Q1, 0, 16), bitfieldExtract(Q1, 16, 16)));
+
+		uint ScaleMesh = DrawData[Base + 5];
+		MeshDraw.Scale = unpackHalf2x16(ScaleMesh).x;
+		MeshDraw.MeshIndex = ScaleMesh >> 16;
+	}
+	else
+	{
+		uint Base = 8 * Index;
+		MeshDraw.Position = uintBitsToFloat(uvec3(DrawData[Base + 0], DrawData[Base + 1], DrawData[Base + 2]));
+		MeshDraw.Scale = uintBitsToFloat(DrawData[Base + 3]);
+
+		// Quaternion xyz with w >= 0
+		vec3 Q = uintBitsToFloat(uvec3(DrawData[Base + 4], DrawData[Base + 5], DrawData[Base + 6]));
+		MeshDraw.Orientation = vec4(Q, sqrt(max(0.0, 1.0 - dot(Q, Q))));
+		MeshDraw.MeshIndex = DrawData[Base + 7];
+	}
+
+	return MeshDraw;
+}
+
+// World space bounding sphere, xyz = center, w = radius. MeshSphere is the local sphere from the mesh table
+vec4 GetBoundingSphere(SMeshDraw MeshDraw, vec4 MeshSphere)
+{
+	vec3 Center = MeshDraw.Position + RotateQuaternion(MeshDraw.Scale * MeshSphere.xyz, MeshDraw.Orientation);
+	float Radius = MeshDraw.Scale * MeshSphere.w;
+
+	return vec4(Center, Radius);
+}
+
+#ifdef DRAW_UPDATE
+// Same 16 bit smallest three as the CPU EncodeQuaternion
+ivec4 EncodeQuaternion(vec4 Q)
+{
+	vec4 A = abs(Q);
+	int MaxComponent = (A.x > A.y) ? 0 : 1;
+	MaxComponent = (A.z > A[MaxComponent]) ? 2 : MaxComponent;
+	MaxComponent = (A.w > A[MaxComponent]) ? 3 : MaxComponent;
+
+	float Scale = (Q[MaxComponent] < 0.0) ? -sqrt(2.0) : sqrt(2.0);
+	vec3 V = vec3(Q[(MaxComponent + 1) & 3], Q[(MaxComponent + 2) & 3], Q[(MaxComponent + 3) & 3]) * Scale;
+
+	return ivec4(ivec3(round(clamp(V, -1.0, 1.0) * 32767.0)), (32767 & ~3) | MaxComponent);
+}
+
+// Inverse of LoadMeshDraw. The host fits QuantizationGrid over everywhere a draw can move, so the clamps only catch rounding
+void StoreMeshDraw(uint Index, SMeshDraw MeshDraw)
+{
+	if (bQuantizedDraws)
+	{
+		uint Base = 6 * Index;
+
+		vec3 GridPosition = (MeshDraw.Position - QuantizationGrid.xyz) / QuantizationGrid.w;
+		uvec3 CellCoords = uvec3(clamp(ivec3(floor(GridPosition)), ivec3(0), ivec3(1023)));
+		uvec3 Fixed = uvec3(clamp(GridPosition - vec3(CellCoords), 0.0, 1.0) * 2097151.0 + 0.5);
+		DrawData[Base + 0] = Fixed.x | (Fixed.y << 21);
+		DrawData[Base + 1] = (Fixed.y >> 11) | (Fixed.z << 10);
+		DrawData[Base + 2] = CellCoords.x | (CellCoords.y << 10) | (CellCoords.z << 20);
+
+		uvec4 Q = uvec4(EncodeQuaternion(MeshDraw.Orientation)) & 0xFFFFu;
+		DrawData[Base + 3] = Q.x | (Q.y << 16);
+		DrawData[Base + 4] = Q.z | (Q.w << 16);
+		DrawData[Base + 5] = packHalf2x16(vec2(MeshDraw.Scale, 0.0)) | (MeshDraw.MeshIndex << 16);
+	}
+	else
+	{
+		uint Base = 8 * Index;
+		vec4 Q = (MeshDraw.Orientation.w < 0.0) ? -MeshDraw.Orientation : MeshDraw.Orientation;
+
+		DrawData[Base + 0] = floatBitsToUint(MeshDraw.Position.x);
+		DrawData[Base + 1] = floatBitsToUint(MeshDraw.Position.y);
+		DrawData[Base + 2] = floatBitsToUint(MeshDraw.Position.z);
+		DrawData[Base + 3] = floatBitsToUint(MeshDraw.Scale);
+		DrawData[Base + 4] = floatBitsToUint(Q.x);
+		DrawData[Base + 5] = floatBitsToUint(Q.y);
+		DrawData[Base + 6] = floatBitsToUint(Q.z);
+		DrawData[Base + 7] = MeshDraw.MeshIndex;
+	}
+}
+#endif
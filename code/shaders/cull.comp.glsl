@@ -1,71 +1,26 @@
 #version 460
 
-layout (push_constant) uniform PushConstants
-{
-	uint bLodEnabled;
-	uint LodsCount;
-
-	uint bOcclusionCullingEnabled;
-	uint ImageWidth;
-	uint ImageHeight;
-};
-
-layout (set = 0, binding = 0) uniform CameraBuffer
-{
-	mat4 View;
-	mat4 Proj;
-
-	mat4 PrevView;
-	mat4 PrevProj;
-
-	vec4 CameraPosition; // w = Near
-	vec4 Frustum[6];
-};
+#extension GL_GOOGLE_include_directive : require
 
-struct SMeshDraw
-{
-	vec3 SphereCenter;
-	float SphereRadius;
-
-	vec3 Position;
-	float Scale;
-	vec4 Orientation;
-
-	uint IndexCount[7];
-	uint FirstIndex[7];
-	uint VertexOffset;
-	uint FirstInstance;
-};
-
-struct SMeshDrawCommand
-{
-	uint IndexCount;
-    uint InstanceCount;
-    uint FirstIndex;
-    uint VertexOffset;
-    uint FirstInstance;
-};
-
-layout (set = 1, binding = 0) readonly buffer Draws
-{
-	SMeshDraw Draw[];
-};
+// Draw command allocation: 0 - one atomic per visible draw, 1 - one atomic per workgroup, 2 - one atomic per subgroup.
+// Bucket slots take one atomic per distinct bucket of the subgroup with 2 and of the workgroup otherwise
+#ifndef COMPACTION
+#define COMPACTION 2
+#endif
 
-layout (set = 1, binding = 1) writeonly buffer DrawCommands
-{
-	SMeshDrawCommand DrawCommand[];
-};
+#if COMPACTION == 2
+#extension GL_KHR_shader_subgroup_basic : require
+#extension GL_KHR_shader_subgroup_ballot : require
+#endif
 
-layout (set = 1, binding = 2) buffer DrawCounter
-{
-	uint DrawCount;
-};
+#include "common.h"
+#include "cull.h"
 
 layout (set = 2, binding = 0) uniform sampler2D HiDepthTexture;
 
 vec3 ProjectPoint(vec3 Point)
 {
-	vec4 V = PrevProj * vec4(Point, 1.0);
+	vec4 V = Proj * vec4(Point, 1.0);
 	return V.xyz / V.w;
 }
 
@@ -103,23 +58,41 @@ bool ProjectSphere(vec3 Center, float Radius, float Near, out vec4 AABB)
 	return true;
 }
 
-layout (local_size_x = 32, local_size_y = 1, local_size_z = 1) in;
-void main()
+// Returns true if the draw has to be emitted in the current pass. Stat is the late pass outcome counter of the draw, ~0 if it wasn't tested.
+// MeshIndex is returned too, so the caller doesn't decode the draw again
+bool CullDraw(uint Index, out uint MeshIndex, out int LodIndex, out uint DepthBin, out uint Stat)
 {
-	uint Index = gl_GlobalInvocationID.x;
+	MeshIndex = 0;
+	LodIndex = 0;
+	DepthBin = 0;
+	Stat = ~0u;
+
+	uint VisibilityMask = 1u << (Index & 31);
+	bool bWasVisible = (Visibility[Index >> 5] & VisibilityMask) != 0;
 
-	float Scale = Draw[Index].Scale ;
-	vec4 Center = vec4(Draw[Index].Position + Scale * Draw[Index].SphereCenter, -1);
-	float Radius = Scale * Draw[Index].SphereRadius;
+	// Early pass draws only what was visible last frame, everything else waits for the depth pyramid built from it
+	if ((bLatePass == 0) && !bWasVisible)
+		return false;
+
+	SMeshDraw MeshDraw = LoadMeshDraw(Index);
+	MeshIndex = MeshDraw.MeshIndex;
+	if (MeshIndex == DeadMeshIndex)
+		return false;
+
+	vec4 Sphere = GetBoundingSphere(MeshDraw, vec4(Meshes[MeshDraw.MeshIndex].SphereCenter, Meshes[MeshDraw.MeshIndex].SphereRadius));
+	vec4 Center = vec4(Sphere.xyz, -1);
+	float Radius = Sphere.w;
 
 	bool bVisible = true;
 	for (uint I = 0; I < 6; I++)
 		bVisible = bVisible && (dot(Center, Frustum[I]) >= -Radius);
 
-	if (bVisible && (bOcclusionCullingEnabled != 0))
+	Stat = bVisible ? CULL_STAT_VISIBLE_DRAWS : CULL_STAT_FRUSTUM_CULLED_DRAWS;
+
+	if (bVisible && (bLatePass != 0) && (bOcclusionCullingEnabled != 0))
 	{
 		float Near = CameraPosition.w;
-		vec4 CenterCameraSpace = PrevView * vec4(Center.xyz, 1.0);
+		vec4 CenterCameraSpace = View * vec4(Center.xyz, 1.0);
 
 		vec4 AABB;
 		if (ProjectSphere(CenterCameraSpace.xyz, Radius, Near, AABB))
@@ -131,27 +104,210 @@ void main()
 			// This computes max depth of 2x2 texel quad
 			float MaxDepth = textureLod(HiDepthTexture, 0.5*(AABB.xy + AABB.zw), Level).x;
 
-			vec4 MinObjectCameraSpace = PrevView * vec4(Center.xy, Center.z + Radius, 1.0);
+			vec4 MinObjectCameraSpace = View * vec4(Center.xy, Center.z + Radius, 1.0);
 			float MinObjectDepth = ProjectPoint(MinObjectCameraSpace.xyz).z;
 
 			// Some objects cull themselves, mb because of some precision issues, so I add this bias
-			float Bias = 0.0001;
-			bVisible = bVisible && (MinObjectDepth < MaxDepth + Bias);
+			bVisible = bVisible && (MinObjectDepth < MaxDepth + OcclusionBias);
+			Stat = bVisible ? CULL_STAT_VISIBLE_DRAWS : CULL_STAT_OCCLUSION_CULLED_DRAWS;
 		}
 	}
 
-	if (bVisible)
+	if (bLatePass == 0)
+		Stat = ~0u;
+
+	if ((bLatePass != 0) && (bVisible != bWasVisible))
 	{
-		uint CommandIndex = atomicAdd(DrawCount, 1);
+		if (bVisible)
+			atomicOr(Visibility[Index >> 5], VisibilityMask);
+		else
+			atomicAnd(Visibility[Index >> 5], ~VisibilityMask);
+	}
+
+	float Distance = length(Center.xyz - CameraPosition.xyz) - Radius;
+	float LodDistance = log2(max(Distance, 1.0));
+	LodIndex = bLodEnabled > 0 ? clamp(int(LodDistance) - 1, 0, int(LodsCount) - 1) : 0;
+
+	// Depth bins are half an octave of view depth wide, so near objects get finer ordering
+	float ViewDepth = -(View * vec4(Center.xyz, 1.0)).z;
+	DepthBin = min(uint(2.0 * log2(max(ViewDepth, 1.0))), DepthBinsCount - 1);
 
-		float Distance = length(Center.xyz - CameraPosition.xyz) - Radius;
-		float LodDistance = log2(max(Distance, 1.0));
-		int LodIndex = bLodEnabled > 0 ? clamp(int(LodDistance) - 1, 0, int(LodsCount) - 1) : 0;
+	// Objects drawn in the early pass are already in the depth buffer, late pass adds only the newly visible ones
+	return bVisible && ((bLatePass == 0) || !bWasVisible);
+}
+
+// Must be called from uniform control flow, every invocation of the workgroup takes part
+#if COMPACTION == 2
+uint AllocateVisibleDraw(bool bEmit)
+{
+	uvec4 Ballot = subgroupBallot(bEmit);
+	uint EmitCount = subgroupBallotBitCount(Ballot);
+
+	uint Base = 0;
+	if (subgroupElect() && (EmitCount > 0))
+		Base = atomicAdd(DrawCount[bLatePass], EmitCount);
+
+	return subgroupBroadcastFirst(Base) + subgroupBallotExclusiveBitCount(Ballot);
+}
+
+// Invocations with the same bucket share one atomic, loop runs once per distinct bucket in the subgroup
+uint AllocateBucketSlot(bool bEmit, uint Bucket)
+{
+	if (!bEmit)
+		return 0;
+
+	for (;;)
+	{
+		if (subgroupBroadcastFirst(Bucket) == Bucket)
+		{
+			uvec4 Ballot = subgroupBallot(true);
+
+			uint Base = 0;
+			if (subgroupElect())
+				Base = atomicAdd(Buckets[Bucket].InstanceCount, subgroupBallotBitCount(Ballot));
+
+			return subgroupBroadcastFirst(Base) + subgroupBallotExclusiveBitCount(Ballot);
+		}
+	}
+	return 0;
+}
+#elif COMPACTION == 1
+shared uint WorkgroupEmitCount;
+shared uint WorkgroupBase;
+
+uint AllocateVisibleDraw(bool bEmit)
+{
+	if (gl_LocalInvocationIndex == 0)
+		WorkgroupEmitCount = 0;
+	barrier();
 
-		DrawCommand[CommandIndex].IndexCount = Draw[Index].IndexCount[LodIndex];
-		DrawCommand[CommandIndex].InstanceCount = 1;
-		DrawCommand[CommandIndex].FirstIndex = Draw[Index].FirstIndex[LodIndex];
-		DrawCommand[CommandIndex].VertexOffset = Draw[Index].VertexOffset;
-		DrawCommand[CommandIndex].FirstInstance = Draw[Index].FirstInstance;
+	uint LocalIndex = bEmit ? atomicAdd(WorkgroupEmitCount, 1) : 0;
+	barrier();
+
+	if ((gl_LocalInvocationIndex == 0) && (WorkgroupEmitCount > 0))
+		WorkgroupBase = atomicAdd(DrawCount[bLatePass], WorkgroupEmitCount);
+	barrier();
+
+	return WorkgroupBase + LocalIndex;
+}
+#else
+uint AllocateVisibleDraw(bool bEmit)
+{
+	return bEmit ? atomicAdd(DrawCount[bLatePass], 1) : 0;
+}
+#endif
+
+#if COMPACTION != 2
+// Open addressing table of the buckets emitted by the workgroup, there are never more distinct buckets than invocations
+const uint EmptyBucket = 0xFFFFFFFF;
+shared uint WorkgroupBucketKeys[gl_WorkGroupSize.x];
+shared uint WorkgroupBucketCounts[gl_WorkGroupSize.x];
+
+// Must be called from uniform control flow. Invocations with the same bucket count in one table entry, then the first of them
+// adds the whole entry to the bucket, so there is one global atomic per distinct bucket of the workgroup
+uint AllocateBucketSlot(bool bEmit, uint Bucket)
+{
+	barrier();
+	WorkgroupBucketKeys[gl_LocalInvocationIndex] = EmptyBucket;
+	WorkgroupBucketCounts[gl_LocalInvocationIndex] = 0;
+	barrier();
+
+	uint Entry = Bucket % gl_WorkGroupSize.x;
+	uint LocalIndex = 0;
+	if (bEmit)
+	{
+		for (;;)
+		{
+			uint Key = atomicCompSwap(WorkgroupBucketKeys[Entry], EmptyBucket, Bucket);
+			if ((Key == EmptyBucket) || (Key == Bucket))
+				break;
+			Entry = (Entry + 1) % gl_WorkGroupSize.x;
+		}
+		LocalIndex = atomicAdd(WorkgroupBucketCounts[Entry], 1);
+	}
+	barrier();
+
+	if (bEmit && (LocalIndex == 0))
+		WorkgroupBucketCounts[Entry] = atomicAdd(Buckets[Bucket].InstanceCount, WorkgroupBucketCounts[Entry]);
+	barrier();
+
+	return bEmit ? WorkgroupBucketCounts[Entry] + LocalIndex : 0;
+}
+#endif
+
+shared uint WorkgroupCullStats[CULL_STATS_COUNT];
+
+// One workgroup per cell that survived the cell pass, the width is tuned per device through constant_id 3
+layout (local_size_x = 32, local_size_y = 1, local_size_z = 1, local_size_x_id = 3) in;
+void main()
+{
+	// The last row of the dispatch is partially filled, the whole workgroup leaves together
+	uint CellSlot = gl_WorkGroupID.y * MaxCellDispatchX + gl_WorkGroupID.x;
+	if (CellSlot >= VisibleCellCount)
+		return;
+
+	uint CellIndex = VisibleCells[CellSlot];
+	uint FirstDraw = Cells[CellIndex].FirstDraw;
+	uint CellDrawCount = Cells[CellIndex].DrawCount;
+
+	// Counters are summed in shared memory first, so the stats cost one atomic per counter and workgroup
+	if (bCullStats)
+	{
+		if (gl_LocalInvocationIndex < CULL_STATS_COUNT)
+			WorkgroupCullStats[gl_LocalInvocationIndex] = 0;
+		barrier();
+	}
+
+	// Loop bounds are the same for the whole workgroup, so the compaction always sees every invocation
+	for (uint Base = 0; Base < CellDrawCount; Base += gl_WorkGroupSize.x)
+	{
+		uint Index = FirstDraw + Base + gl_LocalInvocationID.x;
+
+		uint MeshIndex = 0;
+		int LodIndex = 0;
+		uint DepthBin = 0;
+		uint Stat = ~0u;
+		bool bEmit = (Base + gl_LocalInvocationID.x < CellDrawCount) && CullDraw(Index, MeshIndex, LodIndex, DepthBin, Stat);
+
+		if (bCullStats && (Stat != ~0u))
+		{
+			atomicAdd(WorkgroupCullStats[CULL_STAT_TESTED_DRAWS], 1);
+			atomicAdd(WorkgroupCullStats[Stat], 1);
+		}
+
+		uint VisibleIndex = bLatePass * ObjectsCount + AllocateVisibleDraw(bEmit);
+
+		uint Key = 0;
+		if (bEmit)
+		{
+			Key = DepthBin * BucketsCount + MeshIndex * LodsCount + uint(LodIndex);
+
+			if (bCullStats)
+			{
+				atomicAdd(WorkgroupCullStats[CULL_STAT_EMITTED_LOD_DRAWS + LodIndex], 1);
+				atomicAdd(WorkgroupCullStats[CULL_STAT_EMITTED_TRIANGLES], Meshes[MeshIndex].IndexCount[LodIndex] / 3);
+			}
+
+			VisibleDraws[VisibleIndex].DrawIndex = Index;
+			VisibleDraws[VisibleIndex].Key = Key;
+		}
+
+		uint Slot = AllocateBucketSlot(bEmit, bLatePass * BucketsCount * DepthBinsCount + Key);
+		if (bEmit)
+			VisibleDraws[VisibleIndex].Slot = Slot;
+	}
+
+	if (bCullStats)
+	{
+		barrier();
+		if ((gl_LocalInvocationIndex < CULL_STATS_COUNT) && (WorkgroupCullStats[gl_LocalInvocationIndex] > 0))
+		{
+			uint Value = WorkgroupCullStats[gl_LocalInvocationIndex];
+			uint Previous = atomicAdd(CullStats[gl_LocalInvocationIndex], Value);
+
+			// Every add that wraps the low half of the triangle counter carries exactly one into the high half
+			if ((gl_LocalInvocationIndex == CULL_STAT_EMITTED_TRIANGLES) && (Previous + Value < Previous))
+				atomicAdd(CullStats[CULL_STAT_EMITTED_TRIANGLES + 1], 1);
+		}
 	}
 }
\ No newline at end of file
@@ -0,0 +1,195 @@
+layout (push_constant) uniform PushConstants
+{
+	uint bLodEnabled;
+	uint LodsCount;
+
+	uint bOcclusionCullingEnabled;
+	uint ImageWidth;
+	uint ImageHeight;
+
+	uint bLatePass;
+	uint ObjectsCount;
+	uint CellsCount;
+	uint BucketsCount;
+	uint DepthBinsCount; // 1 when depth sorting is off
+
+	float DeltaTime;
+
+	uint NodeFirst; // Transform hierarchy level processed by the current dispatch
+	uint NodeCount;
+
+	float OcclusionBias; // Added to the depth pyramid value before the occlusion test
+};
+
+// One instanced command per non-empty bucket
+layout (set = 1, binding = 1) writeonly buffer DrawCommands
+{
+	SMeshDrawCommand DrawCommand[];
+};
+
+// Visible draws and instanced commands of the early and late pass
+layout (set = 1, binding = 2) buffer DrawCounter
+{
+	uint DrawCount[2];
+	uint CommandCount[2];
+};
+
+// One bit per object, set if the object passed the late pass test last frame
+layout (set = 1, binding = 3) buffer DrawVisibility
+{
+	uint Visibility[];
+};
+
+layout (set = 1, binding = 4) buffer CellList
+{
+	SCell Cells[];
+};
+
+layout (set = 1, binding = 5) buffer VisibleCellList
+{
+	uint VisibleCells[];
+};
+
+// Filled by the cell pass, the first three are the VkDispatchIndirectCommand of the draw passes. Visible cells go in rows of MaxCellDispatchX workgroups,
+// only 65535 are guaranteed in each dimension
+layout (set = 1, binding = 6) buffer CellDispatch
+{
+	uint CellDispatchX;
+	uint CellDispatchY;
+	uint CellDispatchZ;
+	uint VisibleCellCount;
+};
+
+const uint MaxCellDispatchX = 65535;
+
+
+layout (set = 1, binding = 7) readonly buffer MeshList
+{
+	SMesh Meshes[];
+};
+
+// Draw that passed culling, Slot is its place inside the bucket
+struct SVisibleDraw
+{
+	uint DrawIndex;
+	uint Key;
+	uint Slot;
+};
+
+layout (set = 1, binding = 8) buffer VisibleDrawList
+{
+	SVisibleDraw VisibleDraws[];
+};
+
+// Key = DepthBin * BucketsCount + MeshIndex * LodsCount + LodIndex, every pass has BucketsCount * DepthBinsCount buckets.
+// Buckets are drawn in key order, so with depth bins the scene goes roughly front to back. FirstInstance is filled by the prefix pass
+struct SBucket
+{
+	uint InstanceCount;
+	uint FirstInstance;
+};
+
+layout (set = 1, binding = 9) buffer BucketList
+{
+	SBucket Buckets[];
+};
+
+// Draw indices grouped by bucket, the vertex shader reads them with gl_InstanceIndex
+layout (set = 1, binding = 10) writeonly buffer InstanceList
+{
+	uint Instances[];
+};
+
+struct SDispatch
+{
+	uint X;
+	uint Y;
+	uint Z;
+};
+
+// Scatter pass arguments of the early and late pass
+layout (set = 1, binding = 11) buffer ScatterDispatchList
+{
+	SDispatch ScatterDispatch[2];
+};
+
+// Per draw slot motion advanced by the animation pass, all zero for static draws
+struct SMotion
+{
+	vec4 LinearVelocity; // w = orbit speed, radians per second around the vertical axis through OrbitCenter
+	vec4 AngularVelocity; // xyz = rotation axis * radians per second
+	vec4 OrbitCenter;
+};
+
+// Draws changed on the CPU this frame, every update also carries the new live draw count of its cell
+#define MAX_DRAW_UPDATES 65536
+
+struct SDrawUpdate
+{
+	uint DrawIndex;
+	uint CellIndex;
+	uint CellDrawCount;
+	uint Data[8];
+};
+
+// MotionUpdateCount is DrawUpdateCount when the animation pass runs and 0 otherwise, MotionUpdates[I] belongs to DrawUpdates[I]
+layout (set = 1, binding = 12) readonly buffer DrawUpdateList
+{
+	uint DrawUpdateCount;
+	uint DirtyCellCount;
+	uint MotionUpdateCount;
+	uint DrawUpdatePadding;
+	uint DirtyCells[MAX_DRAW_UPDATES];
+	SDrawUpdate DrawUpdates[MAX_DRAW_UPDATES];
+	SMotion MotionUpdates[];
+};
+
+layout (set = 1, binding = 13) buffer MotionList
+{
+	SMotion Motions[];
+};
+
+// Transform hierarchy node, the transform is relative to the parent. Nodes are stored level by level, so a level only reads the one before
+struct SNode
+{
+	vec3 Position;
+	float Scale;
+	vec4 Orientation;
+	uint Parent; // ~0 for roots
+	uint DrawIndex; // Draw slot that follows the node, ~0 for none
+	uint Padding[2];
+};
+
+struct SNodeWorld
+{
+	vec3 Position;
+	float Scale;
+	vec4 Orientation;
+};
+
+layout (set = 1, binding = 14) readonly buffer NodeList
+{
+	SNode Nodes[];
+};
+
+layout (set = 1, binding = 15) buffer NodeWorldList
+{
+	SNodeWorld NodeWorlds[];
+};
+// Culling counters, only written when constant_id 2 is set. Outcome counters cover the late pass, which tests every draw in a visible cell,
+// emitted draws and triangles are what both passes submit
+#define CULL_STAT_EMITTED_TRIANGLES 0 // 64 bit, low half here and the carry in the next counter
+#define CULL_STAT_CELL_CULLED_DRAWS 2
+#define CULL_STAT_TESTED_DRAWS 3
+#define CULL_STAT_FRUSTUM_CULLED_DRAWS 4
+#define CULL_STAT_OCCLUSION_CULLED_DRAWS 5
+#define CULL_STAT_VISIBLE_DRAWS 6
+#define CULL_STAT_EMITTED_LOD_DRAWS 7 // One counter per LOD
+#define CULL_STATS_COUNT 14
+
+layout (constant_id = 2) const bool bCullStats = false;
+
+layout (set = 1, binding = 16) buffer CullStatsBuffer
+{
+	uint CullStats[CULL_STATS_COUNT];
+};
@@ -8,7 +8,8 @@ layout (push_constant) uniform PushConstants
 	vec2 ImageSize;
 };
 
-layout (local_size_x = 32, local_size_y = 32, local_size_z = 1) in;
+// Workgroup size is tuned per device through constant_id 0 and 1, the host dispatches with the same size
+layout (local_size_x = 32, local_size_y = 32, local_size_z = 1, local_size_x_id = 0, local_size_y_id = 1) in;
 void main()
 {
 	uvec2 TexCoordinate = gl_GlobalInvocationID.xy;
@@ -0,0 +1,27 @@
+#version 460
+
+#extension GL_GOOGLE_include_directive : require
+
+#define DRAW_UPDATE
+
+#include "common.h"
+#include "cull.h"
+
+// Copies the draws changed on the CPU into their slots, so a frame uploads only what changed
+layout (local_size_x = 64, local_size_y = 1, local_size_z = 1) in;
+void main()
+{
+	uint UpdateIndex = gl_GlobalInvocationID.x;
+	if (UpdateIndex >= DrawUpdateCount)
+		return;
+
+	uint DrawStride = bQuantizedDraws ? 6 : 8;
+	uint DrawIndex = DrawUpdates[UpdateIndex].DrawIndex;
+	for (uint I = 0; I < DrawStride; I++)
+		DrawData[DrawStride * DrawIndex + I] = DrawUpdates[UpdateIndex].Data[I];
+	if (UpdateIndex < MotionUpdateCount)
+		Motions[DrawIndex] = MotionUpdates[UpdateIndex];
+
+	// Updates of the same cell all carry the same count
+	Cells[DrawUpdates[UpdateIndex].CellIndex].DrawCount = DrawUpdates[UpdateIndex].CellDrawCount;
+}
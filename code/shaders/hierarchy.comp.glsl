@@ -0,0 +1,41 @@
+#version 460
+
+#extension GL_GOOGLE_include_directive : require
+
+#define DRAW_UPDATE
+
+#include "common.h"
+#include "cull.h"
+
+// Concatenates one hierarchy level with the world transforms of the previous one and moves the attached draws
+layout (local_size_x = 64, local_size_y = 1, local_size_z = 1) in;
+void main()
+{
+	if (gl_GlobalInvocationID.x >= NodeCount)
+		return;
+
+	uint NodeIndex = NodeFirst + gl_GlobalInvocationID.x;
+	SNode Node = Nodes[NodeIndex];
+
+	SNodeWorld World;
+	World.Position = Node.Position;
+	World.Scale = Node.Scale;
+	World.Orientation = Node.Orientation;
+	if (Node.Parent != ~0u)
+	{
+		SNodeWorld Parent = NodeWorlds[Node.Parent];
+		World.Position = Parent.Position + RotateQuaternion(Parent.Scale * Node.Position, Parent.Orientation);
+		World.Scale = Parent.Scale * Node.Scale;
+		World.Orientation = normalize(MultiplyQuaternion(Parent.Orientation, Node.Orientation));
+	}
+	NodeWorlds[NodeIndex] = World;
+
+	if (Node.DrawIndex != ~0u)
+	{
+		SMeshDraw MeshDraw = LoadMeshDraw(Node.DrawIndex);
+		MeshDraw.Position = World.Position;
+		MeshDraw.Scale = World.Scale;
+		MeshDraw.Orientation = World.Orientation;
+		StoreMeshDraw(Node.DrawIndex, MeshDraw);
+	}
+}